@@ -26,6 +26,7 @@
 #include <cstdlib>
 #include <iostream>
 #include <vector>
+#include <mutex>
 #include "render_object.h"
 #include "physics.h"
 
@@ -74,6 +75,8 @@ class BlockDescriptor : public enable_shared_from_this<BlockDescriptor>
 private:
     static map<wstring, BlockDescriptorPtr> *blocks;
     static vector<BlockDescriptorPtr> *blocksList;
+    mutable once_flag collisionShapeFlag;
+    mutable CollisionShape collisionShape;
 protected:
     static void initBlock(BlockDescriptorPtr bd) /// call with all constructed BlockDescriptor daughter classes
     {
@@ -152,8 +155,64 @@ public:
     {
         return getPhysicsObjectConstructor()->make((PositionF)pos, VectorF(0), physicsWorld);
     }
+    /// the shape of every block of this kind, relative to the block's center
+    const CollisionShape & getCollisionShape() const
+    {
+        call_once(collisionShapeFlag, [this]()
+        {
+            collisionShape = getPhysicsObjectConstructor()->shape;
+        });
+        return collisionShape;
+    }
 };
 
+/// the collision shape of the block at bi. blocks that aren't generated yet are solid
+inline const CollisionShape & getBlockCollisionShape(BlockIterator & bi)
+{
+    BlockData block = bi.get();
+    if(!block.good())
+        return CollisionShape::solidBlock();
+    return block.desc->getCollisionShape();
+}
+
+/// calls fn(position, center, shape) for every block in bi.position() + [minOffset, maxOffset] that has a shape
+template <typename Fn>
+void forEachBlockCollisionShape(BlockIterator bi, VectorI minOffset, VectorI maxOffset, Fn fn)
+{
+    for(int dx = minOffset.x; dx <= maxOffset.x; dx++)
+    {
+        for(int dy = minOffset.y; dy <= maxOffset.y; dy++)
+        {
+            for(int dz = minOffset.z; dz <= maxOffset.z; dz++)
+            {
+                BlockIterator curBI = bi;
+                curBI += VectorI(dx, dy, dz);
+                const CollisionShape & shape = getBlockCollisionShape(curBI);
+                if(shape.empty())
+                    continue;
+                fn(curBI.position(), (VectorI)curBI.position() + VectorF(0.5), shape);
+            }
+        }
+    }
+}
+
+/// pushes object out of the blocks in bi.position() + [minOffset, maxOffset] and
+/// marks it supported if it's standing on one of them
+inline void collideWithBlocks(PhysicsObject & object, BlockIterator bi, VectorI minOffset, VectorI maxOffset)
+{
+    bool supported = false;
+    object.setupNewState();
+    forEachBlockCollisionShape(bi, minOffset, maxOffset, [&](PositionI position, VectorF center, const CollisionShape & shape)
+    {
+        PositionF shapePosition(center, position.d);
+        if(object.collides(shape, shapePosition))
+            object.adjustPosition(shape, shapePosition);
+        if(object.isSupportedBy(shape, shapePosition))
+            supported = true;
+    });
+    object.applyNewState(supported);
+}
+
 struct BlockDescriptors_t final
 {
     BlockDescriptorPtr get(wstring name) const
@@ -22,6 +22,7 @@
 #include "position.h"
 #include <memory>
 #include <array>
+#include <atomic>
 
 using namespace std;
 
@@ -123,8 +124,10 @@ struct Chunk
     weak_ptr<Chunk> nz;
     weak_ptr<Chunk> pz;
     array<array<array<BlockData, ChunkSize>, ChunkHeight>, ChunkSize> blocks;
+    /// goes up every time a block in this chunk is set
+    atomic_uint_fast64_t changeCount;
     Chunk(ChunkPosition pos)
-        : pos(pos)
+        : pos(pos), changeCount(0)
     {
     }
 };
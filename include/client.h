@@ -37,10 +37,13 @@ public:
     enum class DataType
     {
         Image, // Image::ImageData
+        ImageHashSet, // unordered_set<uint64_t>
+        ImageRequestList, // vector<Client::IdType>
         RenderObjectBlockMesh, // RenderObjectBlockMesh
         RenderObjectEntityMesh, // RenderObjectEntityMesh
         RenderObjectEntity, // RenderObjectEntity
         RenderObjectEntitySet, // set<RenderObjectEntity>
+        RenderObjectEntityReplicatedStates, // RenderObjectEntity::ReplicatedStateMap
         RenderObjectWorld, // RenderObjectWorld
         ServerFlag, // flag
         UpdateList, // UpdateList
@@ -50,6 +53,7 @@ public:
         Double, // double
         Float, // float
         Player, // EntityData
+        WakeFunction, // function<void()>
         Last
     };
     typedef uint_fast64_t IdType;
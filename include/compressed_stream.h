@@ -19,6 +19,8 @@
 #define COMPRESSED_STREAM_H_INCLUDED
 
 #include <deque>
+#include <vector>
+#include <chrono>
 #include "stream.h"
 #include <iostream>
 
@@ -76,12 +78,20 @@ struct LZ77CodeType final
 
         return retval;
     }
+    static constexpr size_t byteCount = 3;
+    void write(uint8_t * bytes) const
+    {
+        uint16_t v = (offset & maxOffset) | (length << offsetBits);
+        bytes[0] = nextByte;
+        bytes[1] = (uint8_t)(v >> 8);
+        bytes[2] = (uint8_t)(v & 0xFF);
+    }
     void write(Writer &writer)
     {
         //cout << "Write code : 0x" << hex << (unsigned)nextByte << dec << " : length : " << length << " : offset : " << offset << endl;
-        writer.writeByte(nextByte);
-        uint16_t v = (offset & maxOffset) | (length << offsetBits);
-        writer.writeU16(v);
+        uint8_t bytes[byteCount];
+        write(bytes);
+        writer.writeBytes(bytes, byteCount);
     }
 };
 
@@ -144,141 +154,206 @@ public:
     }
 };
 
+/// LZ77 compressor using hash chains with bounded depth and one step of lazy matching.
+/// input is compressed a block at a time and the codes for a block are written with one call
 class CompressWriter final : public Writer
 {
 private:
-    static constexpr int uint8_max = (1 << 8) - 1;
-    static constexpr size_t bufferSize = LZ77CodeType::maxOffset + 1;
+    static constexpr size_t windowSize = LZ77CodeType::maxOffset + 1;
+    static constexpr size_t blockSize = 1 << 16;
+    static constexpr size_t hashBits = 12, hashSize = 1 << hashBits;
+    static constexpr size_t chainSize = windowSize * 2; // room for the lookahead used by lazy matching
+    static constexpr size_t maxChainDepth = 32;
+    static constexpr uint64_t noPosition = ~(uint64_t)0;
+    static_assert((chainSize & (chainSize - 1)) == 0, "chainSize is not a power of 2");
     struct Match
     {
-        size_t location, length;
-        Match(size_t location, size_t length)
-            : location(location), length(length)
+        size_t length;
+        uint64_t location;
+        Match(size_t length = 0, uint64_t location = noPosition)
+            : length(length), location(location)
+        {
+        }
+    };
+    struct MatchTable
+    {
+        vector<uint64_t> heads, chain;
+        MatchTable(size_t headCount)
+            : heads(headCount, noPosition), chain(chainSize, noPosition)
+        {
+        }
+        void insert(size_t key, uint64_t pos)
         {
+            chain[(size_t)pos & (chainSize - 1)] = heads[key];
+            heads[key] = pos;
         }
-        Match()
-            : Match(0, 0)
+        uint64_t next(uint64_t pos) const
         {
+            uint64_t retval = chain[(size_t)pos & (chainSize - 1)];
+            if(retval >= pos) // overwritten
+                return noPosition;
+            return retval;
+        }
+        /// returns the most recent position before pos with the same key
+        uint64_t firstBefore(size_t key, uint64_t pos) const
+        {
+            uint64_t retval = heads[key];
+            while(retval != noPosition && retval >= pos)
+                retval = next(retval);
+            return retval;
         }
     };
 
-    size_t location;
-    size_t getActualLocation(size_t l)
+    shared_ptr<Writer> writer;
+    vector<uint8_t> data; // the last windowSize bytes already written followed by the pending input
+    uint64_t dataStart; // stream position of data[0]
+    size_t processedSize; // bytes in data that have been written as codes
+    uint64_t hashedEnd; // stream position of the first byte not inserted into the match tables
+    MatchTable table3, table2, table1;
+    vector<uint8_t> output;
+
+    static size_t hash3(const uint8_t * p)
     {
-        return location - l;
+        uint32_t v = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+        return (size_t)((v * 2654435761U) >> (32 - hashBits));
+    }
+    static size_t hash2(const uint8_t * p)
+    {
+        return ((size_t)p[0] << 8) | p[1];
+    }
+    const uint8_t * at(uint64_t pos) const
+    {
+        return &data[(size_t)(pos - dataStart)];
+    }
+    uint64_t endPosition() const
+    {
+        return dataStart + data.size();
     }
 
-    shared_ptr<Writer> writer;
-    circularDeque<uint_fast8_t, bufferSize + 1> currentInput;
-    circularDeque<uint_fast8_t, bufferSize + 2> buffer;
-    list<size_t> nodes[uint8_max + 1];
-
-    void addByte(uint_fast8_t v)
+    void insertUpTo(uint64_t pos)
     {
-        nodes[v].push_front(++location);
-        buffer.push_front(v);
-        if(buffer.size() > bufferSize)
+        if(pos + 2 > endPosition())
+            pos = (endPosition() >= 2 ? endPosition() - 2 : 0);
+        for(; hashedEnd < pos; hashedEnd++)
         {
-            buffer.pop_back();
-            for(list<size_t> & nodeList : nodes)
-            {
-                for(auto i = nodeList.begin(); i != nodeList.end();)
-                {
-                    if(getActualLocation(*i) >= buffer.size())
-                        i = nodeList.erase(i);
-                    else
-                        i++;
-                }
-            }
+            const uint8_t * p = at(hashedEnd);
+            table3.insert(hash3(p), hashedEnd);
+            table2.insert(hash2(p), hashedEnd);
+            table1.insert(p[0], hashedEnd);
         }
     }
 
-    /*void dumpLocation(size_t l)
+    size_t matchLength(uint64_t candidate, uint64_t pos, size_t maxLength) const
     {
-        cout << l << " : ";
-        l = getActualLocation(l);
-        if(l >= buffer.size())
-            cout << "\"\"" << endl;
-        else
-        {
-            cout << "\"";
-            auto iter = buffer.cbegin() + l;
-            for(int i = 0; i < 5 && i <= l; i++, iter--)
-            {
-                cout << (char)*iter;
-            }
-            cout << "\"" << endl;
-        }
-    }*/
+        const uint8_t * a = at(candidate), * b = at(pos);
+        size_t retval = 0;
+        while(retval < maxLength && a[retval] == b[retval])
+            retval++;
+        return retval;
+    }
 
-    Match getBiggestMatch()
+    static bool inWindow(uint64_t candidate, uint64_t pos)
     {
-        Match retval;
-        auto ii = currentInput.cbegin();
-        if(ii == currentInput.cend())
-            return Match();
-        const list<size_t> & curNodes = nodes[*ii++];
-        if(curNodes.empty())
+        return candidate != noPosition && candidate < pos && pos - candidate <= windowSize;
+    }
+
+    Match findMatch(uint64_t pos)
+    {
+        insertUpTo(pos);
+        size_t left = (size_t)(endPosition() - pos);
+        if(left <= 1)
             return Match();
-        auto startII = ii;
-        for(size_t startPos : curNodes)
+        size_t maxLength = left - 1; // leave room for the next byte
+        if(maxLength > LZ77CodeType::maxLength)
+            maxLength = LZ77CodeType::maxLength;
+        Match retval;
+        const uint8_t * p = at(pos);
+        if(maxLength >= 3)
         {
-            size_t matchLength = 1;
-            size_t node = startPos;
-            for(ii = startII; ii != currentInput.cend(); matchLength++, ii++, node++)
+            uint64_t candidate = table3.firstBefore(hash3(p), pos);
+            for(size_t depth = 0; depth < maxChainDepth && inWindow(candidate, pos); depth++)
             {
-                size_t pos = getActualLocation(node + 1);
-                if(pos >= buffer.size())
-                    break;
-                if(buffer.cbegin()[pos] != *ii)
-                    break;
+                size_t length = matchLength(candidate, pos, maxLength);
+                if(length > retval.length)
+                {
+                    retval = Match(length, candidate);
+                    if(length >= maxLength)
+                        return retval;
+                }
+                candidate = table3.next(candidate);
             }
-            if(matchLength > retval.length)
+        }
+        if(retval.length < 2 && maxLength >= 2)
+        {
+            uint64_t candidate = table2.firstBefore(hash2(p), pos);
+            if(inWindow(candidate, pos))
             {
-                retval.length = matchLength;
-                retval.location = getActualLocation(startPos);
+                size_t length = matchLength(candidate, pos, maxLength);
+                if(length > retval.length)
+                    retval = Match(length, candidate);
             }
         }
-        if(retval.length > LZ77CodeType::maxLength + 1)
-            retval.length = LZ77CodeType::maxLength + 1;
+        if(retval.length < 1)
+        {
+            uint64_t candidate = table1.firstBefore(p[0], pos);
+            if(inWindow(candidate, pos))
+                retval = Match(1, candidate);
+        }
         return retval;
     }
 
-    void writeCode()
+    void emit(uint64_t pos, const Match &m)
     {
-        if(currentInput.empty())
-            return;
-        if(currentInput.size() == 1)
-        {
-            addByte(currentInput.front());
-            LZ77CodeType(currentInput.front()).write(*writer);
-            currentInput.pop_front();
-            return;
-        }
-        Match m = getBiggestMatch();
-        if(m.length <= 1)
+        LZ77CodeType code(*at(pos + m.length));
+        if(m.length > 0)
+            code = LZ77CodeType(m.length, (size_t)(pos - m.location - 1), *at(pos + m.length));
+        size_t outputSize = output.size();
+        output.resize(outputSize + LZ77CodeType::byteCount);
+        code.write(&output[outputSize]);
+    }
+
+    void compressBlock()
+    {
+        uint64_t pos = dataStart + processedSize;
+        Match current = findMatch(pos);
+        while(pos < endPosition())
         {
-            addByte(currentInput.front());
-            LZ77CodeType(currentInput.front()).write(*writer);
-            currentInput.pop_front();
-            return;
+            uint64_t nextPos = pos + current.length + 1;
+            Match next = (nextPos < endPosition() ? findMatch(nextPos) : Match());
+            if(current.length > 0 && pos + 1 < endPosition())
+            {
+                // lazy matching : a literal followed by the match at pos + 1 may cover more
+                Match lazy = findMatch(pos + 1);
+                if(1 + lazy.length + 1 > current.length + 1 + next.length + 1)
+                {
+                    emit(pos, Match());
+                    pos++;
+                    current = lazy;
+                    continue;
+                }
+            }
+            emit(pos, current);
+            pos = nextPos;
+            current = next;
         }
-        m.length--;
-        for(size_t i = 0; i < m.length; i++)
+        processedSize = data.size();
+        writer->writeBytes(output.data(), output.size());
+        output.clear();
+        if(data.size() > windowSize)
         {
-            addByte(currentInput.front());
-            currentInput.pop_front();
+            size_t removeCount = data.size() - windowSize;
+            data.erase(data.begin(), data.begin() + removeCount);
+            dataStart += removeCount;
+            processedSize = data.size();
         }
-        LZ77CodeType code(m.length, m.location, currentInput.front());
-        code.write(*writer);
-        addByte(currentInput.front());
-        currentInput.pop_front();
     }
 
 public:
     CompressWriter(shared_ptr<Writer> writer)
-        : writer(writer)
+        : writer(writer), dataStart(0), processedSize(0), hashedEnd(0), table3(hashSize), table2(1 << 16), table1(1 << 8)
     {
+        data.reserve(windowSize + blockSize);
+        output.reserve((blockSize + 1) * LZ77CodeType::byteCount);
     }
     CompressWriter(Writer &writer)
         : CompressWriter(shared_ptr<Writer>(&writer, [](Writer *) {}))
@@ -289,16 +364,162 @@ public:
     }
     virtual void flush() override
     {
-        while(!currentInput.empty())
-            writeCode();
+        if(processedSize < data.size())
+            compressBlock();
         writer->flush();
     }
     virtual void writeByte(uint8_t v) override
     {
-        currentInput.push_back(v);
-        if(currentInput.size() < bufferSize)
+        data.push_back(v);
+        if(data.size() - processedSize >= blockSize)
+            compressBlock();
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        while(count > 0)
+        {
+            size_t currentCount = blockSize - (data.size() - processedSize);
+            if(currentCount > count)
+                currentCount = count;
+            data.insert(data.end(), array, array + currentCount);
+            array += currentCount;
+            count -= currentCount;
+            if(data.size() - processedSize >= blockSize)
+                compressBlock();
+        }
+    }
+};
+
+/// reads the batches written by AdaptiveCompressWriter
+class AdaptiveExpandReader final : public Reader
+{
+private:
+    shared_ptr<Reader> reader;
+    ExpandReader expandReader;
+    bool compressed;
+    uint32_t batchLeft;
+    void readHeader()
+    {
+        while(batchLeft == 0)
+        {
+            compressed = reader->readBool();
+            batchLeft = reader->readU32();
+        }
+    }
+public:
+    AdaptiveExpandReader(shared_ptr<Reader> reader)
+        : reader(reader), expandReader(reader), compressed(false), batchLeft(0)
+    {
+    }
+    virtual uint8_t readByte() override
+    {
+        readHeader();
+        batchLeft--;
+        if(compressed)
+            return expandReader.readByte();
+        return reader->readByte();
+    }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        while(count > 0)
+        {
+            readHeader();
+            size_t currentCount = batchLeft;
+            if(currentCount > count)
+                currentCount = count;
+            if(compressed)
+                expandReader.readBytes(array, currentCount);
+            else
+                reader->readBytes(array, currentCount);
+            batchLeft -= currentCount;
+            array += currentCount;
+            count -= currentCount;
+        }
+    }
+};
+
+/// writes data in batches that are each either compressed or sent as-is.
+/// compression is skipped for small batches, when it isn't shrinking the data,
+/// and when it has used up its share of the CPU
+class AdaptiveCompressWriter final : public Writer
+{
+private:
+    static constexpr size_t maxBatchSize = 1 << 16;
+    static constexpr size_t minCompressSize = 256;
+    static constexpr float badRatio = 0.9f;
+    static constexpr int retryInterval = 32; // batches to send uncompressed after compression didn't help
+    shared_ptr<Writer> writer;
+    MemoryWriter batch;
+    shared_ptr<MemoryWriter> compressedBatch;
+    CompressWriter compressWriter;
+    float averageRatio;
+    int skipCount;
+    const double cpuBudget; // fraction of the wall clock time that can be spent compressing
+    double cpuAvailable; // seconds
+    chrono::steady_clock::time_point lastBatchTime;
+    bool shouldCompress()
+    {
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        cpuAvailable += cpuBudget * chrono::duration_cast<chrono::duration<double>>(now - lastBatchTime).count();
+        if(cpuAvailable > cpuBudget) // don't save up more than a second's worth
+            cpuAvailable = cpuBudget;
+        lastBatchTime = now;
+        if(batch.size() < minCompressSize)
+            return false;
+        if(cpuAvailable <= 0)
+            return false;
+        if(averageRatio > badRatio && skipCount-- > 0)
+            return false;
+        return true;
+    }
+    void writeBatch()
+    {
+        if(batch.empty())
             return;
-        writeCode();
+        if(shouldCompress())
+        {
+            chrono::steady_clock::time_point startTime = chrono::steady_clock::now();
+            compressWriter.writeBytes(batch.data(), batch.size());
+            compressWriter.flush();
+            cpuAvailable -= chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
+            float ratio = (float)compressedBatch->size() / batch.size();
+            averageRatio = averageRatio * 0.75f + ratio * 0.25f;
+            if(averageRatio > badRatio)
+                skipCount = retryInterval;
+            writer->writeBool(true);
+            writer->writeU32(batch.size());
+            writer->writeBytes(compressedBatch->data(), compressedBatch->size());
+            compressedBatch->clear();
+        }
+        else
+        {
+            writer->writeBool(false);
+            writer->writeU32(batch.size());
+            writer->writeBytes(batch.data(), batch.size());
+        }
+        batch.clear();
+    }
+public:
+    AdaptiveCompressWriter(shared_ptr<Writer> writer, double cpuBudget = 0.1)
+        : writer(writer), compressedBatch(make_shared<MemoryWriter>()), compressWriter(compressedBatch), averageRatio(0), skipCount(0), cpuBudget(cpuBudget), cpuAvailable(cpuBudget), lastBatchTime(chrono::steady_clock::now())
+    {
+    }
+    virtual void writeByte(uint8_t v) override
+    {
+        batch.writeByte(v);
+        if(batch.size() >= maxBatchSize)
+            writeBatch();
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        batch.writeBytes(array, count);
+        if(batch.size() >= maxBatchSize)
+            writeBatch();
+    }
+    virtual void flush() override
+    {
+        writeBatch();
+        writer->flush();
     }
 };
 
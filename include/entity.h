@@ -153,6 +153,11 @@ protected:
 public:
     virtual shared_ptr<RenderObjectEntity> getEntity(EntityData & entity, shared_ptr<World> world) const = 0;
     virtual void onMove(EntityData & entity, shared_ptr<World> world, float deltaTime) const = 0;
+    /// true if onMove only changes entity and can run on any thread without holding the world lock
+    virtual bool canMoveInParallel() const
+    {
+        return false;
+    }
     static EntityData load(GameLoadStream & gls)
     {
         return gls.readEntityDescriptor()->loadInternal(gls);
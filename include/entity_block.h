@@ -28,14 +28,38 @@ class EntityBlock final : public EntityDescriptor
 private:
     static constexpr const VectorF physicsExtents() {return VectorF(0.125);}
     static constexpr const PhysicsProperties physicsProperties() {return PhysicsProperties();}
+    /// an entity that stays put for this many ticks goes to sleep and isn't simulated
+    /// until the blocks around it change or something moves it
+    static constexpr int ticksBeforeSleep = 5;
+    static constexpr float sleepSpeed = 0.05f;
+    static constexpr float sleepDistance = 1e-3f;
     struct ExtraData final : public ExtraEntityData
     {
         BlockDescriptorPtr block;
+        int restTickCount = 0;
+        bool sleeping = false;
+        PositionF restPosition;
+        uint64_t neighborhoodChangeCount = 0;
         ExtraData(BlockDescriptorPtr block)
             : block(block)
         {
         }
     };
+    /// goes up whenever any of the blocks around bi changes
+    static uint64_t getNeighborhoodChangeCount(BlockIterator bi)
+    {
+        uint64_t retval = 0;
+        for(int dx = -1; dx <= 1; dx += 2)
+        {
+            for(int dz = -1; dz <= 1; dz += 2)
+            {
+                BlockIterator corner = bi;
+                corner += VectorI(dx, 0, dz);
+                retval += corner.getChunkChangeCount();
+            }
+        }
+        return retval;
+    }
     friend void initEntityBlock();
     EntityBlock()
         : EntityDescriptor(L"builtin.block")
@@ -82,11 +106,13 @@ protected:
 public:
     virtual shared_ptr<RenderObjectEntity> getEntity(EntityData & entity, shared_ptr<World> world) const override;
     virtual void onMove(EntityData & entity, shared_ptr<World> world, float deltaTime) const override;
+    virtual bool canMoveInParallel() const override
+    {
+        return true;
+    }
     shared_ptr<PhysicsObjectConstructor> getPhysicsObjectConstructor() const
     {
-        static shared_ptr<PhysicsObjectConstructor> retval;
-        if(!retval)
-            retval = PhysicsObjectConstructor::boxMaker(physicsExtents(), true, false, physicsProperties(), vector<PhysicsConstraint>());
+        static shared_ptr<PhysicsObjectConstructor> retval = PhysicsObjectConstructor::boxMaker(physicsExtents(), true, false, physicsProperties(), vector<PhysicsConstraint>());
         return retval;
     }
     virtual shared_ptr<PhysicsObjectConstructor> getPhysicsObjectConstructor(EntityData &) const override
@@ -100,6 +100,10 @@ public:
     {
         return reader->readByte();
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        reader->readBytes(array, count);
+    }
     BlockDescriptorPtr readBlockDescriptor();
     EntityDescriptorPtr readEntityDescriptor();
 };
@@ -124,6 +128,10 @@ public:
     {
         writer->writeByte(v);
     }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        writer->writeBytes(array, count);
+    }
     virtual void flush() override
     {
         writer->flush();
@@ -24,6 +24,7 @@
 #include <stdexcept>
 #include <mutex>
 #include <memory>
+#include <vector>
 #include "color.h"
 #include "stream.h"
 #include "client.h"
@@ -81,7 +82,24 @@ public:
     }
     void write(Writer &writer, Client &client) const;
     static Image read(Reader &reader, Client &client);
+    /// the content hashes of the images in the local cache, for the client to send when it connects
+    static vector<uint64_t> getCachedHashes();
+    /// images with these content hashes aren't sent to client
+    static void setPeerCachedHashes(Client &client, const vector<uint64_t> &hashes);
+    /// returns and clears the ids of the images to ask the server for again (on the client) or to send again (on the server)
+    static vector<Client::IdType> takeImageRequests(Client &client);
+    static void addImageRequest(Client &client, Client::IdType id);
+    /// writes all of the image with id, for a client whose cached copy was bad
+    static void writeRequested(Writer &writer, Client &client, Client::IdType id);
+    /// reads an image written by writeRequested into the blank image that read left in its place
+    static void readRequested(Reader &reader, Client &client);
 private:
+    /// filtered and compressed pixels plus the content hash, built once per image data
+    struct EncodedImage final
+    {
+        uint64_t hash;
+        vector<uint8_t> bytes;
+    };
     enum RowOrder
     {
         TopToBottom,
@@ -94,6 +112,7 @@ private:
         RowOrder rowOrder;
         uint32_t texture;
         bool textureValid;
+        shared_ptr<const EncodedImage> encoded;
         mutex lock;
         data_t(uint8_t * data, unsigned w, unsigned h, RowOrder rowOrder)
             : data(data), w(w), h(h), rowOrder(rowOrder), texture(0), textureValid(false)
@@ -110,6 +129,7 @@ private:
     void setRowOrder(RowOrder newRowOrder) const;
     void swapRows(unsigned y1, unsigned y2) const;
     void copyOnWrite();
+    shared_ptr<const EncodedImage> getEncoded() const;
 };
 
 #endif // IMAGE_H
@@ -150,22 +150,11 @@ private:
         textureCoords.resize(floatsPerTextureCoord * textureCoordsPerTriangle * length);
         textureInternal = Image::read(reader, client);
         DUMP_V(Mesh_t::Mesh_t, "reading mesh : read texture");
-        for(float & v : points)
-        {
-            v = reader.readFiniteF32();
-        }
-        DUMP_V(Mesh_t::Mesh_t, "reading mesh : read points");
-        for(float & v : textureCoords)
-        {
-            v = reader.readFiniteF32();
-        }
-        DUMP_V(Mesh_t::Mesh_t, "reading mesh : read textureCoords");
-        for(float & v : colors)
-        {
-            v = reader.readFiniteF32();
-        }
-        DUMP_V(Mesh_t::Mesh_t, "reading mesh : read colors");
+        readData(reader);
+        DUMP_V(Mesh_t::Mesh_t, "reading mesh : read data");
     }
+    /// reads the vertex data written by writeMeshData into the already sized arrays
+    void readData(Reader &reader);
 public:
     Mesh_t()
     {
@@ -487,6 +476,7 @@ public:
     }
 
     friend void writeMesh(Mesh mesh, Writer &writer, Client &client);
+    friend void writeMeshData(Mesh mesh, Writer &writer);
 
     friend Mesh readMesh(Reader &reader, Client &client);
     friend Mesh interpolateColors(Mesh dest, Mesh mesh, Color cNXNYNZ, Color cNXNYPZ, Color cNXPYNZ, Color cNXPYPZ, Color cPXNYNZ, Color cPXNYPZ, Color cPXPYNZ, Color cPXPYPZ);
@@ -586,23 +576,16 @@ inline Mesh lightColors(Mesh mesh, VectorF lightDir, float ambient, float diffus
     return Mesh(new Mesh_t(mesh->texture(), triangles));
 }
 
+/// writes the vertex data of mesh : the part of writeMesh that doesn't depend on the client.
+/// uses the compact indexed format when the mesh fits in it and plain floats otherwise
+void writeMeshData(Mesh mesh, Writer &writer);
+
 inline void writeMesh(Mesh mesh, Writer &writer, Client &client)
 {
     assert(mesh && (uint32_t)mesh->size() == mesh->size());
     writer.writeU32(mesh->size());
     mesh->texture().write(writer, client);
-    for(float v : mesh->points)
-    {
-        writer.writeF32(v);
-    }
-    for(float v : mesh->textureCoords)
-    {
-        writer.writeF32(v);
-    }
-    for(float v : mesh->colors)
-    {
-        writer.writeF32(v);
-    }
+    writeMeshData(mesh, writer);
 }
 
 inline Mesh readMesh(Reader &reader, Client &client)
@@ -30,26 +30,85 @@ public:
     }
 };
 
+/// sends chain from buffer index and offset onward with sendmsg and advances them past what was sent.
+/// returns false if the socket is non-blocking and can't take any more right now
+bool sendBufferChain(int fd, const ChainWriter::Chain & chain, size_t & index, size_t & offset);
+
+/// reads from a socket through a large buffer so that each byte doesn't go through stdio
+class NetworkReader final : public Reader
+{
+private:
+    static constexpr size_t bufferSize = 1 << 18;
+    uint8_t * const buffer;
+    size_t startIndex, endIndex;
+    int fd;
+    void fill(size_t count);
+public:
+    explicit NetworkReader(int fd);
+    virtual ~NetworkReader();
+    virtual uint8_t readByte() override
+    {
+        if(startIndex == endIndex)
+            fill(1);
+        return buffer[startIndex++];
+    }
+    virtual void readBytes(uint8_t * array, size_t count) override;
+    /// returns a pointer to the next count bytes and consumes them.
+    /// the returned memory is valid until the next read
+    const uint8_t * readContiguous(size_t count)
+    {
+        if(endIndex - startIndex < count)
+            fill(count);
+        const uint8_t * retval = &buffer[startIndex];
+        startIndex += count;
+        return retval;
+    }
+    static constexpr size_t maxContiguousSize()
+    {
+        return bufferSize;
+    }
+    size_t bufferedSize() const
+    {
+        return endIndex - startIndex;
+    }
+};
+
 class NetworkConnection final : public StreamRW
 {
     friend class NetworkServer;
 private:
+    int fd;
+    bool localPeer;
     shared_ptr<Reader> readerInternal;
     shared_ptr<Writer> writerInternal;
-    NetworkConnection(int readFd, int writeFd)
-        : readerInternal(new FileReader(fdopen(readFd, "r"))), writerInternal(new FileWriter(fdopen(writeFd, "w")))
-    {
-    }
+    explicit NetworkConnection(int fd);
+    void makeStreams();
 public:
     explicit NetworkConnection(wstring url, uint16_t port);
+    ~NetworkConnection();
     shared_ptr<Reader> preader() override
     {
+        makeStreams();
         return readerInternal;
     }
     shared_ptr<Writer> pwriter() override
     {
+        makeStreams();
         return writerInternal;
     }
+    /// true if the other end is on this machine or a private network
+    bool peerIsLocal() const
+    {
+        return localPeer;
+    }
+    /// gives the socket to the caller, who is responsible for closing it.
+    /// returns -1 if the reader or writer has already been used
+    int releaseSocket()
+    {
+        int retval = fd;
+        fd = -1;
+        return retval;
+    }
 };
 
 class NetworkServer final : public StreamServer
@@ -0,0 +1,100 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef NETWORK_EVENT_LOOP_H_INCLUDED
+#define NETWORK_EVENT_LOOP_H_INCLUDED
+
+#include "network.h"
+#include <thread>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+/// multiplexes non-blocking sockets over a fixed set of epoll threads
+class NetworkEventLoop final
+{
+    NetworkEventLoop(const NetworkEventLoop &) = delete;
+    const NetworkEventLoop & operator =(const NetworkEventLoop &) = delete;
+public:
+    struct Handler
+    {
+        Handler()
+        {
+        }
+        Handler(const Handler &) = delete;
+        const Handler & operator =(const Handler &) = delete;
+        virtual ~Handler()
+        {
+        }
+        /// parses as many complete messages as are in data and returns the number of bytes used
+        virtual size_t onRead(const uint8_t * data, size_t size) = 0;
+        /// writes the next batch of output. shared buffers written with writeSharedBytes are sent without copying.
+        /// returns false if there is nothing to send
+        virtual bool onWritable(Writer & writer) = 0;
+        virtual void onClose() = 0;
+        /// the most unparsed input to hold before the connection stops reading
+        virtual size_t maxInputSize() const
+        {
+            return (size_t)1 << 20;
+        }
+    };
+    class Connection final
+    {
+        friend class NetworkEventLoop;
+        Connection(const Connection &) = delete;
+        const Connection & operator =(const Connection &) = delete;
+    private:
+        const int fd;
+        const int epollFd;
+        shared_ptr<Handler> handler;
+        vector<uint8_t> input;
+        const size_t maxInputSize;
+        ChainWriter output;
+        size_t outputIndex, outputOffset;
+        atomic_bool wakeRequested, closed, readBlocked;
+        Connection(int fd, int epollFd, shared_ptr<Handler> handler);
+        void setEvents(bool wantWrite);
+        bool handleRead();
+        bool handleWrite();
+        void close();
+    public:
+        ~Connection();
+        /// tells the connection that its handler may have more to write. can be called from any thread
+        void wake();
+    };
+    explicit NetworkEventLoop(size_t threadCount);
+    ~NetworkEventLoop();
+    /// takes ownership of fd
+    shared_ptr<Connection> add(int fd, shared_ptr<Handler> handler);
+private:
+    struct IOThread final
+    {
+        int epollFd;
+        int eventFd;
+        thread theThread;
+        mutex lock;
+        unordered_map<Connection *, shared_ptr<Connection>> connections;
+    };
+    vector<shared_ptr<IOThread>> ioThreads;
+    atomic_size_t nextThread;
+    atomic_bool done;
+    void run(IOThread & ioThread);
+};
+
+#endif // NETWORK_EVENT_LOOP_H_INCLUDED
@@ -19,7 +19,10 @@
 #define NETWORK_PROTOCOL_H_INCLUDED
 
 #include <cstdint>
+#include <vector>
+#include <cassert>
 #include "stream.h"
+#include "network.h"
 
 namespace NetworkProtocol
 {
@@ -31,19 +34,181 @@ enum class NetworkEvent : uint_fast8_t
     RequestChunk,
     RequestState,
     SendPlayer,
+    RequestImage,
+    SendImage,
+    UnsubscribeChunk,
     Last
 };
 
 typedef NetworkEvent NetworkEvent;
 
-inline NetworkEvent readNetworkEvent(Reader & reader)
+/// after the handshake both directions are a sequence of frames : a U32 size followed by that many bytes of messages.
+/// each message is a U8 NetworkEvent and a U32 body size followed by the body, so messages with unknown
+/// events can be skipped and a message body can be parsed in place
+constexpr size_t MessageHeaderSize = 5;
+constexpr uint32_t MaxFrameSize = 1 << 26;
+
+/// calls fn(event, reader) for every message in frame, where reader reads from the message body in place.
+/// messages with unknown events are skipped
+template <typename Fn>
+void forEachMessage(const uint8_t * frame, size_t size, Fn fn)
+{
+    size_t offset = 0;
+    while(offset < size)
+    {
+        if(size - offset < MessageHeaderSize)
+            throw InvalidDataValueException("truncated message header");
+        uint8_t event = frame[offset];
+        size_t length = (size_t)frame[offset + 1] << 24 | (size_t)frame[offset + 2] << 16 | (size_t)frame[offset + 3] << 8 | (size_t)frame[offset + 4];
+        offset += MessageHeaderSize;
+        if(length > size - offset)
+            throw InvalidDataValueException("message runs past the end of its frame");
+        if(event < (uint8_t)NetworkEvent::Last)
+        {
+            MemoryReader reader(shared_ptr<const uint8_t>(frame + offset, [](const uint8_t *){}), length);
+            fn((NetworkEvent)event, static_cast<Reader &>(reader));
+        }
+        offset += length;
+    }
+}
+
+/// returns the size of the frame at the start of data including its size prefix, or 0 if more data is needed
+inline size_t getFrameSize(const uint8_t * data, size_t size)
+{
+    if(size < sizeof(uint32_t))
+        return 0;
+    uint32_t frameSize = (uint32_t)data[0] << 24 | (uint32_t)data[1] << 16 | (uint32_t)data[2] << 8 | (uint32_t)data[3];
+    if(frameSize > MaxFrameSize)
+        throw InvalidDataValueException("frame too big");
+    if(size - sizeof(uint32_t) < frameSize)
+        return 0;
+    return sizeof(uint32_t) + frameSize;
+}
+
+/// reads whole frames from a stream. frames are handed out as slices of the NetworkReader's buffer when they fit
+class FrameReader final
+{
+    FrameReader(const FrameReader &) = delete;
+    const FrameReader & operator =(const FrameReader &) = delete;
+private:
+    Reader & reader;
+    NetworkReader * const networkReader;
+    vector<uint8_t> buffer;
+public:
+    explicit FrameReader(Reader & reader)
+        : reader(reader), networkReader(dynamic_cast<NetworkReader *>(&reader))
+    {
+    }
+    /// reads the next frame and calls fn(event, reader) for each message in it
+    template <typename Fn>
+    void readFrame(Fn fn)
+    {
+        uint32_t size = reader.readLimitedU32(0, MaxFrameSize);
+        const uint8_t * frame;
+        if(networkReader != nullptr && size <= networkReader->maxContiguousSize())
+        {
+            frame = networkReader->readContiguous(size);
+        }
+        else
+        {
+            buffer.resize(size);
+            reader.readBytes(buffer.data(), size);
+            frame = buffer.data();
+        }
+        forEachMessage(frame, size, fn);
+    }
+};
+
+/// collects messages and writes them out as one frame. shared buffers written to a message are passed on by reference
+class FrameWriter final
+{
+    FrameWriter(const FrameWriter &) = delete;
+    const FrameWriter & operator =(const FrameWriter &) = delete;
+private:
+    ChainWriter frame;
+    size_t messageStart;
+    uint8_t * messageHeader;
+public:
+    FrameWriter()
+        : messageStart(0), messageHeader(nullptr)
+    {
+    }
+    /// starts a message. write the body to the returned writer then call endMessage
+    Writer & beginMessage(NetworkEvent event)
+    {
+        assert(messageHeader == nullptr);
+        messageStart = frame.size();
+        messageHeader = frame.reserveBytes(MessageHeaderSize);
+        messageHeader[0] = (uint8_t)event;
+        return frame;
+    }
+    void endMessage()
+    {
+        assert(messageHeader != nullptr);
+        size_t length = frame.size() - messageStart - MessageHeaderSize;
+        messageHeader[1] = (uint8_t)(length >> 24);
+        messageHeader[2] = (uint8_t)(length >> 16);
+        messageHeader[3] = (uint8_t)(length >> 8);
+        messageHeader[4] = (uint8_t)length;
+        messageHeader = nullptr;
+    }
+    bool empty() const
+    {
+        return frame.empty();
+    }
+    /// writes the messages since the last call as one frame. doesn't flush writer
+    void writeFrame(Writer & writer)
+    {
+        assert(messageHeader == nullptr);
+        if(frame.empty())
+            return;
+        writer.writeU32(frame.size());
+        frame.writeTo(writer);
+        frame.clear();
+    }
+};
+
+/// sent by the client as the first byte of its stream to say what it can accept,
+/// then by the server as the first byte of its stream to say what it chose.
+/// with Adaptive, the server to client stream is made of AdaptiveCompressWriter batches
+enum class CompressionMode : uint_fast8_t
+{
+    None,
+    Adaptive,
+    Last
+};
+
+inline CompressionMode readCompressionMode(Reader & reader)
+{
+    return (CompressionMode)reader.readLimitedU8(0, (uint8_t)CompressionMode::Last - 1);
+}
+
+inline void writeCompressionMode(Writer & writer, CompressionMode mode)
+{
+    writer.writeU8((uint8_t)mode);
+}
+
+/// sent by the client right after its CompressionMode : the content hashes of the images it
+/// has cached on disk so that the server can skip sending them
+constexpr uint32_t MaxCachedImageHashCount = 4096;
+
+inline vector<uint64_t> readCachedImageHashes(Reader & reader)
 {
-    return (NetworkEvent)reader.readLimitedU8(0, (uint8_t)NetworkEvent::Last);
+    vector<uint64_t> retval;
+    retval.resize(reader.readLimitedU32(0, MaxCachedImageHashCount));
+    for(uint64_t & hash : retval)
+        hash = reader.readU64();
+    return retval;
 }
 
-inline void writeNetworkEvent(Writer & writer, NetworkEvent event)
+inline void writeCachedImageHashes(Writer & writer, const vector<uint64_t> & hashes)
 {
-    writer.writeU8((uint8_t)event);
+    size_t count = hashes.size();
+    if(count > MaxCachedImageHashCount)
+        count = MaxCachedImageHashCount;
+    writer.writeU32(count);
+    for(size_t i = 0; i < count; i++)
+        writer.writeU64(hashes[i]);
 }
 
 }
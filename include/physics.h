@@ -23,6 +23,8 @@
 #include "position.h"
 #include "stream.h"
 #include "script.h"
+#include "thread_pool.h"
+#include <atomic>
 #include <unordered_map>
 #include <unordered_set>
 #include <algorithm>
@@ -34,6 +36,7 @@
 using namespace std;
 
 class PhysicsWorld;
+struct CollisionShape;
 
 struct PhysicsProperties final
 {
@@ -76,33 +79,32 @@ public:
     }
 };
 
+/// a handle to a body in a PhysicsWorld. the body's state is stored in the world's body arrays
 class PhysicsObject final : public enable_shared_from_this<PhysicsObject>
 {
     friend class PhysicsWorld;
-private:
-    PositionF position[2];
-    VectorF velocity[2];
-    double objectTime[2];
-    bool affectedByGravity;
-    bool isStatic_;
-    bool supported = false;
-    bool destroyed = false;
+public:
     enum Type
     {
         Box,
         Cylinder,
         Empty,
     };
-    Type type;
-    VectorF extents;
+private:
     weak_ptr<PhysicsWorld> world;
-    uint64_t latestUpdateTag = 0;
-    size_t newStateCount = 0;
-    PhysicsProperties properties;
-    shared_ptr<const vector<PhysicsConstraint>> constraints;
+    PhysicsWorld * worldPointer; /// so reading our state doesn't need to lock world. null once world is destroyed
+    PositionF detachedPosition; /// where we were when world was destroyed
+    VectorF detachedVelocity;
+    static const PhysicsProperties & getDetachedProperties()
+    {
+        static const PhysicsProperties retval;
+        return retval;
+    }
+    const size_t index; /// our slot in the world's body arrays. stays the same as long as we exist
     PhysicsObject(const PhysicsObject &) = delete;
     const PhysicsObject & operator =(const PhysicsObject &) = delete;
     PhysicsObject(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, shared_ptr<PhysicsWorld> world, PhysicsProperties properties, Type type);
+    uint64_t latestUpdateTag() const;
 public:
     static shared_ptr<PhysicsObject> makeBox(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, PhysicsProperties properties, shared_ptr<PhysicsWorld> world);
     static shared_ptr<PhysicsObject> makeCylinder(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, float radius, float yExtents, PhysicsProperties properties, shared_ptr<PhysicsWorld> world);
@@ -110,66 +112,74 @@ public:
     ~PhysicsObject();
     PositionF getPosition() const;
     VectorF getVelocity() const;
-    shared_ptr<PhysicsObject> setConstraints(shared_ptr<const vector<PhysicsConstraint>> constraints = nullptr)
-    {
-        this->constraints = constraints;
-        return shared_from_this();
-    }
+    shared_ptr<PhysicsObject> setConstraints(shared_ptr<const vector<PhysicsConstraint>> constraints = nullptr);
     shared_ptr<PhysicsObject> setConstraints(const vector<PhysicsConstraint> &constraints)
     {
-        this->constraints = make_shared<vector<PhysicsConstraint>>(constraints);
-        return shared_from_this();
-    }
-    bool isAffectedByGravity() const
-    {
-        return affectedByGravity;
-    }
-    bool isSupported() const
-    {
-        return supported;
-    }
-    bool isStatic() const
-    {
-        return isStatic_;
-    }
-    bool isDestroyed() const
-    {
-        return destroyed;
-    }
-    void destroy()
-    {
-        destroyed = true;
-    }
-    VectorF getExtents() const
-    {
-        return extents;
+        return setConstraints(make_shared<vector<PhysicsConstraint>>(constraints));
     }
+    bool isAffectedByGravity() const;
+    bool isSupported() const;
+    bool isStatic() const;
+    bool isDestroyed() const;
+    void destroy();
+    VectorF getExtents() const;
+    Type getType() const;
     bool isCylinder() const
     {
-        return type == Type::Cylinder;
+        return getType() == Type::Cylinder;
     }
     bool isBox() const
     {
-        return type == Type::Box;
+        return getType() == Type::Box;
     }
     bool isEmpty() const
     {
-        return type == Type::Empty;
+        return getType() == Type::Empty;
     }
     shared_ptr<PhysicsWorld> getWorld() const
     {
         return world.lock();
     }
-    const PhysicsProperties & getProperties() const
-    {
-        return properties;
-    }
+    const PhysicsProperties & getProperties() const;
     void setNewState(PositionF newPosition, VectorF newVelocity);
     void setupNewState();
+    /// makes the state adjustPosition built up since setupNewState the current one
+    void applyNewState(bool supported);
     void setCurrentState(PositionF newPosition, VectorF newVelocity);
     bool collides(const PhysicsObject & rt) const;
     void adjustPosition(const PhysicsObject & rt);
     bool isSupportedBy(const PhysicsObject & rt) const;
+    /// the same tests against a static shape centered at shapePosition
+    bool collides(const CollisionShape & shape, PositionF shapePosition) const;
+    void adjustPosition(const CollisionShape & shape, PositionF shapePosition);
+    bool isSupportedBy(const CollisionShape & shape, PositionF shapePosition) const;
+private:
+    bool collides(PositionF lPosition, Type rType, PositionF rPosition, VectorF rExtents) const;
+    void adjustPosition(PositionF aPosition, VectorF aVelocity, Type rType, PositionF bPosition, VectorF bVelocity, VectorF rExtents, bool rIsStatic, bool rIsSupported, const PhysicsProperties & rProperties);
+    bool isSupportedBy(PositionF aPosition, Type rType, PositionF bPosition, VectorF rExtents, bool rIsSupportedOrStatic) const;
+};
+
+/// the shape of a static object relative to its center. lets every block of a kind share one shape
+/// for collision tests instead of each block making its own PhysicsObject
+struct CollisionShape final
+{
+    PhysicsObject::Type type;
+    VectorF extents;
+    PhysicsProperties properties;
+    bool fullBlock; /// fills the whole unit cube around its center
+    CollisionShape(PhysicsObject::Type type = PhysicsObject::Type::Empty, VectorF extents = VectorF(0), PhysicsProperties properties = PhysicsProperties())
+        : type(type), extents(extents), properties(properties), fullBlock(type == PhysicsObject::Type::Box && extents.x >= 0.5f && extents.y >= 0.5f && extents.z >= 0.5f)
+    {
+    }
+    bool empty() const
+    {
+        return type == PhysicsObject::Type::Empty;
+    }
+    static const CollisionShape & solidBlock()
+    {
+        static const CollisionShape retval(PhysicsObject::Type::Box, VectorF(0.5f), PhysicsProperties(1, 0));
+        return retval;
+    }
 };
 
 class PhysicsWorld final : public enable_shared_from_this<PhysicsWorld>
@@ -195,21 +205,111 @@ public:
     }
 private:
     unordered_set<shared_ptr<PhysicsObject>> objects;
+    enum BodyFlag : uint8_t
+    {
+        AffectedByGravityFlag = 1 << 0,
+        StaticFlag = 1 << 1,
+        SupportedFlag = 1 << 2,
+        DestroyedFlag = 1 << 3,
+        InBroadphaseFlag = 1 << 4,
+        ChangedFlag = 1 << 5, /// needs to be added to changedObjects
+    };
+    struct BroadphaseRange final
+    {
+        int minX, maxX, minY, maxY, minZ, maxZ;
+        Dimension d;
+        bool large; /// covers too many cells, so it is tested against everything
+        bool operator ==(const BroadphaseRange & rt) const
+        {
+            return minX == rt.minX && maxX == rt.maxX && minY == rt.minY && maxY == rt.maxY && minZ == rt.minZ && maxZ == rt.maxZ && d == rt.d && large == rt.large;
+        }
+        bool operator !=(const BroadphaseRange & rt) const
+        {
+            return !operator ==(rt);
+        }
+    };
+    // the state of every body, stored by field and indexed by PhysicsObject::index
+    vector<PositionF> bodyPosition[2];
+    vector<VectorF> bodyVelocity[2];
+    vector<double> bodyTime[2];
+    vector<VectorF> bodyExtents;
+    vector<PhysicsObject::Type> bodyType;
+    vector<uint8_t> bodyFlags;
+    vector<PhysicsProperties> bodyProperties;
+    vector<shared_ptr<const vector<PhysicsConstraint>>> bodyConstraints;
+    vector<uint64_t> bodyUpdateTag;
+    vector<size_t> bodyNewStateCount;
+    vector<BroadphaseRange> bodyBroadphaseRange;
+    vector<uint64_t> bodyQueryTag;
+    vector<float> bodySortKey;
+    vector<size_t> bodySortIndex;
+    vector<size_t> bodyIsland; /// parent in the island union-find
+    vector<size_t> bodyIslandIndex;
+    vector<size_t> bodyCandidateStart, bodyCandidateEnd; /// range in candidateBodies
+    vector<PhysicsObject *> bodyObject;
+    vector<size_t> freeBodies;
+    size_t allocateBody(PhysicsObject * object, PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, PhysicsProperties properties, PhysicsObject::Type type);
+    void freeBody(size_t body);
+    PositionF getBodyPosition(size_t body) const
+    {
+        return getBodyPosition(body, currentTime);
+    }
+    VectorF getBodyVelocity(size_t body) const
+    {
+        return getBodyVelocity(body, currentTime);
+    }
+    PositionF getBodyPosition(size_t body, double time) const;
+    VectorF getBodyVelocity(size_t body, double time) const;
+    vector<size_t> sortedBodies; /// every body in objects, kept sorted by the bottom of its bounding box
+    static constexpr int broadphaseScaleFactor = 1; /// broadphase cells per block along each axis
+    static constexpr size_t broadphaseMaxCellCount = 64;
+    unordered_map<PositionI, vector<size_t>> broadphaseCells;
+    vector<size_t> broadphaseLargeBodies;
+    uint64_t broadphaseQueryTag = 0;
     void addObject(shared_ptr<PhysicsObject> o)
     {
-        objects.insert(o);
+        if(objects.insert(o).second)
+            sortedBodies.push_back(o->index);
     }
     void removeObject(shared_ptr<PhysicsObject> o)
     {
-        objects.erase(o);
+        if(objects.erase(o) == 0)
+            return;
+        removeFromBroadphase(o->index);
+        sortedBodies.erase(find(sortedBodies.begin(), sortedBodies.end(), o->index));
     }
+    static void removeFromList(vector<size_t> & list, size_t body)
+    {
+        auto iter = find(list.begin(), list.end(), body);
+        assert(iter != list.end());
+        *iter = list.back();
+        list.pop_back();
+    }
+    void updateBroadphase(size_t body, VectorF minPosition, VectorF maxPosition, Dimension d); /// covers everywhere the center goes between minPosition and maxPosition
+    void removeFromBroadphase(size_t body);
+    template <typename Fn>
+    void forEachBroadphaseCandidate(size_t body, Fn fn);
+    static constexpr size_t maxSolverIterations = 10;
+    static constexpr float maxSubstepDistance = 0.5f; /// how far a body can move in one substep, as a fraction of its smallest extent
+    static constexpr size_t maxSubstepCount = 256;
+    static constexpr float contactStepDuration = 1 / 600.0f; /// the longest substep for bodies touching something that aren't resting
+    shared_ptr<ThreadPool> threadPool;
+    vector<size_t> candidateBodies; /// the broadphase candidates of every moving body this step
+    vector<size_t> islandStart, islandBodies;
+    atomic_uint_fast64_t collisionPairTestCount{0};
+    size_t findIsland(size_t body);
+    void mergeIslands(size_t bodyA, size_t bodyB);
+    size_t getSubstepCount(const size_t * bodies, size_t bodyCount, float deltaTime) const;
+    float getSubstepDistance(size_t body, float deltaTime) const;
+    static float getSweepHitFraction(VectorF startOffset, VectorF deltaPosition, VectorF extentsSum);
+    void solveIsland(const size_t * bodies, size_t bodyCount, double startTime, double stopTime);
     struct CollisionEvent final
     {
         double collisionTime;
         weak_ptr<PhysicsObject> a, b;
         uint64_t aTag, bTag;
         CollisionEvent(double collisionTime, shared_ptr<PhysicsObject> a, shared_ptr<PhysicsObject> b)
-            : collisionTime(collisionTime), a(a), b(b), aTag(a->latestUpdateTag), bTag(b->latestUpdateTag)
+            : collisionTime(collisionTime), a(a), b(b), aTag(a->latestUpdateTag()), bTag(b->latestUpdateTag())
         {
         }
         bool operator ==(const CollisionEvent & rt) const
@@ -244,11 +344,19 @@ private:
     priority_queue<CollisionEvent, vector<CollisionEvent>, CollisionEventCompare> eventsQueue;
     unordered_set<CollisionEvent, CollisionEventHash> eventsSet;
     unordered_map<intptr_t, weak_ptr<PhysicsObject>> changedObjects;
-    void swapVariableSetIndex()
+public:
+    /// objects that outlive us keep where they were and act as destroyed
+    ~PhysicsWorld();
+    /// islands are solved on threadPool if it's set
+    void setThreadPool(shared_ptr<ThreadPool> threadPool)
     {
-        variableSetIndex = (variableSetIndex != 0 ? 0 : 1);
+        this->threadPool = threadPool;
+    }
+    /// how many pairs of bodies runToTime has tested for collision so far
+    uint64_t getCollisionPairTestCount() const
+    {
+        return collisionPairTestCount;
     }
-public:
     void runToTime(double stopTime);
     void stepTime(double deltaTime)
     {
@@ -263,9 +371,11 @@ class PhysicsObjectConstructor final : public enable_shared_from_this<PhysicsObj
 public:
     const makeFnType make;
     const writeFnType write;
+    /// the shape that make gives its objects, for static collision tests without making an object
+    const CollisionShape shape;
 private:
-    PhysicsObjectConstructor(makeFnType make, writeFnType write)
-        : make(make), write(write)
+    PhysicsObjectConstructor(makeFnType make, writeFnType write, CollisionShape shape)
+        : make(make), write(write), shape(shape)
     {
     }
     static constexpr uint8_t BoxShape = 0;
@@ -296,7 +406,7 @@ public:
             retval->setConstraints(constraints);
             return retval;
         };
-        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write));
+        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write, CollisionShape(PhysicsObject::Type::Cylinder, VectorF(radius, yExtent, radius), properties)));
     }
     static shared_ptr<PhysicsObjectConstructor> boxMaker(VectorF extents, bool affectedByGravity, bool isStatic, PhysicsProperties properties, vector<PhysicsConstraint> constraints)
     {
@@ -322,7 +432,7 @@ public:
             retval->setConstraints(constraints);
             return retval;
         };
-        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write));
+        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write, CollisionShape(PhysicsObject::Type::Box, extents, properties)));
     }
     static shared_ptr<PhysicsObjectConstructor> empty()
     {
@@ -334,7 +444,7 @@ public:
         {
             return PhysicsObject::makeEmpty(position, velocity, world);
         };
-        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write));
+        return shared_ptr<PhysicsObjectConstructor>(new PhysicsObjectConstructor(make, write, CollisionShape()));
     }
     static shared_ptr<PhysicsObjectConstructor> read(Reader & reader)
     {
@@ -382,23 +492,96 @@ public:
     }
 };
 
+inline size_t PhysicsWorld::allocateBody(PhysicsObject * object, PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, PhysicsProperties properties, PhysicsObject::Type type)
+{
+    size_t body;
+    if(freeBodies.empty())
+    {
+        body = bodyObject.size();
+        size_t size = body + 1;
+        for(int i = 0; i < 2; i++)
+        {
+            bodyPosition[i].resize(size);
+            bodyVelocity[i].resize(size);
+            bodyTime[i].resize(size);
+        }
+        bodyExtents.resize(size);
+        bodyType.resize(size);
+        bodyFlags.resize(size);
+        bodyProperties.resize(size);
+        bodyConstraints.resize(size);
+        bodyUpdateTag.resize(size);
+        bodyNewStateCount.resize(size);
+        bodyBroadphaseRange.resize(size);
+        bodyQueryTag.resize(size);
+        bodySortKey.resize(size);
+        bodySortIndex.resize(size);
+        bodyIsland.resize(size);
+        bodyIslandIndex.resize(size);
+        bodyCandidateStart.resize(size);
+        bodyCandidateEnd.resize(size);
+        bodyObject.resize(size);
+    }
+    else
+    {
+        body = freeBodies.back();
+        freeBodies.pop_back();
+    }
+    for(int i = 0; i < 2; i++)
+    {
+        bodyPosition[i][body] = position;
+        bodyVelocity[i][body] = velocity;
+        bodyTime[i][body] = currentTime;
+    }
+    bodyExtents[body] = extents;
+    bodyType[body] = type;
+    bodyFlags[body] = (affectedByGravity ? AffectedByGravityFlag : 0) | (isStatic ? StaticFlag : 0);
+    bodyProperties[body] = properties;
+    bodyConstraints[body] = nullptr;
+    bodyUpdateTag[body] = 0;
+    bodyNewStateCount[body] = 0;
+    bodyQueryTag[body] = 0;
+    bodySortKey[body] = 0;
+    bodySortIndex[body] = 0;
+    bodyObject[body] = object;
+    return body;
+}
+
+inline void PhysicsWorld::freeBody(size_t body)
+{
+    assert((bodyFlags[body] & InBroadphaseFlag) == 0);
+    bodyConstraints[body] = nullptr;
+    bodyObject[body] = nullptr;
+    freeBodies.push_back(body);
+}
+
+inline PositionF PhysicsWorld::getBodyPosition(size_t body, double time) const
+{
+    float deltaTime = time - bodyTime[variableSetIndex][body];
+    if((bodyFlags[body] & (AffectedByGravityFlag | SupportedFlag)) == AffectedByGravityFlag)
+        return bodyPosition[variableSetIndex][body] + deltaTime * bodyVelocity[variableSetIndex][body] + 0.5f * deltaTime * deltaTime * gravityVector;
+    return bodyPosition[variableSetIndex][body] + deltaTime * bodyVelocity[variableSetIndex][body];
+}
+
+inline VectorF PhysicsWorld::getBodyVelocity(size_t body, double time) const
+{
+    if((bodyFlags[body] & (AffectedByGravityFlag | SupportedFlag)) != AffectedByGravityFlag)
+        return bodyVelocity[variableSetIndex][body];
+    float deltaTime = time - bodyTime[variableSetIndex][body];
+    return bodyVelocity[variableSetIndex][body] + deltaTime * gravityVector;
+}
+
 inline PhysicsObject::PhysicsObject(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, shared_ptr<PhysicsWorld> world, PhysicsProperties properties, Type type)
-    : position{position, position},
-    velocity{velocity, velocity},
-    objectTime{world->getCurrentTime(), world->getCurrentTime()},
-    affectedByGravity(affectedByGravity),
-    isStatic_(isStatic),
-    type(type),
-    extents(extents),
-    world(world),
-    properties(properties)
+    : world(world),
+    worldPointer(world.get()),
+    index(world->allocateBody(this, position, velocity, affectedByGravity, isStatic, extents, properties, type))
 {
 }
 
 inline shared_ptr<PhysicsObject> PhysicsObject::makeBox(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, VectorF extents, PhysicsProperties properties, shared_ptr<PhysicsWorld> world)
 {
     shared_ptr<PhysicsObject> retval = shared_ptr<PhysicsObject>(new PhysicsObject(position, velocity, affectedByGravity, isStatic, extents, world, properties, Type::Box));
-    world->objects.insert(retval);
+    world->addObject(retval);
     world->changedObjects[(intptr_t)retval.get()] = retval;
     return retval;
 }
@@ -406,7 +589,7 @@ inline shared_ptr<PhysicsObject> PhysicsObject::makeBox(PositionF position, Vect
 inline shared_ptr<PhysicsObject> PhysicsObject::makeCylinder(PositionF position, VectorF velocity, bool affectedByGravity, bool isStatic, float radius, float yExtents, PhysicsProperties properties, shared_ptr<PhysicsWorld> world)
 {
     shared_ptr<PhysicsObject> retval = shared_ptr<PhysicsObject>(new PhysicsObject(position, velocity, affectedByGravity, isStatic, VectorF(radius, yExtents, radius), world, properties, Type::Cylinder));
-    world->objects.insert(retval);
+    world->addObject(retval);
     world->changedObjects[(intptr_t)retval.get()] = retval;
     return retval;
 }
@@ -414,74 +597,165 @@ inline shared_ptr<PhysicsObject> PhysicsObject::makeCylinder(PositionF position,
 inline shared_ptr<PhysicsObject> PhysicsObject::makeEmpty(PositionF position, VectorF velocity, shared_ptr<PhysicsWorld> world)
 {
     shared_ptr<PhysicsObject> retval = shared_ptr<PhysicsObject>(new PhysicsObject(position, velocity, false, true, VectorF(), world, PhysicsProperties(), Type::Empty));
-    world->objects.insert(retval);
+    world->addObject(retval);
     return retval;
 }
 
 inline PhysicsObject::~PhysicsObject()
 {
+    shared_ptr<PhysicsWorld> world = getWorld();
+    if(world != nullptr) // the world frees all of its bodies at once when it's destroyed
+        world->freeBody(index);
+}
+
+inline PhysicsWorld::~PhysicsWorld()
+{
+    for(size_t body = 0; body < bodyObject.size(); body++)
+    {
+        PhysicsObject * object = bodyObject[body];
+        if(object == nullptr)
+            continue;
+        object->detachedPosition = getBodyPosition(body);
+        object->detachedVelocity = getBodyVelocity(body);
+        object->worldPointer = nullptr;
+    }
+}
+
+inline uint64_t PhysicsObject::latestUpdateTag() const
+{
+    if(worldPointer == nullptr)
+        return 0;
+    return worldPointer->bodyUpdateTag[index];
 }
 
 inline PositionF PhysicsObject::getPosition() const
 {
-    auto world = getWorld();
-    int variableSetIndex = world->getOldVariableSetIndex();
-    float deltaTime = world->getCurrentTime() - objectTime[variableSetIndex];
-    if(affectedByGravity && !isSupported())
-        return position[variableSetIndex] + deltaTime * velocity[variableSetIndex] + 0.5f * deltaTime * deltaTime * gravityVector;
-    return position[variableSetIndex] + deltaTime * velocity[variableSetIndex];
+    if(worldPointer == nullptr)
+        return detachedPosition;
+    return worldPointer->getBodyPosition(index);
 }
 
 inline VectorF PhysicsObject::getVelocity() const
 {
-    auto world = getWorld();
-    int variableSetIndex = world->getOldVariableSetIndex();
-    if(!affectedByGravity || isSupported())
-        return velocity[variableSetIndex];
-    float deltaTime = world->getCurrentTime() - objectTime[variableSetIndex];
-    return velocity[variableSetIndex] + deltaTime * gravityVector;
+    if(worldPointer == nullptr)
+        return detachedVelocity;
+    return worldPointer->getBodyVelocity(index);
+}
+
+inline shared_ptr<PhysicsObject> PhysicsObject::setConstraints(shared_ptr<const vector<PhysicsConstraint>> constraints)
+{
+    if(worldPointer != nullptr)
+        worldPointer->bodyConstraints[index] = constraints;
+    return shared_from_this();
+}
+
+inline bool PhysicsObject::isAffectedByGravity() const
+{
+    if(worldPointer == nullptr)
+        return false;
+    return worldPointer->bodyFlags[index] & PhysicsWorld::AffectedByGravityFlag;
+}
+
+inline bool PhysicsObject::isSupported() const
+{
+    if(worldPointer == nullptr)
+        return false;
+    return worldPointer->bodyFlags[index] & PhysicsWorld::SupportedFlag;
+}
+
+inline bool PhysicsObject::isStatic() const
+{
+    if(worldPointer == nullptr)
+        return true;
+    return worldPointer->bodyFlags[index] & PhysicsWorld::StaticFlag;
+}
+
+inline bool PhysicsObject::isDestroyed() const
+{
+    if(worldPointer == nullptr)
+        return true;
+    return worldPointer->bodyFlags[index] & PhysicsWorld::DestroyedFlag;
+}
+
+inline void PhysicsObject::destroy()
+{
+    if(worldPointer != nullptr)
+        worldPointer->bodyFlags[index] |= PhysicsWorld::DestroyedFlag;
+}
+
+inline VectorF PhysicsObject::getExtents() const
+{
+    if(worldPointer == nullptr)
+        return VectorF(0);
+    return worldPointer->bodyExtents[index];
+}
+
+inline PhysicsObject::Type PhysicsObject::getType() const
+{
+    if(worldPointer == nullptr)
+        return Type::Empty;
+    return worldPointer->bodyType[index];
+}
+
+inline const PhysicsProperties & PhysicsObject::getProperties() const
+{
+    if(worldPointer == nullptr)
+        return getDetachedProperties();
+    return worldPointer->bodyProperties[index];
 }
 
 inline void PhysicsObject::setNewState(PositionF newPosition, VectorF newVelocity)
 {
-    auto world = getWorld();
-    int variableSetIndex = world->getNewVariableSetIndex();
-    objectTime[variableSetIndex] = world->getCurrentTime();
-    newPosition += position[variableSetIndex] * newStateCount;
-    newVelocity += velocity[variableSetIndex] * newStateCount;
+    if(worldPointer == nullptr)
+        return;
+    PhysicsWorld & world = *worldPointer;
+    int variableSetIndex = world.getNewVariableSetIndex();
+    size_t & newStateCount = world.bodyNewStateCount[index];
+    world.bodyTime[variableSetIndex][index] = world.getCurrentTime();
+    newPosition += world.bodyPosition[variableSetIndex][index] * newStateCount;
+    newVelocity += world.bodyVelocity[variableSetIndex][index] * newStateCount;
     newStateCount++;
     newPosition /= newStateCount;
     newVelocity /= newStateCount;
     //cout << "new position : " << (VectorF)newPosition << " : new velocity : " << newVelocity << endl;
-    position[variableSetIndex] = newPosition;
-    velocity[variableSetIndex] = newVelocity;
-    world->changedObjects[(intptr_t)this] = shared_from_this();
-    latestUpdateTag++;
+    world.bodyPosition[variableSetIndex][index] = newPosition;
+    world.bodyVelocity[variableSetIndex][index] = newVelocity;
+    world.bodyFlags[index] |= PhysicsWorld::ChangedFlag;
+    world.bodyUpdateTag[index]++;
 }
 
 inline void PhysicsObject::setupNewState()
 {
-    auto world = getWorld();
-    int oldVariableSetIndex = world->getOldVariableSetIndex();
-    int newVariableSetIndex = world->getNewVariableSetIndex();
-    objectTime[newVariableSetIndex] = objectTime[oldVariableSetIndex];
-    position[newVariableSetIndex] = position[oldVariableSetIndex];
-    velocity[newVariableSetIndex] = velocity[oldVariableSetIndex];
-    newStateCount = 0;
+    if(worldPointer == nullptr)
+        return;
+    PhysicsWorld & world = *worldPointer;
+    int oldVariableSetIndex = world.getOldVariableSetIndex();
+    int newVariableSetIndex = world.getNewVariableSetIndex();
+    world.bodyTime[newVariableSetIndex][index] = world.bodyTime[oldVariableSetIndex][index];
+    world.bodyPosition[newVariableSetIndex][index] = world.bodyPosition[oldVariableSetIndex][index];
+    world.bodyVelocity[newVariableSetIndex][index] = world.bodyVelocity[oldVariableSetIndex][index];
+    world.bodyNewStateCount[index] = 0;
 }
 
 inline bool PhysicsObject::collides(const PhysicsObject & rt) const
 {
-    if(isEmpty() || rt.isEmpty())
+    assert(worldPointer == rt.worldPointer);
+    return collides(getPosition(), rt.getType(), rt.getPosition(), rt.getExtents());
+}
+
+inline bool PhysicsObject::collides(const CollisionShape & shape, PositionF shapePosition) const
+{
+    return collides(getPosition(), shape.type, shapePosition, shape.extents);
+}
+
+inline bool PhysicsObject::collides(PositionF lPosition, Type rType, PositionF rPosition, VectorF rExtents) const
+{
+    if(isEmpty() || rType == Type::Empty)
         return false;
-    auto world = getWorld();
-    assert(world == rt.getWorld());
-    PositionF lPosition = getPosition();
-    PositionF rPosition = rt.getPosition();
     if(lPosition.d != rPosition.d)
         return false;
+    VectorF extents = getExtents();
     VectorF lExtents = extents;
-    VectorF rExtents = rt.extents;
     VectorF extentsSum = lExtents + rExtents;
     VectorF deltaPosition = (VectorF)lPosition - (VectorF)rPosition;
     if(abs(deltaPosition.x) > PhysicsWorld::distanceEPS + extentsSum.x)
@@ -490,14 +764,14 @@ inline bool PhysicsObject::collides(const PhysicsObject & rt) const
         return false;
     if(abs(deltaPosition.z) > PhysicsWorld::distanceEPS + extentsSum.z)
         return false;
-    if(isBox() && rt.isBox())
+    if(isBox() && rType == Type::Box)
         return true;
-    if(isCylinder() && rt.isCylinder())
+    if(isCylinder() && rType == Type::Cylinder)
     {
         deltaPosition.y = 0;
         return abs(deltaPosition) <= extentsSum.x + PhysicsWorld::distanceEPS;
     }
-    if((isBox() && rt.isCylinder()) || (rt.isBox() && isCylinder()))
+    if((isBox() && rType == Type::Cylinder) || (rType == Type::Box && isCylinder()))
     {
         VectorF cylinderCenter;
         float cylinderRadius;
@@ -506,7 +780,7 @@ inline bool PhysicsObject::collides(const PhysicsObject & rt) const
         if(isBox())
         {
             cylinderCenter = (VectorF)rPosition;
-            cylinderRadius = rt.extents.x;
+            cylinderRadius = rExtents.x;
             boxCenter = (VectorF)lPosition;
             boxExtents = extents;
         }
@@ -515,7 +789,7 @@ inline bool PhysicsObject::collides(const PhysicsObject & rt) const
             cylinderCenter = (VectorF)lPosition;
             cylinderRadius = extents.x;
             boxCenter = (VectorF)rPosition;
-            boxExtents = rt.extents;
+            boxExtents = rExtents;
         }
         cylinderCenter.y = 0;
         boxCenter.y = 0;
@@ -532,243 +806,475 @@ inline bool PhysicsObject::collides(const PhysicsObject & rt) const
     return false;
 }
 
-inline void PhysicsWorld::runToTime(double stopTime)
+inline void PhysicsWorld::updateBroadphase(size_t body, VectorF minPosition, VectorF maxPosition, Dimension d)
 {
-    float stepDuration = 1 / 600.0f;
-    size_t stepCount = (size_t)ceil((stopTime - currentTime) / stepDuration - timeEPS);
-    for(size_t i = 1; i <= stepCount; i++)
+    // pad by half the largest gap that still counts as touching so bodies that touch always share a cell
+    VectorF extents = bodyExtents[body] + VectorF(2 * distanceEPS);
+    BroadphaseRange range;
+    range.minX = ifloor((minPosition.x - extents.x) * broadphaseScaleFactor);
+    range.maxX = ifloor((maxPosition.x + extents.x) * broadphaseScaleFactor);
+    range.minY = ifloor((minPosition.y - extents.y) * broadphaseScaleFactor);
+    range.maxY = ifloor((maxPosition.y + extents.y) * broadphaseScaleFactor);
+    range.minZ = ifloor((minPosition.z - extents.z) * broadphaseScaleFactor);
+    range.maxZ = ifloor((maxPosition.z + extents.z) * broadphaseScaleFactor);
+    range.d = d;
+    range.large = (size_t)(range.maxX - range.minX + 1) * (size_t)(range.maxY - range.minY + 1) * (size_t)(range.maxZ - range.minZ + 1) > broadphaseMaxCellCount;
+    if((bodyFlags[body] & InBroadphaseFlag) && range == bodyBroadphaseRange[body])
+        return;
+    removeFromBroadphase(body);
+    bodyBroadphaseRange[body] = range;
+    bodyFlags[body] |= InBroadphaseFlag;
+    if(range.large)
     {
-        if(i >= stepCount)
-            currentTime = stopTime;
-        else
-            currentTime += stepDuration;
-        bool anyCollisions = true;
-        for(size_t i = 0; i < 10 && anyCollisions; i++)
-        {
-            anyCollisions = false;
-            vector<shared_ptr<PhysicsObject>> objectsVector(objects.begin(), objects.end());
-            vector<pair<float, shared_ptr<PhysicsObject>>> temporaryObjectsVector;
-            temporaryObjectsVector.resize(objectsVector.size());
-            for(size_t i = 0; i < temporaryObjectsVector.size(); i++)
-                temporaryObjectsVector[i] = make_pair(objectsVector[i]->getPosition().y - objectsVector[i]->getExtents().y, objectsVector[i]);
-            sort(temporaryObjectsVector.begin(), temporaryObjectsVector.end(), [](pair<float, shared_ptr<PhysicsObject>> a, pair<float, shared_ptr<PhysicsObject>> b)
-            {
-                return get<0>(a) < get<0>(b);
-            });
-            for(size_t i = 0; i < temporaryObjectsVector.size(); i++)
-                objectsVector[i] = get<1>(temporaryObjectsVector[i]);
-            for(auto i = objectsVector.begin(); i != objectsVector.end(); i++)
+        broadphaseLargeBodies.push_back(body);
+        return;
+    }
+    for(int x = range.minX; x <= range.maxX; x++)
+    {
+        for(int y = range.minY; y <= range.maxY; y++)
+        {
+            for(int z = range.minZ; z <= range.maxZ; z++)
             {
-                shared_ptr<PhysicsObject> objectA = *i;
-                if(!objectA || objectA->isDestroyed())
-                    continue;
-                objectA->position[getOldVariableSetIndex()] = objectA->getPosition();
-                objectA->velocity[getOldVariableSetIndex()] = objectA->getVelocity();
-                objectA->objectTime[getOldVariableSetIndex()] = currentTime;
-                objectA->supported = false;
-                if(objectA->isEmpty())
-                {
-                    continue;
-                }
-                if(objectA->isStatic())
-                {
-                    objectA->supported = true;
-                    continue;
-                }
-                for(auto j = objectsVector.begin(); j != i; j++)
-                {
-                    shared_ptr<PhysicsObject> objectB = *j;
-                    if(!objectB || objectB->isDestroyed())
-                        continue;
-                    bool supported = objectA->isSupportedBy(*objectB);
-                    if(supported)
-                    {
-                        objectA->supported = true;
-                    }
-                }
+                broadphaseCells[PositionI(x, y, z, range.d)].push_back(body);
             }
-            constexpr size_t xScaleFactor = 5, zScaleFactor = 5;
-            constexpr size_t bigHashPrime = 14713, smallHashPrime = 91;
-            struct HashNode final
+        }
+    }
+}
+
+inline void PhysicsWorld::removeFromBroadphase(size_t body)
+{
+    if((bodyFlags[body] & InBroadphaseFlag) == 0)
+        return;
+    bodyFlags[body] &= ~InBroadphaseFlag;
+    const BroadphaseRange & range = bodyBroadphaseRange[body];
+    if(range.large)
+    {
+        removeFromList(broadphaseLargeBodies, body);
+        return;
+    }
+    for(int x = range.minX; x <= range.maxX; x++)
+    {
+        for(int y = range.minY; y <= range.maxY; y++)
+        {
+            for(int z = range.minZ; z <= range.maxZ; z++)
             {
-                HashNode * hashNext;
-                int x, z;
-                shared_ptr<PhysicsObject> object;
-            };
-            array<HashNode *, bigHashPrime> overallHashTable;
-            overallHashTable.fill(nullptr);
-            static thread_local HashNode * freeListHead = nullptr;
-            vector<shared_ptr<PhysicsObject>> collideObjectsList;
-            collideObjectsList.reserve(objects.size());
-            for(auto i = objects.begin(); i != objects.end();)
+                auto iter = broadphaseCells.find(PositionI(x, y, z, range.d));
+                assert(iter != broadphaseCells.end());
+                removeFromList(get<1>(*iter), body);
+                if(get<1>(*iter).empty())
+                    broadphaseCells.erase(iter);
+            }
+        }
+    }
+}
+
+/// calls fn(bodyB) once for every body that shares a broadphase cell with body
+template <typename Fn>
+inline void PhysicsWorld::forEachBroadphaseCandidate(size_t body, Fn fn)
+{
+    if((bodyFlags[body] & InBroadphaseFlag) == 0)
+        return;
+    if(bodyBroadphaseRange[body].large)
+    {
+        for(size_t bodyB : sortedBodies)
+        {
+            if(bodyB != body && (bodyFlags[bodyB] & InBroadphaseFlag))
+                fn(bodyB);
+        }
+        return;
+    }
+    uint64_t tag = ++broadphaseQueryTag;
+    bodyQueryTag[body] = tag;
+    for(size_t bodyB : broadphaseLargeBodies)
+    {
+        if(bodyQueryTag[bodyB] != tag)
+        {
+            bodyQueryTag[bodyB] = tag;
+            fn(bodyB);
+        }
+    }
+    const BroadphaseRange & range = bodyBroadphaseRange[body];
+    for(int x = range.minX; x <= range.maxX; x++)
+    {
+        for(int y = range.minY; y <= range.maxY; y++)
+        {
+            for(int z = range.minZ; z <= range.maxZ; z++)
             {
-                shared_ptr<PhysicsObject> o = *i;
-                if(!o || o->isDestroyed())
-                {
-                    i = objects.erase(i);
+                auto iter = broadphaseCells.find(PositionI(x, y, z, range.d));
+                if(iter == broadphaseCells.end())
                     continue;
-                }
-                o->setupNewState();
-                if(o->isEmpty())
+                for(size_t bodyB : get<1>(*iter))
                 {
-                    i++;
-                    continue;
-                }
-                PositionF position = o->getPosition();
-                VectorF extents = o->getExtents();
-                float fMinX = position.x - extents.x;
-                float fMaxX = position.x + extents.x;
-                int minX = ifloor(fMinX * xScaleFactor);
-                int maxX = iceil(fMaxX * xScaleFactor);
-                float fMinZ = position.z - extents.z;
-                float fMaxZ = position.z + extents.z;
-                int minZ = ifloor(fMinZ * zScaleFactor);
-                int maxZ = iceil(fMaxZ * zScaleFactor);
-                if((size_t)(maxZ - minZ) * (size_t)(maxX * minX) > (size_t)(xScaleFactor + 1) * (size_t)(zScaleFactor + 1))
-                {
-                    collideObjectsList.push_back(o);
-                }
-                else
-                {
-                    for(int xPosition = minX; xPosition <= maxX; xPosition++)
+                    if(bodyQueryTag[bodyB] != tag)
                     {
-                        for(int zPosition = minZ; zPosition <= maxZ; zPosition++)
-                        {
-                            HashNode * node = freeListHead;
-                            if(node != nullptr)
-                                freeListHead = freeListHead->hashNext;
-                            else
-                                node = new HashNode;
-                            size_t hash = (size_t)(xPosition * 8191 + zPosition) % bigHashPrime;
-                            node->hashNext = overallHashTable.at(hash);
-                            node->x = xPosition;
-                            node->z = zPosition;
-                            node->object = o;
-                            overallHashTable.at(hash) = node;
-                        }
+                        bodyQueryTag[bodyB] = tag;
+                        fn(bodyB);
                     }
                 }
-                i++;
             }
-            size_t startCollideObjectsListSize = collideObjectsList.size();
-            for(shared_ptr<PhysicsObject> objectA : objects)
+        }
+    }
+}
+
+inline size_t PhysicsWorld::findIsland(size_t body)
+{
+    while(bodyIsland[body] != body)
+    {
+        bodyIsland[body] = bodyIsland[bodyIsland[body]];
+        body = bodyIsland[body];
+    }
+    return body;
+}
+
+inline void PhysicsWorld::mergeIslands(size_t bodyA, size_t bodyB)
+{
+    bodyA = findIsland(bodyA);
+    bodyB = findIsland(bodyB);
+    if(bodyA == bodyB)
+        return;
+    if(bodySortIndex[bodyA] > bodySortIndex[bodyB]) // keep the lowest body as the root so the islands come out the same every time
+        swap(bodyA, bodyB);
+    bodyIsland[bodyB] = bodyA;
+}
+
+/// how far body might go in deltaTime
+inline float PhysicsWorld::getSubstepDistance(size_t body, float deltaTime) const
+{
+    float distance = abs(bodyVelocity[getOldVariableSetIndex()][body]) * deltaTime;
+    if((bodyFlags[body] & (AffectedByGravityFlag | SupportedFlag)) == AffectedByGravityFlag)
+        distance += 0.5f * abs(gravityVector) * deltaTime * deltaTime;
+    return distance;
+}
+
+/// the fraction of deltaPosition a box starting at startOffset from another box goes before they touch,
+/// or 1 if they don't. boxes that already touch at the start don't count
+inline float PhysicsWorld::getSweepHitFraction(VectorF startOffset, VectorF deltaPosition, VectorF extentsSum)
+{
+    float enter = 0, exit = 1;
+    bool touching = true;
+    auto sweepAxis = [&](float start, float delta, float extentsSum)->bool
+    {
+        if(abs(start) > extentsSum)
+            touching = false;
+        if(abs(delta) < eps)
+            return abs(start) <= extentsSum;
+        float t0 = (-extentsSum - start) / delta, t1 = (extentsSum - start) / delta;
+        if(t0 > t1)
+            swap(t0, t1);
+        enter = max(enter, t0);
+        exit = min(exit, t1);
+        return enter <= exit;
+    };
+    if(!sweepAxis(startOffset.x, deltaPosition.x, extentsSum.x))
+        return 1;
+    if(!sweepAxis(startOffset.y, deltaPosition.y, extentsSum.y))
+        return 1;
+    if(!sweepAxis(startOffset.z, deltaPosition.z, extentsSum.z))
+        return 1;
+    if(touching)
+        return 1;
+    return enter;
+}
+
+inline size_t PhysicsWorld::getSubstepCount(const size_t * bodies, size_t bodyCount, float deltaTime) const
+{
+    int oldSet = getOldVariableSetIndex();
+    float substepCount = 1;
+    for(size_t i = 0; i < bodyCount; i++)
+    {
+        size_t body = bodies[i];
+        float distance = getSubstepDistance(body, deltaTime);
+        VectorF extents = bodyExtents[body];
+        float maxDistance = max(maxSubstepDistance * min(extents.x, min(extents.y, extents.z)), (float)distanceEPS);
+        substepCount = max(substepCount, ceil(distance / maxDistance));
+        // bodies that might touch something need small steps to settle unless they're already resting
+        bool resting = (bodyFlags[body] & SupportedFlag) != 0 && abs(bodyVelocity[oldSet][body]) * deltaTime <= distanceEPS;
+        if(!resting && bodyCandidateStart[body] != bodyCandidateEnd[body])
+            substepCount = max(substepCount, ceil(deltaTime / contactStepDuration - timeEPS));
+    }
+    return (size_t)min(substepCount, (float)maxSubstepCount);
+}
+
+inline void PhysicsWorld::solveIsland(const size_t * bodies, size_t bodyCount, double startTime, double stopTime)
+{
+    int oldSet = getOldVariableSetIndex(), newSet = getNewVariableSetIndex();
+    size_t substepCount = getSubstepCount(bodies, bodyCount, stopTime - startTime);
+    float substepDuration = (stopTime - startTime) / substepCount;
+    uint64_t pairTestCount = 0;
+    for(size_t substep = 1; substep <= substepCount; substep++)
+    {
+        double time = (substep < substepCount ? startTime + (stopTime - startTime) * substep / substepCount : stopTime);
+        for(size_t i = 0; i < bodyCount; i++)
+        {
+            size_t body = bodies[i];
+            PositionF startPosition = bodyPosition[oldSet][body];
+            float distance = getSubstepDistance(body, substepDuration);
+            PositionF position = getBodyPosition(body, time);
+            bodyVelocity[oldSet][body] = getBodyVelocity(body, time);
+            VectorF extents = bodyExtents[body];
+            if(distance > maxSubstepDistance * min(extents.x, min(extents.y, extents.z)) && bodyType[body] != PhysicsObject::Type::Empty)
             {
-                if(objectA->isStatic())
-                    continue;
-                collideObjectsList.resize(startCollideObjectsListSize);
-                PositionF position = objectA->getPosition();
-                VectorF extents = objectA->getExtents();
-                float fMinX = position.x - extents.x;
-                float fMaxX = position.x + extents.x;
-                int minX = ifloor(fMinX * xScaleFactor);
-                int maxX = iceil(fMaxX * xScaleFactor);
-                float fMinZ = position.z - extents.z;
-                float fMaxZ = position.z + extents.z;
-                int minZ = ifloor(fMinZ * zScaleFactor);
-                int maxZ = iceil(fMaxZ * zScaleFactor);
-                array<HashNode *, smallHashPrime> perObjectHashTable;
-                perObjectHashTable.fill(nullptr);
-                for(int xPosition = minX; xPosition <= maxX; xPosition++)
+                // too fast for maxSubstepCount substeps to catch everything, so stop where the swept box first touches something.
+                // cylinders are swept as their bounding boxes
+                float hitFraction = 1;
+                VectorF deltaPosition = (VectorF)position - (VectorF)startPosition;
+                for(size_t j = bodyCandidateStart[body]; j < bodyCandidateEnd[body]; j++)
                 {
-                    for(int zPosition = minZ; zPosition <= maxZ; zPosition++)
-                    {
-                        size_t hash = (size_t)(xPosition * 8191 + zPosition);
-                        hash %= bigHashPrime;
-                        HashNode * node = overallHashTable.at(hash);
-                        while(node != nullptr)
-                        {
-                            if(node->x == xPosition && node->z == zPosition) // found one
-                            {
-                                size_t perObjectHash = std::hash<shared_ptr<PhysicsObject>>()(node->object) % smallHashPrime;
-                                HashNode ** pnode = &perObjectHashTable.at(perObjectHash);
-                                HashNode * node2 = *pnode;
-                                bool found = false;
-                                while(node2 != nullptr)
-                                {
-                                    if(node2->object == node->object)
-                                    {
-                                        found = true;
-                                        break;
-                                    }
-                                    pnode = &node2->hashNext;
-                                    node2 = *pnode;
-                                }
-                                if(!found)
-                                {
-                                    node2 = freeListHead;
-                                    if(node2 == nullptr)
-                                        node2 = new HashNode;
-                                    else
-                                        freeListHead = node2->hashNext;
-                                    node2->hashNext = perObjectHashTable.at(perObjectHash);
-                                    node2->object = node->object;
-                                    node2->x = node2->z = 0;
-                                    perObjectHashTable.at(perObjectHash) = node2;
-                                    collideObjectsList.push_back(node->object);
-                                }
-                            }
-                            node = node->hashNext;
-                        }
-                    }
+                    size_t otherBody = candidateBodies[j];
+                    if(bodyType[otherBody] == PhysicsObject::Type::Empty)
+                        continue;
+                    PositionF otherPosition = (bodyFlags[otherBody] & StaticFlag) ? getBodyPosition(otherBody, time) : bodyPosition[oldSet][otherBody];
+                    if(otherPosition.d != startPosition.d)
+                        continue;
+                    hitFraction = min(hitFraction, getSweepHitFraction((VectorF)startPosition - (VectorF)otherPosition, deltaPosition, extents + bodyExtents[otherBody]));
                 }
-                for(HashNode * node : perObjectHashTable)
+                if(hitFraction < 1)
+                    position = startPosition + deltaPosition * hitFraction;
+            }
+            bodyPosition[oldSet][body] = position;
+            bodyTime[oldSet][body] = time;
+        }
+        // static bodies aren't moved along with the island, so find where they are now
+        auto getPosition = [&](size_t body)->PositionF
+        {
+            if(bodyFlags[body] & StaticFlag)
+                return getBodyPosition(body, time);
+            return bodyPosition[oldSet][body];
+        };
+        auto getVelocity = [&](size_t body)->VectorF
+        {
+            if(bodyFlags[body] & StaticFlag)
+                return getBodyVelocity(body, time);
+            return bodyVelocity[oldSet][body];
+        };
+        for(size_t iteration = 0; iteration < maxSolverIterations; iteration++)
+        {
+            for(size_t i = 0; i < bodyCount; i++)
+            {
+                size_t body = bodies[i];
+                bodyPosition[newSet][body] = bodyPosition[oldSet][body];
+                bodyVelocity[newSet][body] = bodyVelocity[oldSet][body];
+                bodyTime[newSet][body] = time;
+                bodyNewStateCount[body] = 0;
+            }
+            // bodies can only be supported by bodies that are lower down, so do them in order
+            for(size_t i = 0; i < bodyCount; i++)
+            {
+                size_t bodyA = bodies[i];
+                const PhysicsObject & objectA = *bodyObject[bodyA];
+                PositionF positionA = bodyPosition[oldSet][bodyA];
+                bodyFlags[bodyA] &= ~SupportedFlag;
+                for(size_t j = bodyCandidateStart[bodyA]; j < bodyCandidateEnd[bodyA]; j++)
                 {
-                    while(node != nullptr)
+                    size_t bodyB = candidateBodies[j];
+                    if(bodySortIndex[bodyB] < bodySortIndex[bodyA] &&
+                       objectA.isSupportedBy(positionA, bodyType[bodyB], getPosition(bodyB), bodyExtents[bodyB], (bodyFlags[bodyB] & (SupportedFlag | StaticFlag)) != 0))
                     {
-                        HashNode * nextNode = node->hashNext;
-                        node->hashNext = freeListHead;
-                        freeListHead = node;
-                        node = nextNode;
+                        bodyFlags[bodyA] |= SupportedFlag;
+                        break;
                     }
                 }
-                for(auto objectB : collideObjectsList)
+            }
+            bool anyCollisions = false;
+            for(size_t i = 0; i < bodyCount; i++)
+            {
+                size_t bodyA = bodies[i];
+                PhysicsObject & objectA = *bodyObject[bodyA];
+                PositionF positionA = bodyPosition[oldSet][bodyA];
+                VectorF velocityA = bodyVelocity[oldSet][bodyA];
+                for(size_t j = bodyCandidateStart[bodyA]; j < bodyCandidateEnd[bodyA]; j++)
                 {
-                    if(objectA != objectB && objectA->collides(*objectB))
+                    size_t bodyB = candidateBodies[j];
+                    PositionF positionB = getPosition(bodyB);
+                    pairTestCount++;
+                    if(objectA.collides(positionA, bodyType[bodyB], positionB, bodyExtents[bodyB]))
                     {
                         anyCollisions = true;
-                        objectA->adjustPosition(*objectB);
-                        //cout << "collision" << endl;
+                        objectA.adjustPosition(positionA, velocityA, bodyType[bodyB], positionB, getVelocity(bodyB), bodyExtents[bodyB], (bodyFlags[bodyB] & StaticFlag) != 0, (bodyFlags[bodyB] & SupportedFlag) != 0, bodyProperties[bodyB]);
                     }
                 }
-                if(objectA->constraints)
+                if(bodyConstraints[bodyA])
                 {
-                    for(PhysicsConstraint constraint : *objectA->constraints)
+                    for(PhysicsConstraint constraint : *bodyConstraints[bodyA])
                     {
-                        constraint(objectA->position[getNewVariableSetIndex()], objectA->velocity[getNewVariableSetIndex()]);
+                        constraint(bodyPosition[newSet][bodyA], bodyVelocity[newSet][bodyA]);
                     }
                 }
             }
-            for(HashNode * node : overallHashTable)
+            for(size_t i = 0; i < bodyCount; i++)
             {
-                while(node != nullptr)
-                {
-                    HashNode * nextNode = node->hashNext;
-                    node->hashNext = freeListHead;
-                    freeListHead = node;
-                    node = nextNode;
-                }
+                size_t body = bodies[i];
+                bodyPosition[oldSet][body] = bodyPosition[newSet][body];
+                bodyVelocity[oldSet][body] = bodyVelocity[newSet][body];
+                bodyTime[oldSet][body] = time;
+            }
+            if(!anyCollisions)
+                break;
+        }
+    }
+    collisionPairTestCount += pairTestCount;
+}
+
+inline void PhysicsWorld::runToTime(double stopTime)
+{
+    double startTime = currentTime;
+    if(stopTime <= startTime)
+        return;
+    int oldSet = getOldVariableSetIndex(), newSet = getNewVariableSetIndex();
+    // drop destroyed bodies, bring the rest up to the start time and put everywhere they might
+    // go before stopTime in the broadphase
+    size_t liveCount = 0;
+    for(size_t body : sortedBodies)
+    {
+        if(bodyFlags[body] & DestroyedFlag)
+        {
+            removeFromBroadphase(body);
+            objects.erase(bodyObject[body]->shared_from_this());
+            continue;
+        }
+        PositionF position = getBodyPosition(body, startTime);
+        bodyVelocity[oldSet][body] = getBodyVelocity(body, startTime);
+        bodyPosition[oldSet][body] = position;
+        bodyTime[oldSet][body] = startTime;
+        bodyPosition[newSet][body] = position;
+        bodyVelocity[newSet][body] = bodyVelocity[oldSet][body];
+        bodyTime[newSet][body] = startTime;
+        bodyNewStateCount[body] = 0;
+        bodySortKey[body] = position.y - bodyExtents[body].y;
+        if(bodyType[body] != PhysicsObject::Type::Empty)
+        {
+            VectorF sweepMin = (VectorF)position, sweepMax = (VectorF)position;
+            VectorF endPosition = (VectorF)getBodyPosition(body, stopTime);
+            sweepMin = VectorF(min(sweepMin.x, endPosition.x), min(sweepMin.y, endPosition.y), min(sweepMin.z, endPosition.z));
+            sweepMax = VectorF(max(sweepMax.x, endPosition.x), max(sweepMax.y, endPosition.y), max(sweepMax.z, endPosition.z));
+            if(bodyFlags[body] & AffectedByGravityFlag) // it might fall off what it's standing on
+            {
+                float deltaTime = stopTime - startTime;
+                sweepMin.y = min(sweepMin.y, position.y + deltaTime * bodyVelocity[oldSet][body].y + 0.5f * deltaTime * deltaTime * gravityVector.y);
             }
-            swapVariableSetIndex();
+            updateBroadphase(body, sweepMin, sweepMax, position.d);
+        }
+        sortedBodies[liveCount++] = body;
+    }
+    sortedBodies.resize(liveCount);
+    // bodies only move a little each tick so the list is almost sorted already
+    for(size_t i = 1; i < sortedBodies.size(); i++)
+    {
+        size_t body = sortedBodies[i];
+        float sortKey = bodySortKey[body];
+        size_t j = i;
+        for(; j > 0 && bodySortKey[sortedBodies[j - 1]] > sortKey; j--)
+            sortedBodies[j] = sortedBodies[j - 1];
+        sortedBodies[j] = body;
+    }
+    for(size_t i = 0; i < sortedBodies.size(); i++)
+    {
+        size_t body = sortedBodies[i];
+        bodySortIndex[body] = i;
+        bodyIsland[body] = body;
+        bodyIslandIndex[body] = (size_t)-1;
+    }
+    // a moving body and every moving body it might touch go in the same island. an island only
+    // reads and writes its own bodies and static ones, so islands can be solved at the same time
+    candidateBodies.clear();
+    for(size_t bodyA : sortedBodies)
+    {
+        bodyCandidateStart[bodyA] = bodyCandidateEnd[bodyA] = candidateBodies.size();
+        if(bodyType[bodyA] == PhysicsObject::Type::Empty)
+        {
+            bodyFlags[bodyA] &= ~SupportedFlag;
+            continue;
+        }
+        if(bodyFlags[bodyA] & StaticFlag)
+        {
+            bodyFlags[bodyA] |= SupportedFlag;
+            continue;
+        }
+        forEachBroadphaseCandidate(bodyA, [&](size_t bodyB)
+        {
+            candidateBodies.push_back(bodyB);
+            if((bodyFlags[bodyB] & StaticFlag) == 0)
+                mergeIslands(bodyA, bodyB);
+        });
+        bodyCandidateEnd[bodyA] = candidateBodies.size();
+    }
+    islandStart.clear();
+    for(size_t body : sortedBodies)
+    {
+        if((bodyFlags[body] & StaticFlag) != 0 || bodyType[body] == PhysicsObject::Type::Empty)
+            continue;
+        size_t & island = bodyIslandIndex[findIsland(body)];
+        if(island == (size_t)-1)
+        {
+            island = islandStart.size();
+            islandStart.push_back(0);
+        }
+        islandStart[island]++;
+    }
+    size_t islandCount = islandStart.size();
+    size_t bodyCount = 0;
+    for(size_t & start : islandStart) // convert the sizes to where each island ends
+    {
+        bodyCount += start;
+        start = bodyCount;
+    }
+    islandStart.push_back(bodyCount);
+    islandBodies.resize(bodyCount);
+    for(auto iter = sortedBodies.rbegin(); iter != sortedBodies.rend(); ++iter) // backwards so each island ends up in order
+    {
+        size_t body = *iter;
+        if((bodyFlags[body] & StaticFlag) != 0 || bodyType[body] == PhysicsObject::Type::Empty)
+            continue;
+        islandBodies[--islandStart[bodyIslandIndex[findIsland(body)]]] = body;
+    }
+    function<void(size_t)> solveFn = [this, startTime, stopTime](size_t island)
+    {
+        solveIsland(&islandBodies[islandStart[island]], islandStart[island + 1] - islandStart[island], startTime, stopTime);
+    };
+    if(threadPool != nullptr)
+        threadPool->run(islandCount, solveFn);
+    else
+    {
+        for(size_t island = 0; island < islandCount; island++)
+            solveFn(island);
+    }
+    currentTime = stopTime;
+    for(size_t body : sortedBodies)
+    {
+        if(bodyFlags[body] & ChangedFlag)
+        {
+            bodyFlags[body] &= ~ChangedFlag;
+            changedObjects[(intptr_t)bodyObject[body]] = bodyObject[body]->shared_from_this();
         }
     }
 }
 
 inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
+{
+    adjustPosition(getPosition(), getVelocity(), rt.getType(), rt.getPosition(), rt.getVelocity(), rt.getExtents(), rt.isStatic(), rt.isSupported(), rt.getProperties());
+}
+
+inline void PhysicsObject::adjustPosition(const CollisionShape & shape, PositionF shapePosition)
+{
+    if(shape.empty())
+        return;
+    adjustPosition(getPosition(), getVelocity(), shape.type, shapePosition, VectorF(0), shape.extents, true, true, shape.properties);
+}
+
+inline void PhysicsObject::adjustPosition(PositionF aPosition, VectorF aVelocity, Type rType, PositionF bPosition, VectorF bVelocity, VectorF rExtents, bool rIsStatic, bool rIsSupported, const PhysicsProperties & rProperties)
 {
     if(isStatic())
         return;
-    PositionF aPosition = getPosition();
-    PositionF bPosition = rt.getPosition();
-    VectorF aVelocity = getVelocity();
-    VectorF bVelocity = rt.getVelocity();
+    VectorF extents = getExtents();
+    const PhysicsProperties & properties = getProperties();
     VectorF deltaPosition = aPosition - bPosition;
-    VectorF extentsSum = getExtents() + rt.getExtents();
+    VectorF extentsSum = extents + rExtents;
     VectorF deltaVelocity = aVelocity - bVelocity;
     float interpolationT = 0.5f;
-    if(rt.isStatic())
+    if(rIsStatic)
         interpolationT = 1.0f;
     float interpolationTY = interpolationT;
-    if(rt.isSupported())
+    if(rIsSupported)
         interpolationTY = 1.0f;
     VectorF normal(0);
     if(deltaPosition.x == 0)
@@ -777,7 +1283,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
         deltaPosition.y = PhysicsWorld::distanceEPS;
     if(deltaPosition.z == 0)
         deltaPosition.z = PhysicsWorld::distanceEPS;
-    if(isBox() && rt.isBox())
+    if(isBox() && rType == Type::Box)
     {
         VectorF AbsDeltaPosition = VectorF(abs(deltaPosition.x), abs(deltaPosition.y), abs(deltaPosition.z));
         VectorF surfaceOffset = extentsSum - AbsDeltaPosition + VectorF(PhysicsWorld::distanceEPS * 2);
@@ -797,7 +1303,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
             aPosition.z += interpolationT * normal.z * surfaceOffset.z;
         }
     }
-    else if(isCylinder() && rt.isCylinder())
+    else if(isCylinder() && rType == Type::Cylinder)
     {
         float absDeltaY = abs(deltaPosition.y);
         VectorF xzDeltaPosition = deltaPosition;
@@ -816,7 +1322,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
             aPosition += interpolationT * rSurfaceOffset * normal;
         }
     }
-    else if(isCylinder() && rt.isBox())
+    else if(isCylinder() && rType == Type::Box)
     {
         float absDeltaY = abs(deltaPosition.y);
         float ySurfaceOffset = extentsSum.y - absDeltaY + PhysicsWorld::distanceEPS * 2;
@@ -825,8 +1331,8 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
         VectorF horizontalNormal;
         float horizontalSurfaceOffset;
         VectorF absXZDeltaPosition = VectorF(abs(deltaPosition.x), 0, abs(deltaPosition.z));
-        VectorF xzSurfaceOffset = VectorF(extents.x, 0, extents.x) + rt.extents - absXZDeltaPosition + VectorF(PhysicsWorld::distanceEPS * 2, 0, PhysicsWorld::distanceEPS * 2);
-        if(absXZDeltaPosition.x < rt.extents.x && absXZDeltaPosition.z < rt.extents.z)
+        VectorF xzSurfaceOffset = VectorF(extents.x, 0, extents.x) + rExtents - absXZDeltaPosition + VectorF(PhysicsWorld::distanceEPS * 2, 0, PhysicsWorld::distanceEPS * 2);
+        if(absXZDeltaPosition.x < rExtents.x && absXZDeltaPosition.z < rExtents.z)
         {
             if(xzSurfaceOffset.x < xzSurfaceOffset.z)
             {
@@ -839,19 +1345,19 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
                 horizontalSurfaceOffset = xzSurfaceOffset.z;
             }
         }
-        else if(absXZDeltaPosition.x < rt.extents.x + PhysicsWorld::distanceEPS)
+        else if(absXZDeltaPosition.x < rExtents.x + PhysicsWorld::distanceEPS)
         {
             horizontalNormal = VectorF(0, 0, sgn(deltaPosition.z));
             horizontalSurfaceOffset = xzSurfaceOffset.z;
         }
-        else if(absXZDeltaPosition.z < rt.extents.z + PhysicsWorld::distanceEPS)
+        else if(absXZDeltaPosition.z < rExtents.z + PhysicsWorld::distanceEPS)
         {
             horizontalNormal = VectorF(sgn(deltaPosition.x), 0, 0);
             horizontalSurfaceOffset = xzSurfaceOffset.x;
         }
         else
         {
-            VectorF closestPoint = VectorF(limit(deltaPosition.x, -rt.extents.x, rt.extents.x), 0, limit(deltaPosition.z, -rt.extents.z, rt.extents.z));
+            VectorF closestPoint = VectorF(limit(deltaPosition.x, -rExtents.x, rExtents.x), 0, limit(deltaPosition.z, -rExtents.z, rExtents.z));
             VectorF v = xzDeltaPosition - closestPoint;
             float r = abs(v);
             horizontalSurfaceOffset = extents.x - r + PhysicsWorld::distanceEPS * 2;
@@ -868,7 +1374,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
             aPosition += interpolationT * horizontalSurfaceOffset * normal;
         }
     }
-    else if(isBox() && rt.isCylinder())
+    else if(isBox() && rType == Type::Cylinder)
     {
         float absDeltaY = abs(deltaPosition.y);
         float ySurfaceOffset = extentsSum.y - absDeltaY + PhysicsWorld::distanceEPS * 2;
@@ -877,7 +1383,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
         VectorF horizontalNormal;
         float horizontalSurfaceOffset;
         VectorF absXZDeltaPosition = VectorF(abs(deltaPosition.x), 0, abs(deltaPosition.z));
-        VectorF xzSurfaceOffset = VectorF(rt.extents.x, 0, rt.extents.x) + extents - absXZDeltaPosition + VectorF(PhysicsWorld::distanceEPS * 2, 0, PhysicsWorld::distanceEPS * 2);
+        VectorF xzSurfaceOffset = VectorF(rExtents.x, 0, rExtents.x) + extents - absXZDeltaPosition + VectorF(PhysicsWorld::distanceEPS * 2, 0, PhysicsWorld::distanceEPS * 2);
         if(absXZDeltaPosition.x < extents.x && absXZDeltaPosition.z < extents.z)
         {
             if(xzSurfaceOffset.x < xzSurfaceOffset.z)
@@ -906,7 +1412,7 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
             VectorF closestPoint = VectorF(limit(deltaPosition.x, -extents.x, extents.x), 0, limit(deltaPosition.z, -extents.z, extents.z));
             VectorF v = xzDeltaPosition - closestPoint;
             float r = abs(v);
-            horizontalSurfaceOffset = rt.extents.x - r + PhysicsWorld::distanceEPS * 2;
+            horizontalSurfaceOffset = rExtents.x - r + PhysicsWorld::distanceEPS * 2;
             horizontalNormal = normalize(v);
         }
         if(ySurfaceOffset < horizontalSurfaceOffset)
@@ -923,23 +1429,34 @@ inline void PhysicsObject::adjustPosition(const PhysicsObject & rt)
     else
         assert(false);
     if(dot(deltaVelocity, normal) < 0)
-        aVelocity -= ((1 + properties.bounceFactor * rt.properties.bounceFactor) * dot(deltaVelocity, normal) * normal + (1 - properties.slideFactor) * (1 - rt.properties.slideFactor) * (deltaVelocity - normal * dot(deltaVelocity, normal))) * interpolationT;
+        aVelocity -= ((1 + properties.bounceFactor * rProperties.bounceFactor) * dot(deltaVelocity, normal) * normal + (1 - properties.slideFactor) * (1 - rProperties.slideFactor) * (deltaVelocity - normal * dot(deltaVelocity, normal))) * interpolationT;
     else
         aVelocity = interpolate(0.5f, aVelocity, bVelocity);
     setNewState(aPosition, aVelocity);
 }
 
 inline bool PhysicsObject::isSupportedBy(const PhysicsObject & rt) const
+{
+    return isSupportedBy(getPosition(), rt.getType(), rt.getPosition(), rt.getExtents(), rt.isSupported() || rt.isStatic());
+}
+
+inline bool PhysicsObject::isSupportedBy(const CollisionShape & shape, PositionF shapePosition) const
+{
+    if(shape.empty())
+        return false;
+    return isSupportedBy(getPosition(), shape.type, shapePosition, shape.extents, true);
+}
+
+inline bool PhysicsObject::isSupportedBy(PositionF aPosition, Type rType, PositionF bPosition, VectorF rExtents, bool rIsSupportedOrStatic) const
 {
     if(isStatic())
         return false;
-    if(!rt.isSupported() && !rt.isStatic())
+    if(!rIsSupportedOrStatic)
         return false;
-    PositionF aPosition = getPosition();
-    PositionF bPosition = rt.getPosition();
     if(aPosition.d != bPosition.d)
         return false;
-    VectorF extentsSum = extents + rt.extents;
+    VectorF extents = getExtents();
+    VectorF extentsSum = extents + rExtents;
     VectorF deltaPosition = aPosition - bPosition;
     if(deltaPosition.x + PhysicsWorld::distanceEPS > -extentsSum.x && deltaPosition.x - PhysicsWorld::distanceEPS < extentsSum.x &&
        deltaPosition.z + PhysicsWorld::distanceEPS > -extentsSum.z && deltaPosition.z - PhysicsWorld::distanceEPS < extentsSum.z)
@@ -948,14 +1465,14 @@ inline bool PhysicsObject::isSupportedBy(const PhysicsObject & rt) const
         {
             if(deltaPosition.y < PhysicsWorld::distanceEPS * 4 + extentsSum.y)
             {
-                if(isBox() && rt.isBox())
+                if(isBox() && rType == Type::Box)
                     return true;
-                if(isCylinder() && rt.isCylinder())
+                if(isCylinder() && rType == Type::Cylinder)
                 {
                     deltaPosition.y = 0;
                     return abs(deltaPosition) <= extentsSum.x + PhysicsWorld::distanceEPS;
                 }
-                if((isBox() && rt.isCylinder()) || (rt.isBox() && isCylinder()))
+                if((isBox() && rType == Type::Cylinder) || (rType == Type::Box && isCylinder()))
                 {
                     VectorF cylinderCenter;
                     float cylinderRadius;
@@ -964,7 +1481,7 @@ inline bool PhysicsObject::isSupportedBy(const PhysicsObject & rt) const
                     if(isBox())
                     {
                         cylinderCenter = (VectorF)bPosition;
-                        cylinderRadius = rt.extents.x;
+                        cylinderRadius = rExtents.x;
                         boxCenter = (VectorF)aPosition;
                         boxExtents = extents;
                     }
@@ -973,7 +1490,7 @@ inline bool PhysicsObject::isSupportedBy(const PhysicsObject & rt) const
                         cylinderCenter = (VectorF)aPosition;
                         cylinderRadius = extents.x;
                         boxCenter = (VectorF)bPosition;
-                        boxExtents = rt.extents;
+                        boxExtents = rExtents;
                     }
                     cylinderCenter.y = 0;
                     boxCenter.y = 0;
@@ -993,12 +1510,34 @@ inline bool PhysicsObject::isSupportedBy(const PhysicsObject & rt) const
     return false;
 }
 
+inline void PhysicsObject::applyNewState(bool supported)
+{
+    if(worldPointer == nullptr)
+        return;
+    PhysicsWorld & world = *worldPointer;
+    int oldVariableSetIndex = world.getOldVariableSetIndex();
+    int newVariableSetIndex = world.getNewVariableSetIndex();
+    if(world.bodyNewStateCount[index] > 0)
+    {
+        world.bodyTime[oldVariableSetIndex][index] = world.bodyTime[newVariableSetIndex][index];
+        world.bodyPosition[oldVariableSetIndex][index] = world.bodyPosition[newVariableSetIndex][index];
+        world.bodyVelocity[oldVariableSetIndex][index] = world.bodyVelocity[newVariableSetIndex][index];
+    }
+    if(supported)
+        world.bodyFlags[index] |= PhysicsWorld::SupportedFlag;
+    else
+        world.bodyFlags[index] &= ~PhysicsWorld::SupportedFlag;
+}
+
 inline void PhysicsObject::setCurrentState(PositionF newPosition, VectorF newVelocity)
 {
-    auto i = world->getOldVariableSetIndex();
-    position[i] = newPosition;
-    velocity[i] = newVelocity;
-    objectTime[i] = world->getCurrentTime();
+    if(worldPointer == nullptr)
+        return;
+    PhysicsWorld & world = *worldPointer;
+    int variableSetIndex = world.getOldVariableSetIndex();
+    world.bodyPosition[variableSetIndex][index] = newPosition;
+    world.bodyVelocity[variableSetIndex][index] = newVelocity;
+    world.bodyTime[variableSetIndex][index] = world.getCurrentTime();
 }
 
 #endif // PHYSICS_OBJECT_H_INCLUDED
@@ -21,6 +21,7 @@
 #include <GL/gl.h>
 #include <string>
 #include <memory>
+#include <vector>
 #include "matrix.h"
 #include "vector.h"
 #include "stream.h"
@@ -34,6 +35,14 @@ void glLoadMatrix(Matrix mat);
 const float defaultFPS = 60;
 
 shared_ptr<Reader> getResourceReader(wstring resource);
+/// returns the directory (ending in a separator) for files that can be regenerated, or an empty string if there isn't one
+wstring getCacheDirectory();
+/// returns the names of the files in directory
+vector<wstring> listDirectory(wstring directory);
+/// replaces newName with oldName in one step, so readers see either the old or the new file. returns false on failure
+bool renameFile(wstring oldName, wstring newName);
+/// returns false on failure
+bool removeFile(wstring fileName);
 
 enum KeyboardKey
 {
@@ -29,6 +29,7 @@
 #include "script.h"
 #include "physics.h"
 #include <atomic>
+#include <mutex>
 #include <unordered_map>
 #include <unordered_set>
 #include <array>
@@ -212,89 +213,254 @@ public:
     }
     const shared_ptr<Scripting::DataObject> scriptIOObject;
     friend class RenderObject;
+    /// the last state sent to (or received from) the other end for one entity
+    struct ReplicatedState final
+    {
+        PositionF position;
+        VectorF velocity;
+        vector<uint8_t> scriptVariables;
+    };
+    /// per-client map from entity id to ReplicatedState
+    typedef unordered_map<Client::IdType, ReplicatedState> ReplicatedStateMap;
+    static ReplicatedStateMap &getReplicatedStates(Client &client)
+    {
+        return client.getPropertyReference<ReplicatedStateMap, 0>(Client::DataType::RenderObjectEntityReplicatedStates);
+    }
+private:
+    /// bits of the field mask sent after the entity id. a mask of zero means the entity was removed
+    enum ChangedField : uint8_t
+    {
+        FieldCreated = 1 << 0, // mesh, age and everything else follows
+        FieldPositionDelta = 1 << 1, // S16 offsets from the last position in units of 1 / positionScale
+        FieldPosition = 1 << 2, // absolute position and dimension
+        FieldVelocity = 1 << 3,
+        FieldScriptVariables = 1 << 4,
+        AllFields = (1 << 5) - 1
+    };
+    static constexpr float positionScale = 1024;
+    static constexpr float velocityEpsilon = 1.0f / 256;
+    static vector<uint8_t> serializeScriptVariables(const Scripting::DataObject &object)
+    {
+        MemoryWriter writer;
+        object.write(writer);
+        return std::move(writer.getBuffer());
+    }
+    static bool getPositionDelta(PositionF position, PositionF lastPosition, int16_t delta[3])
+    {
+        if(position.d != lastPosition.d)
+            return false;
+        float offsets[3] = {position.x - lastPosition.x, position.y - lastPosition.y, position.z - lastPosition.z};
+        for(int i = 0; i < 3; i++)
+        {
+            float v = std::round(offsets[i] * positionScale);
+            if(v < -32768 || v > 32767)
+                return false;
+            delta[i] = (int16_t)v;
+        }
+        return true;
+    }
+    static PositionF applyPositionDelta(PositionF lastPosition, const int16_t delta[3])
+    {
+        return PositionF(lastPosition.x + delta[0] / positionScale,
+                         lastPosition.y + delta[1] / positionScale,
+                         lastPosition.z + delta[2] / positionScale,
+                         lastPosition.d);
+    }
+    /// returns the fields of the current state that differ from state
+    unsigned getChangedFields(const ReplicatedState &state, const vector<uint8_t> &scriptVariables) const
+    {
+        unsigned retval = 0;
+        PositionF position = physicsObject->getPosition();
+        int16_t delta[3];
+        if(!getPositionDelta(position, state.position, delta))
+            retval |= FieldPosition;
+        else if(delta[0] != 0 || delta[1] != 0 || delta[2] != 0)
+            retval |= FieldPositionDelta;
+        VectorF velocityChange = physicsObject->getVelocity() - state.velocity;
+        if(std::abs(velocityChange.x) > velocityEpsilon || std::abs(velocityChange.y) > velocityEpsilon || std::abs(velocityChange.z) > velocityEpsilon)
+            retval |= FieldVelocity;
+        if(scriptVariables != state.scriptVariables)
+            retval |= FieldScriptVariables;
+        return retval;
+    }
 protected:
     static shared_ptr<RenderObjectEntity> read(Reader &reader, Client &client, shared_ptr<PhysicsWorld> physicsWorld)
     {
         Client::IdType id = Client::readIdNonNull(reader);
         shared_ptr<RenderObjectEntity> retval = client.getPtr<RenderObjectEntity>(id, Client::DataType::RenderObjectEntity);
+        ReplicatedStateMap &states = getReplicatedStates(client);
+        unsigned fields = reader.readLimitedU8(0, AllFields);
 
-        if(retval == nullptr)
+        if(fields == 0)
         {
-            retval = make_shared<RenderObjectEntity>();
-            client.setPtr(retval, id, Client::DataType::RenderObjectEntity);
+            if(retval == nullptr)
+                retval = make_shared<RenderObjectEntity>();
+            retval->clear();
+            client.removeId(id, Client::DataType::RenderObjectEntity);
+            states.erase(id);
+            return retval;
         }
 
-        retval->meshInternal = RenderObjectEntityMesh::readOrNull(reader, client);
-
-        if(retval->mesh() == nullptr)
+        if(fields & FieldCreated)
         {
-            client.removeId(id, Client::DataType::RenderObjectEntity);
-            return retval;
+            if(retval == nullptr)
+            {
+                retval = make_shared<RenderObjectEntity>();
+                client.setPtr(retval, id, Client::DataType::RenderObjectEntity);
+            }
+            retval->meshInternal = RenderObjectEntityMesh::readOrNull(reader, client);
+            if(retval->mesh() == nullptr)
+                throw InvalidDataValueException("RenderObjectEntity : created entity has no mesh");
+            retval->age = reader.readLimitedF32(0, 1e10);
+            fields = AllFields & ~FieldPositionDelta;
         }
+        else if(retval == nullptr || states.count(id) == 0)
+            throw InvalidDataValueException("RenderObjectEntity : update for unknown entity");
 
-        retval->age = reader.readLimitedF32(0, 1e10);
+        ReplicatedState &state = states[id];
         retval->updateAge = 0;
-        PositionF position;
-        position.x = reader.readFiniteF32();
-        position.y = reader.readFiniteF32();
-        position.z = reader.readFiniteF32();
-        position.d = reader.readDimension();
-        VectorF velocity;
-        velocity.x = reader.readFiniteF32();
-        velocity.y = reader.readFiniteF32();
-        velocity.z = reader.readFiniteF32();
+        if(fields & FieldPosition)
+        {
+            state.position.x = reader.readFiniteF32();
+            state.position.y = reader.readFiniteF32();
+            state.position.z = reader.readFiniteF32();
+            state.position.d = reader.readDimension();
+        }
+        else if(fields & FieldPositionDelta)
+        {
+            int16_t delta[3];
+            reader.readS16Array(delta, 3);
+            state.position = applyPositionDelta(state.position, delta);
+        }
+        if(fields & FieldVelocity)
+        {
+            state.velocity.x = reader.readFiniteF32();
+            state.velocity.y = reader.readFiniteF32();
+            state.velocity.z = reader.readFiniteF32();
+        }
         if(retval->physicsObject == nullptr)
         {
-            retval->physicsObject = retval->mesh()->constructPhysicsObject(position, velocity, physicsWorld);
+            retval->physicsObject = retval->mesh()->constructPhysicsObject(state.position, state.velocity, physicsWorld);
         }
         else
         {
-            retval->physicsObject->setCurrentState(position, velocity);
+            retval->physicsObject->setCurrentState(state.position, state.velocity);
         }
-        shared_ptr<Scripting::Data> newData = Scripting::Data::read(reader);
-        if(newData->type() != Scripting::Data::Type::Object)
-            throw IOException("RenderObjectEntity : script variables object is not an object");
-        auto newObj = dynamic_pointer_cast<Scripting::DataObject>(newData);
-        assert(newObj);
-        for(auto v : newObj->value)
+        if(fields & FieldScriptVariables)
         {
-            retval->scriptIOObject->value[get<0>(v)] = get<1>(v);
+            shared_ptr<Scripting::Data> newData = Scripting::Data::read(reader);
+            if(newData->type() != Scripting::Data::Type::Object)
+                throw IOException("RenderObjectEntity : script variables object is not an object");
+            auto newObj = dynamic_pointer_cast<Scripting::DataObject>(newData);
+            assert(newObj);
+            for(auto v : newObj->value)
+            {
+                retval->scriptIOObject->value[get<0>(v)] = get<1>(v);
+            }
         }
         return retval;
     }
+    /// writes only the fields that changed since the last write to this client.
+    /// the stream is reliable and ordered so the last state written is the state the client has.
     virtual void writeInternal(Writer &writer, Client &client) override
     {
-        Client::IdType id = client.getId(shared_from_this(), Client::DataType::RenderObjectEntity);
-
-        if(id == Client::NullId)
+        // the simulate thread reads states in needsUpdate, so they're only touched with client locked.
+        // only the writer adds or removes entries, so state stays valid while we write without the lock
+        Client::IdType id;
+        bool created = false;
+        unsigned fields;
+        PositionF lastPosition;
+        vector<uint8_t> scriptVariables;
+        ReplicatedState * pstate;
         {
-            id = client.makeId(shared_from_this(), Client::DataType::RenderObjectEntity);
+            LockedClient lockIt(client);
+            ReplicatedStateMap &states = getReplicatedStates(client);
+            id = client.getId(shared_from_this(), Client::DataType::RenderObjectEntity);
+
+            if(mesh() == nullptr)
+            {
+                if(id == Client::NullId)
+                    id = client.makeId(shared_from_this(), Client::DataType::RenderObjectEntity);
+                Client::writeId(writer, id);
+                writer.writeU8(0);
+                client.removeId(id, Client::DataType::RenderObjectEntity);
+                states.erase(id);
+                return;
+            }
+
+            if(id == Client::NullId)
+            {
+                id = client.makeId(shared_from_this(), Client::DataType::RenderObjectEntity);
+                created = true;
+            }
+
+            scriptVariables = serializeScriptVariables(*scriptIOObject);
+            pstate = &states[id];
+            if(created)
+                fields = FieldCreated | FieldPosition | FieldVelocity | FieldScriptVariables;
+            else
+                fields = getChangedFields(*pstate, scriptVariables);
+            lastPosition = pstate->position;
         }
 
         Client::writeId(writer, id);
+        writer.writeU8((uint8_t)fields);
 
-        if(mesh() != nullptr)
+        if(created)
         {
             mesh()->write(writer, client);
+            writer.writeF32(age);
         }
-        else
+        PositionF position = physicsObject->getPosition();
+        VectorF velocity = physicsObject->getVelocity();
+        int16_t delta[3];
+        if(fields & FieldPosition)
         {
-            Client::writeId(writer, Client::NullId);
-            client.removeId(id, Client::DataType::RenderObjectEntity);
-            return;
+            writer.writeF32(position.x);
+            writer.writeF32(position.y);
+            writer.writeF32(position.z);
+            writer.writeDimension(position.d);
+        }
+        else if(fields & FieldPositionDelta)
+        {
+            getPositionDelta(position, lastPosition, delta);
+            writer.writeS16Array(delta, 3);
+            // track what the client reconstructs so the rounding error doesn't accumulate
+            position = applyPositionDelta(lastPosition, delta);
+        }
+        if(fields & FieldVelocity)
+        {
+            writer.writeF32(velocity.x);
+            writer.writeF32(velocity.y);
+            writer.writeF32(velocity.z);
+        }
+        if(fields & FieldScriptVariables)
+        {
+            writer.writeBytes(scriptVariables.data(), scriptVariables.size());
         }
 
-        writer.writeF32(age);
-        PositionF position = physicsObject->getPosition();
-        writer.writeF32(position.x);
-        writer.writeF32(position.y);
-        writer.writeF32(position.z);
-        writer.writeDimension(position.d);
-        VectorF velocity = physicsObject->getVelocity();
-        writer.writeF32(velocity.x);
-        writer.writeF32(velocity.y);
-        writer.writeF32(velocity.z);
-        scriptIOObject->write(writer);
+        LockedClient lockIt(client);
+        ReplicatedState &state = *pstate;
+        if(fields & (FieldPosition | FieldPositionDelta))
+            state.position = position;
+        if(fields & FieldVelocity)
+            state.velocity = velocity;
+        if(fields & FieldScriptVariables)
+            state.scriptVariables = std::move(scriptVariables);
+    }
+public:
+    /// returns true if writing this entity to client would send anything. entities at rest don't need to be sent
+    bool needsUpdate(Client &client)
+    {
+        LockedClient lockIt(client); // writeInternal may be updating states on the writer's thread
+        Client::IdType id = client.getId(shared_from_this(), Client::DataType::RenderObjectEntity);
+        if(id == Client::NullId || mesh() == nullptr)
+            return true;
+        ReplicatedStateMap &states = getReplicatedStates(client);
+        auto iter = states.find(id);
+        if(iter == states.end())
+            return true;
+        return getChangedFields(get<1>(*iter), serializeScriptVariables(*scriptIOObject)) != 0;
     }
 public:
     virtual void render(Mesh dest, RenderLayer rl, Dimension d, Client & client, unsigned) override;
@@ -436,6 +602,31 @@ struct RenderObjectWorld final : public enable_shared_from_this<RenderObjectWorl
 
         return chunk;
     }
+    /// forgets the chunks in the column from (minX, minZ) to (maxX, maxZ) so that their blocks are requested again.
+    /// must have the client locked
+    void removeChunkColumn(int minX, int minZ, int maxX, int maxZ, Dimension d)
+    {
+        for(auto iter = chunks.begin(); iter != chunks.end();)
+        {
+            PositionI pos = iter->first;
+            shared_ptr<Chunk> chunk = iter->second;
+            if(pos.d != d || pos.x < minX || pos.x >= maxX || pos.z < minZ || pos.z >= maxZ)
+            {
+                iter++;
+                continue;
+            }
+            if(chunk != nullptr)
+            {
+                for(weak_ptr<Chunk> neighbor : {chunk->nx, chunk->px, chunk->ny, chunk->py, chunk->nz, chunk->pz})
+                {
+                    shared_ptr<Chunk> c = neighbor.lock();
+                    if(c != nullptr)
+                        c->invalidateMesh();
+                }
+            }
+            iter = chunks.erase(iter);
+        }
+    }
     class BlockIterator final /// Client must be locked when any member function is called
     {
     private:
@@ -759,6 +950,22 @@ private:
     shared_ptr<RenderObjectWorld> world;
     VectorF hitBoxMin, hitBoxMax;
     shared_ptr<PhysicsObjectConstructor> physicsConstructor;
+    /// the parts of the serialized form that are the same for every client.
+    /// built the first time any client needs this mesh so joining clients just copy bytes
+    struct SerializedPayload final
+    {
+        struct SerializedMesh final
+        {
+            uint32_t size;
+            Image texture; // written per client because image ids are per client
+            shared_ptr<const vector<uint8_t>> data;
+        };
+        array<SerializedMesh, 7> meshes;
+        vector<uint8_t> tail;
+    };
+    once_flag serializedPayloadFlag;
+    shared_ptr<const SerializedPayload> serializedPayload;
+    const SerializedPayload &getSerializedPayload();
 public:
     const bool nxBlocked, pxBlocked, nyBlocked, pyBlocked, nzBlocked, pzBlocked;
     const LightProperties lightProperties;
@@ -22,6 +22,16 @@
 #include "client.h"
 
 constexpr int GenerateThreadCount = 5;
+constexpr int NetworkThreadCount = 4;
+/// threads that move entities, including the simulate thread
+constexpr int EntityMoveThreadCount = 4;
+/// bytes per second sent to each remote client. clients on the local machine or network aren't limited
+constexpr double ClientBandwidthLimit = 1 << 20;
+constexpr double ServerTicksPerSecond = 20;
+/// how many late ticks the server runs back to back before it gives up and skips them
+constexpr unsigned ServerMaxCatchUpTicks = 5;
+/// how often the tick metrics are logged
+constexpr uint64_t ServerTickMetricsInterval = 60 * 20;
 
 void runServer(StreamServer &server);
 bool isClientValid(Client &client);
@@ -26,6 +26,7 @@
 #include <cstring>
 #include <memory>
 #include <list>
+#include <vector>
 #include "util.h"
 #include "dimension.h"
 #ifdef DEBUG_STREAM
@@ -104,6 +105,34 @@ private:
         }
         return v;
     }
+    static uint16_t getU16(const uint8_t * bytes)
+    {
+        return ((uint16_t)bytes[0] << 8) | bytes[1];
+    }
+    static uint32_t getU32(const uint8_t * bytes)
+    {
+        return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+    }
+    static constexpr size_t arrayChunkSize = 256;
+    template <typename T, typename U, size_t byteCount, U (*get)(const uint8_t *)>
+    void readArray(T * array, size_t count)
+    {
+        static_assert(sizeof(T) == sizeof(U), "array element is not the same size as the stored value");
+        uint8_t bytes[arrayChunkSize * byteCount];
+        U values[arrayChunkSize];
+        while(count > 0)
+        {
+            size_t currentCount = (count < arrayChunkSize ? count : arrayChunkSize);
+            readBytes(bytes, currentCount * byteCount);
+            for(size_t i = 0; i < currentCount; i++)
+            {
+                values[i] = get(&bytes[i * byteCount]);
+            }
+            memcpy((void *)array, (const void *)values, currentCount * sizeof(T));
+            array += currentCount;
+            count -= currentCount;
+        }
+    }
 public:
     Reader()
     {
@@ -114,7 +143,8 @@ public:
     {
     }
     virtual uint8_t readByte() = 0;
-    void readBytes(uint8_t * array, size_t count)
+    /// reads exactly count bytes; buffered readers should override this with a memcpy
+    virtual void readBytes(uint8_t * array, size_t count)
     {
         for(size_t i = 0; i < count; i++)
         {
@@ -135,8 +165,9 @@ public:
     }
     uint16_t readU16()
     {
-        uint16_t v = readU8();
-        uint16_t retval = (v << 8) | readU8();
+        uint8_t bytes[2];
+        readBytes(bytes, sizeof(bytes));
+        uint16_t retval = getU16(bytes);
         DUMP_V(readU16, retval);
         return retval;
     }
@@ -148,8 +179,9 @@ public:
     }
     uint32_t readU32()
     {
-        uint32_t v = readU16();
-        uint32_t retval = (v << 16) | readU16();
+        uint8_t bytes[4];
+        readBytes(bytes, sizeof(bytes));
+        uint32_t retval = getU32(bytes);
         DUMP_V(readU32, retval);
         return retval;
     }
@@ -161,8 +193,9 @@ public:
     }
     uint64_t readU64()
     {
-        uint64_t v = readU32();
-        uint64_t retval = (v << 32) | readU32();
+        uint8_t bytes[8];
+        readBytes(bytes, sizeof(bytes));
+        uint64_t retval = ((uint64_t)getU32(&bytes[0]) << 32) | getU32(&bytes[4]);
         DUMP_V(readU64, retval);
         return retval;
     }
@@ -324,10 +357,75 @@ public:
     {
         return (Dimension)readLimitedU8(0, (uint8_t)Dimension::Last - 1);
     }
+    void readU16Array(uint16_t * array, size_t count)
+    {
+        readArray<uint16_t, uint16_t, 2, getU16>(array, count);
+    }
+    void readS16Array(int16_t * array, size_t count)
+    {
+        readArray<int16_t, uint16_t, 2, getU16>(array, count);
+    }
+    void readU32Array(uint32_t * array, size_t count)
+    {
+        readArray<uint32_t, uint32_t, 4, getU32>(array, count);
+    }
+    void readS32Array(int32_t * array, size_t count)
+    {
+        readArray<int32_t, uint32_t, 4, getU32>(array, count);
+    }
+    void readF32Array(float * array, size_t count)
+    {
+        static_assert(sizeof(float) == sizeof(uint32_t), "float is not 32 bits");
+        readArray<float, uint32_t, 4, getU32>(array, count);
+    }
+    void readFiniteF32Array(float * array, size_t count)
+    {
+        readF32Array(array, count);
+        for(size_t i = 0; i < count; i++)
+        {
+            if(!isfinite(array[i]))
+            {
+                throw InvalidDataValueException("read value is not finite");
+            }
+        }
+    }
 };
 
 class Writer
 {
+private:
+    static void putU16(uint8_t * bytes, uint16_t v)
+    {
+        bytes[0] = (uint8_t)(v >> 8);
+        bytes[1] = (uint8_t)(v & 0xFF);
+    }
+    static void putU32(uint8_t * bytes, uint32_t v)
+    {
+        bytes[0] = (uint8_t)(v >> 24);
+        bytes[1] = (uint8_t)((v >> 16) & 0xFF);
+        bytes[2] = (uint8_t)((v >> 8) & 0xFF);
+        bytes[3] = (uint8_t)(v & 0xFF);
+    }
+    static constexpr size_t arrayChunkSize = 256;
+    template <typename T, typename U, size_t byteCount, void (*put)(uint8_t *, U)>
+    void writeArray(const T * array, size_t count)
+    {
+        static_assert(sizeof(T) == sizeof(U), "array element is not the same size as the stored value");
+        uint8_t bytes[arrayChunkSize * byteCount];
+        U values[arrayChunkSize];
+        while(count > 0)
+        {
+            size_t currentCount = (count < arrayChunkSize ? count : arrayChunkSize);
+            memcpy((void *)values, (const void *)array, currentCount * sizeof(T));
+            for(size_t i = 0; i < currentCount; i++)
+            {
+                put(&bytes[i * byteCount], values[i]);
+            }
+            writeBytes(bytes, currentCount * byteCount);
+            array += currentCount;
+            count -= currentCount;
+        }
+    }
 public:
     Writer()
     {
@@ -341,11 +439,18 @@ public:
     virtual void flush()
     {
     }
-    void writeBytes(const uint8_t * array, size_t count)
+    /// buffered writers should override this with a memcpy
+    virtual void writeBytes(const uint8_t * array, size_t count)
     {
         for(size_t i = 0; i < count; i++)
             writeByte(array[i]);
     }
+    /// writes the contents of an immutable buffer. writers that can send it
+    /// later override this to keep a reference instead of copying
+    virtual void writeSharedBytes(shared_ptr<const vector<uint8_t>> bytes)
+    {
+        writeBytes(bytes->data(), bytes->size());
+    }
     void writeU8(uint8_t v)
     {
         writeByte(v);
@@ -356,8 +461,9 @@ public:
     }
     void writeU16(uint16_t v)
     {
-        writeU8((uint8_t)(v >> 8));
-        writeU8((uint8_t)(v & 0xFF));
+        uint8_t bytes[2];
+        putU16(bytes, v);
+        writeBytes(bytes, sizeof(bytes));
     }
     void writeS16(int16_t v)
     {
@@ -365,8 +471,9 @@ public:
     }
     void writeU32(uint32_t v)
     {
-        writeU16((uint16_t)(v >> 16));
-        writeU16((uint16_t)(v & 0xFFFF));
+        uint8_t bytes[4];
+        putU32(bytes, v);
+        writeBytes(bytes, sizeof(bytes));
     }
     void writeS32(int32_t v)
     {
@@ -374,8 +481,10 @@ public:
     }
     void writeU64(uint64_t v)
     {
-        writeU32((uint64_t)(v >> 32));
-        writeU32((uint64_t)(v & 0xFFFFFFFFU));
+        uint8_t bytes[8];
+        putU32(&bytes[0], (uint32_t)(v >> 32));
+        putU32(&bytes[4], (uint32_t)(v & 0xFFFFFFFFU));
+        writeBytes(bytes, sizeof(bytes));
     }
     void writeS64(int64_t v)
     {
@@ -441,6 +550,27 @@ public:
     {
         writeU8((uint8_t)v);
     }
+    void writeU16Array(const uint16_t * array, size_t count)
+    {
+        writeArray<uint16_t, uint16_t, 2, putU16>(array, count);
+    }
+    void writeS16Array(const int16_t * array, size_t count)
+    {
+        writeArray<int16_t, uint16_t, 2, putU16>(array, count);
+    }
+    void writeU32Array(const uint32_t * array, size_t count)
+    {
+        writeArray<uint32_t, uint32_t, 4, putU32>(array, count);
+    }
+    void writeS32Array(const int32_t * array, size_t count)
+    {
+        writeArray<int32_t, uint32_t, 4, putU32>(array, count);
+    }
+    void writeF32Array(const float * array, size_t count)
+    {
+        static_assert(sizeof(float) == sizeof(uint32_t), "float is not 32 bits");
+        writeArray<float, uint32_t, 4, putU32>(array, count);
+    }
 };
 
 class FileReader final : public Reader
@@ -475,6 +605,15 @@ public:
         }
         return ch;
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        if(fread((void *)array, sizeof(uint8_t), count, f) != count)
+        {
+            if(ferror(f))
+                throw IOException("IO Error : can't read from file");
+            throw EOFException();
+        }
+    }
 };
 
 class FileWriter final : public Writer
@@ -503,6 +642,11 @@ public:
         if(fputc(v, f) == EOF)
             throw IOException("IO Error : can't write to file");
     }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        if(fwrite((const void *)array, sizeof(uint8_t), count, f) != count)
+            throw IOException("IO Error : can't write to file");
+    }
     virtual void flush() override
     {
         if(EOF == fflush(f))
@@ -532,6 +676,144 @@ public:
             throw EOFException();
         return mem.get()[offset++];
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        if(count > length - offset)
+            throw EOFException();
+        memcpy((void *)array, (const void *)&mem.get()[offset], count);
+        offset += count;
+    }
+    size_t position() const
+    {
+        return offset;
+    }
+};
+
+class MemoryWriter final : public Writer
+{
+private:
+    vector<uint8_t> buffer;
+public:
+    MemoryWriter()
+    {
+    }
+    virtual void writeByte(uint8_t v) override
+    {
+        buffer.push_back(v);
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        buffer.insert(buffer.end(), array, array + count);
+    }
+    const uint8_t * data() const
+    {
+        return buffer.data();
+    }
+    size_t size() const
+    {
+        return buffer.size();
+    }
+    bool empty() const
+    {
+        return buffer.empty();
+    }
+    void clear()
+    {
+        buffer.clear();
+    }
+    vector<uint8_t> & getBuffer()
+    {
+        return buffer;
+    }
+};
+
+/// collects output as a chain of refcounted buffers. small writes are copied into the last buffer and
+/// big shared buffers are linked in as they are, so they can be sent later without copying them
+class ChainWriter final : public Writer
+{
+public:
+    typedef vector<shared_ptr<const vector<uint8_t>>> Chain;
+    static constexpr size_t minSharedSize = 1024;
+private:
+    static constexpr size_t minTailSize = 4096, maxTailSize = 1 << 16;
+    Chain chain;
+    shared_ptr<vector<uint8_t>> tail; /// never reallocated, so pointers into it stay valid
+    size_t tailSize;
+    size_t totalSize;
+    uint8_t * appendToTail(size_t count)
+    {
+        if(tail == nullptr || tail->capacity() - tail->size() < count)
+        {
+            tail = make_shared<vector<uint8_t>>();
+            tail->reserve(max(tailSize, count));
+            if(tailSize < maxTailSize)
+                tailSize *= 2;
+            chain.push_back(tail);
+        }
+        size_t oldSize = tail->size();
+        tail->resize(oldSize + count);
+        totalSize += count;
+        return tail->data() + oldSize;
+    }
+public:
+    ChainWriter()
+        : tailSize(minTailSize), totalSize(0)
+    {
+    }
+    virtual void writeByte(uint8_t v) override
+    {
+        *appendToTail(1) = v;
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        memcpy((void *)appendToTail(count), (const void *)array, count);
+    }
+    virtual void writeSharedBytes(shared_ptr<const vector<uint8_t>> bytes) override
+    {
+        if(bytes->size() < minSharedSize)
+        {
+            writeBytes(bytes->data(), bytes->size());
+            return;
+        }
+        tail = nullptr;
+        chain.push_back(bytes);
+        totalSize += bytes->size();
+    }
+    /// appends count bytes and returns where they are so they can be filled in later
+    uint8_t * reserveBytes(size_t count)
+    {
+        return appendToTail(count);
+    }
+    /// writes everything to writer, sharing the buffers where writer supports it.
+    /// this writer starts a new buffer afterwards so the written ones don't change
+    void writeTo(Writer & writer)
+    {
+        tail = nullptr;
+        for(const shared_ptr<const vector<uint8_t>> & buffer : chain)
+        {
+            if(!buffer->empty())
+                writer.writeSharedBytes(buffer);
+        }
+    }
+    const Chain & getChain() const
+    {
+        return chain;
+    }
+    size_t size() const
+    {
+        return totalSize;
+    }
+    bool empty() const
+    {
+        return totalSize == 0;
+    }
+    void clear()
+    {
+        chain.clear();
+        tail = nullptr;
+        tailSize = minTailSize;
+        totalSize = 0;
+    }
 };
 
 class StreamPipe final
@@ -0,0 +1,141 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef THREAD_POOL_H_INCLUDED
+#define THREAD_POOL_H_INCLUDED
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <vector>
+#include <atomic>
+#include <exception>
+#include <cstdint>
+
+using namespace std;
+
+/// a fixed set of threads for running parallel loops. the calling thread helps with the loop too
+class ThreadPool final
+{
+    ThreadPool(const ThreadPool &) = delete;
+    const ThreadPool &operator =(const ThreadPool &) = delete;
+private:
+    vector<thread> threads;
+    mutex lock;
+    condition_variable startCond, doneCond;
+    const function<void(size_t)> *task;
+    size_t taskCount;
+    atomic_size_t nextIndex;
+    size_t busyThreadCount;
+    uint64_t generation;
+    bool done;
+    exception_ptr taskException;
+    void runTasks()
+    {
+        for(size_t i = nextIndex++; i < taskCount; i = nextIndex++)
+        {
+            try
+            {
+                (*task)(i);
+            }
+            catch(...)
+            {
+                lock_guard<mutex> lockIt(lock);
+                if(!taskException)
+                    taskException = current_exception();
+            }
+        }
+    }
+    void threadFn()
+    {
+        uint64_t lastGeneration = 0;
+        unique_lock<mutex> lockIt(lock);
+        while(true)
+        {
+            while(!done && generation == lastGeneration)
+                startCond.wait(lockIt);
+            if(done)
+                return;
+            lastGeneration = generation;
+            lockIt.unlock();
+            runTasks();
+            lockIt.lock();
+            if(--busyThreadCount == 0)
+                doneCond.notify_all();
+        }
+    }
+public:
+    /// threadCount is the number of threads besides the caller of run
+    explicit ThreadPool(size_t threadCount)
+        : task(nullptr), taskCount(0), nextIndex(0), busyThreadCount(0), generation(0), done(false)
+    {
+        for(size_t i = 0; i < threadCount; i++)
+        {
+            threads.push_back(thread([this]()
+            {
+                threadFn();
+            }));
+        }
+    }
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lockIt(lock);
+            done = true;
+        }
+        startCond.notify_all();
+        for(thread &t : threads)
+            t.join();
+    }
+    size_t threadCount() const
+    {
+        return threads.size() + 1;
+    }
+    /// calls fn(i) for every i in [0, count) spread over the threads and waits for all of them.
+    /// rethrows the first exception thrown by fn. not reentrant
+    void run(size_t count, function<void(size_t)> fn)
+    {
+        if(count == 0)
+            return;
+        if(count == 1 || threads.empty())
+        {
+            for(size_t i = 0; i < count; i++)
+                fn(i);
+            return;
+        }
+        {
+            lock_guard<mutex> lockIt(lock);
+            task = &fn;
+            taskCount = count;
+            nextIndex = 0;
+            busyThreadCount = threads.size();
+            taskException = nullptr;
+            generation++;
+        }
+        startCond.notify_all();
+        runTasks();
+        unique_lock<mutex> lockIt(lock);
+        while(busyThreadCount > 0)
+            doneCond.wait(lockIt);
+        task = nullptr;
+        if(taskException)
+            rethrow_exception(taskException);
+    }
+};
+
+#endif // THREAD_POOL_H_INCLUDED
@@ -0,0 +1,173 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef TICK_PROFILER_H_INCLUDED
+#define TICK_PROFILER_H_INCLUDED
+
+//#define ENABLE_TICK_PROFILER
+
+#ifdef ENABLE_TICK_PROFILER
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include <iostream>
+
+using namespace std;
+
+/// collects how long each phase of the simulate loop takes and prints the totals every reportInterval ticks.
+/// a phase started inside another is printed under it, and the outer phase's time includes it. only use it from one thread
+class TickProfiler final
+{
+    TickProfiler(const TickProfiler &) = delete;
+    const TickProfiler &operator =(const TickProfiler &) = delete;
+public:
+    typedef chrono::steady_clock clock;
+private:
+    static constexpr size_t noParent = (size_t)-1;
+    struct Phase final
+    {
+        const char *name;
+        size_t parent; /// the phase this one runs inside of, or noParent
+        clock::duration totalTime, maxTime, childTime;
+        uint64_t callCount, itemCount;
+        Phase(const char *name, size_t parent = noParent)
+            : name(name), parent(parent), totalTime(clock::duration::zero()), maxTime(clock::duration::zero()), childTime(clock::duration::zero()), callCount(0), itemCount(0)
+        {
+        }
+    };
+    vector<Phase> phases;
+    vector<size_t> activePhases;
+    uint64_t tickCount;
+    static constexpr uint64_t reportInterval = 200;
+    TickProfiler()
+        : tickCount(0)
+    {
+    }
+    void report(size_t parent, string indent)
+    {
+        for(Phase &phase : phases)
+        {
+            if(phase.parent != parent)
+                continue;
+            double totalMilliseconds = chrono::duration<double, milli>(phase.totalTime).count();
+            cout << indent << phase.name << " : " << totalMilliseconds / tickCount << "ms per tick";
+            if(phase.childTime > clock::duration::zero())
+                cout << " including the phases under it ("
+                     << chrono::duration<double, milli>(phase.totalTime - phase.childTime).count() / tickCount << "ms without)";
+            cout << ", max " << chrono::duration<double, milli>(phase.maxTime).count() << "ms, "
+                 << (double)phase.callCount / tickCount << " calls per tick";
+            if(phase.itemCount > 0)
+                cout << ", " << (double)phase.itemCount / tickCount << " items per tick";
+            cout << "\n";
+            report(&phase - &phases[0], indent + "    ");
+        }
+    }
+    void report()
+    {
+        cout << "Tick profile for " << tickCount << " ticks :\n";
+        report(noParent, "    ");
+        for(Phase &phase : phases)
+        {
+            phase = Phase(phase.name, phase.parent);
+        }
+        cout << flush;
+        tickCount = 0;
+    }
+public:
+    static TickProfiler &get()
+    {
+        static TickProfiler retval;
+        return retval;
+    }
+    /// returns the phase called name, adding it if it's new
+    size_t getPhase(const char *name)
+    {
+        for(size_t i = 0; i < phases.size(); i++)
+        {
+            if(strcmp(phases[i].name, name) == 0)
+                return i;
+        }
+        phases.push_back(Phase(name));
+        return phases.size() - 1;
+    }
+    void beginPhase(size_t phase)
+    {
+        if(phases[phase].parent == noParent && !activePhases.empty() && activePhases.back() != phase)
+            phases[phase].parent = activePhases.back();
+        activePhases.push_back(phase);
+    }
+    void endPhase(size_t phase, clock::duration time)
+    {
+        assert(!activePhases.empty() && activePhases.back() == phase);
+        activePhases.pop_back();
+        Phase &p = phases[phase];
+        p.totalTime += time;
+        if(time > p.maxTime)
+            p.maxTime = time;
+        p.callCount++;
+        if(!activePhases.empty())
+            phases[activePhases.back()].childTime += time;
+    }
+    void addItems(size_t phase, uint64_t count)
+    {
+        phases[phase].itemCount += count;
+    }
+    void endTick()
+    {
+        if(++tickCount >= reportInterval)
+            report();
+    }
+};
+
+/// adds the time from construction to destruction to a phase
+class TickProfilerScope final
+{
+    TickProfilerScope(const TickProfilerScope &) = delete;
+    const TickProfilerScope &operator =(const TickProfilerScope &) = delete;
+private:
+    size_t phase;
+    TickProfiler::clock::time_point startTime;
+public:
+    explicit TickProfilerScope(size_t phase)
+        : phase(phase), startTime(TickProfiler::clock::now())
+    {
+        TickProfiler::get().beginPhase(phase);
+    }
+    ~TickProfilerScope()
+    {
+        TickProfiler::get().endPhase(phase, TickProfiler::clock::now() - startTime);
+    }
+};
+
+#define TICK_PROFILER_CONCAT_HELPER(a, b) a ## b
+#define TICK_PROFILER_CONCAT(a, b) TICK_PROFILER_CONCAT_HELPER(a, b)
+#define TICK_PROFILER_PHASE_ID(name) ([]()->size_t {static size_t phase = TickProfiler::get().getPhase(name); return phase;}())
+/// times the rest of the enclosing scope as the phase called name
+#define PROFILE_TICK_PHASE(name) TickProfilerScope TICK_PROFILER_CONCAT(tickProfilerScope, __LINE__)(TICK_PROFILER_PHASE_ID(name))
+/// adds count to the items handled by the phase called name
+#define PROFILE_TICK_ITEMS(name, count) TickProfiler::get().addItems(TICK_PROFILER_PHASE_ID(name), count)
+#define PROFILE_TICK_END() TickProfiler::get().endTick()
+#else
+#define PROFILE_TICK_PHASE(name)
+#define PROFILE_TICK_ITEMS(name, count)
+#define PROFILE_TICK_END()
+#endif
+
+#endif // TICK_PROFILER_H_INCLUDED
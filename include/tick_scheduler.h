@@ -0,0 +1,89 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#ifndef TICK_SCHEDULER_H_INCLUDED
+#define TICK_SCHEDULER_H_INCLUDED
+
+#include <array>
+#include <cstdint>
+#include <ostream>
+
+using namespace std;
+
+/// runs a simulation at a fixed rate. ticks that fall behind run back to back to catch up,
+/// but never more than maxCatchUpTicks of them : past that the missed ticks are skipped
+class TickScheduler final
+{
+public:
+    struct Metrics final
+    {
+        /// bucket i counts ticks that took [i, i + 1) eighths of the tick budget. the last bucket counts the rest
+        static constexpr size_t histogramBucketCount = 16;
+        array<uint64_t, histogramBucketCount> durationHistogram;
+        uint64_t tickCount;
+        uint64_t overrunCount; /// ticks that took longer than the budget
+        uint64_t skippedTickCount; /// ticks dropped because we were too far behind
+        double totalDuration;
+        double maxDuration;
+        double tickBudget;
+        Metrics(double tickBudget = 0)
+            : tickCount(0), overrunCount(0), skippedTickCount(0), totalDuration(0), maxDuration(0), tickBudget(tickBudget)
+        {
+            durationHistogram.fill(0);
+        }
+        double averageDuration() const
+        {
+            if(tickCount == 0)
+                return 0;
+            return totalDuration / tickCount;
+        }
+        /// the duration that fraction of the ticks finished within, to the histogram's resolution
+        double durationPercentile(double fraction) const;
+    };
+private:
+    const double tickDuration;
+    const unsigned maxCatchUpTicks;
+    double nextTickTime;
+    double tickStartTime;
+    Metrics metrics;
+public:
+    explicit TickScheduler(double ticksPerSecond, unsigned maxCatchUpTicks = 5);
+    /// the simulated time each tick advances by
+    double getTickDuration() const
+    {
+        return tickDuration;
+    }
+    /// sleeps until the next tick is due
+    void beginTick();
+    /// records how long the tick started by beginTick took
+    void endTick();
+    const Metrics &getMetrics() const
+    {
+        return metrics;
+    }
+    /// returns the metrics collected since the last call and starts over
+    Metrics takeMetrics()
+    {
+        Metrics retval = metrics;
+        metrics = Metrics(tickDuration);
+        return retval;
+    }
+};
+
+ostream &operator <<(ostream &os, const TickScheduler::Metrics &metrics);
+
+#endif // TICK_SCHEDULER_H_INCLUDED
@@ -32,6 +32,7 @@
 #include <cstring>
 #include <mutex>
 #include <condition_variable>
+#include <chrono>
 #include <atomic>
 #include <iterator>
 
@@ -174,6 +175,12 @@ private:
     mutex lock;
     condition_variable_any cond;
     atomic_bool value;
+    void notify()
+    {
+        lock.lock(); // so a waiter can't miss the change between checking value and waiting
+        lock.unlock();
+        cond.notify_all();
+    }
 public:
     flag(bool value = false)
         : value(value)
@@ -183,7 +190,7 @@ public:
     {
         if(value.exchange(v) != v)
         {
-            cond.notify_all();
+            notify();
         }
 
         return *this;
@@ -194,7 +201,7 @@ public:
 
         if(retval != v)
         {
-            cond.notify_all();
+            notify();
         }
 
         return retval;
@@ -225,6 +232,23 @@ public:
 
         lock.unlock();
     }
+    /// waits until value == v or until timeout passes. returns true if value == v
+    template <typename Rep, typename Period>
+    bool waitFor(const chrono::duration<Rep, Period> &timeout, bool v = true)
+    {
+        if(v == value)
+        {
+            return true;
+        }
+
+        lock.lock();
+        bool retval = cond.wait_for(lock, timeout, [this, v]()
+        {
+            return v == value;
+        });
+        lock.unlock();
+        return retval;
+    }
     void set()
     {
         *this = true;
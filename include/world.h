@@ -24,7 +24,9 @@
 #error finish changing to new physics engine
 
 #include "chunk.h"
+#include "thread_pool.h"
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 
 using namespace std;
@@ -45,75 +47,127 @@ class World final : public enable_shared_from_this<World>
     const World &operator =(const World &) = delete;
 public:
     recursive_mutex lock;
+    /// held along with lock to change blocks, and by forEachEntityParallel while its tasks read blocks without lock
+    mutex blockWriteLock;
     WorldRandom random;
     const WorldGenerator generator;
 private:
     list<shared_ptr<Chunk>> chunksList;
-    struct EntityCompare final
+    /// entities are stored per chunk. an entity keeps its slot until it moves to another chunk or is destroyed
+    struct EntityPartition final
     {
-        int operator()(shared_ptr<EntityData> a, const PositionF &b) const
+        vector<shared_ptr<EntityData>> slots; // null for free slots
+        vector<size_t> freeSlots;
+        size_t size() const
         {
-            if(a->position.x < b.x)
-            {
-                return -1;
-            }
-
-            if(a->position.x > b.x)
-            {
-                return 1;
-            }
-
-            if(a->position.y < b.y)
-            {
-                return -1;
-            }
-
-            if(a->position.y > b.y)
+            return slots.size() - freeSlots.size();
+        }
+    };
+    struct EntitySlot final
+    {
+        ChunkPosition chunk;
+        size_t index;
+    };
+    unordered_map<ChunkPosition, EntityPartition> entityPartitions;
+    unordered_map<shared_ptr<EntityData>, EntitySlot> entitySlots;
+    void removeEntityFromPartition(shared_ptr<EntityData> e)
+    {
+        auto iter = entitySlots.find(e);
+        if(iter == entitySlots.end())
+            return;
+        auto partitionIter = entityPartitions.find(iter->second.chunk);
+        EntityPartition &partition = partitionIter->second;
+        partition.slots[iter->second.index] = nullptr;
+        partition.freeSlots.push_back(iter->second.index);
+        if(partition.size() == 0)
+            entityPartitions.erase(partitionIter);
+        entitySlots.erase(iter);
+    }
+    /// moves e to the partition for its current position or removes it if it was destroyed
+    void updateEntityPartition(shared_ptr<EntityData> e)
+    {
+        if(!e->good())
+        {
+            if(entitySlots.count(e) != 0)
             {
-                return 1;
+                removeEntityFromPartition(e);
+                destroyedEntities.push_back(e->entity);
             }
-
-            if(a->position.z < b.z)
+            return;
+        }
+        ChunkPosition chunk(e->position());
+        auto iter = entitySlots.find(e);
+        if(iter != entitySlots.end())
+        {
+            if(iter->second.chunk == chunk)
+                return;
+            removeEntityFromPartition(e);
+        }
+        EntityPartition &partition = entityPartitions[chunk];
+        size_t index;
+        if(partition.freeSlots.empty())
+        {
+            index = partition.slots.size();
+            partition.slots.push_back(e);
+        }
+        else
+        {
+            index = partition.freeSlots.back();
+            partition.freeSlots.pop_back();
+            partition.slots[index] = e;
+        }
+        entitySlots[e] = EntitySlot{chunk, index};
+    }
+    template <typename Function>
+    int forEachEntityInList(Function fn, const vector<shared_ptr<EntityData>> &list)
+    {
+        for(shared_ptr<EntityData> e : list)
+        {
+            if(!e->good())
             {
-                return -1;
+                updateEntityPartition(e);
+                continue;
             }
+            int retval;
 
-            if(a->position.z > b.z)
+            try
             {
-                return 1;
+                retval = fn(e);
             }
-
-            if(a->position.d < b.d)
+            catch(...)
             {
-                return -1;
+                updateEntityPartition(e);
+                throw;
             }
 
-            if(a->position.d > b.d)
-            {
-                return 1;
-            }
+            updateEntityPartition(e);
 
-            return 0;
-        }
-        int operator()(shared_ptr<EntityData> a, shared_ptr<EntityData> b) const
-        {
-            int retval = operator()(a, b->position);
-            if(retval == 0)
+            if(retval != 0)
             {
-                if(a < b)
-                    return -1;
-                if(a > b)
-                    return 1;
-                return 0;
+                return retval;
             }
-            return retval;
         }
-    };
-    balanced_tree<shared_ptr<EntityData>, EntityCompare> entities;
+
+        return 0;
+    }
     vector<shared_ptr<RenderObjectEntity>> destroyedEntities;
     unordered_map<ChunkPosition, shared_ptr<Chunk>> chunksMap;
+    /// the chunks forEachEntityParallel's tasks read blocks from, set on the threads running them.
+    /// blockWriteLock keeps them from changing, so they're read without lock
+    static thread_local const unordered_map<ChunkPosition, shared_ptr<Chunk>> * frozenChunks;
+    shared_ptr<Chunk> getFrozenChunk(ChunkPosition pos)
+    {
+        auto iter = frozenChunks->find(pos);
+        if(iter != frozenChunks->end())
+            return iter->second;
+        return make_shared<Chunk>(pos); // further than forEachEntityParallel expected anything to go : treat it as not generated
+    }
+    void getParallelEntities(vector<vector<shared_ptr<EntityData>>> &parallelChunks, vector<shared_ptr<EntityData>> &serialEntities,
+                             unordered_map<ChunkPosition, shared_ptr<Chunk>> &chunks, float deltaTime);
     shared_ptr<Chunk> getChunk(ChunkPosition pos)
     {
+        if(frozenChunks != nullptr)
+            return getFrozenChunk(pos);
         lock.lock();
         shared_ptr<Chunk> &c = chunksMap[pos];
 
@@ -191,133 +245,133 @@ public:
         lock_guard<recursive_mutex> lockIt(lock);
         return make(random.seed, generator);
     }
+    /// calls fn for every entity in the box from min to max.
+    /// only the chunks overlapping the box are visited.
     template <typename Function>
     int forEachEntityInRange(Function fn, VectorF min, VectorF max, Dimension d)
     {
         lock_guard<recursive_mutex> lockIt(lock);
-
-        for(auto i = entities.rangeBegin(PositionF(min, d)), end = entities.rangeEnd(PositionF(max, d));
-                i != end;)
+        ChunkPosition minChunk(min, d), maxChunk(max, d);
+        vector<shared_ptr<EntityData>> list;
+        auto addEntities = [&](const EntityPartition &partition)
         {
-            shared_ptr<EntityData> e = *i;
-            if(!e->good())
-            {
-                destroyedEntities.push_back(e->entity);
-                i = entities.erase(i);
-            }
-            else if(e->position.d == d && e->position.y >= min.y && e->position.y <= max.y && e->position.z >= min.z
-                    && e->position.z <= max.z)
+            for(shared_ptr<EntityData> e : partition.slots)
             {
-                i = entities.erase(i);
-                int retval;
-
-                try
-                {
-                    retval = fn(e);
-                }
-                catch(...)
-                {
-                    if(e->good())
-                    {
-                        entities.insert(e);
-                    }
-                    else
-                    {
-                        destroyedEntities.push_back(e->entity);
-                    }
-
-                    throw;
-                }
-
-                if(e->good())
-                {
-                    entities.insert(e);
-                }
-                else
-                {
-                    destroyedEntities.push_back(e->entity);
-                }
-
-                if(retval != 0)
+                if(e == nullptr)
+                    continue;
+                if(!e->good())
                 {
-                    return retval;
+                    list.push_back(e);
+                    continue;
                 }
+                PositionF position = e->position();
+                if(position.d == d && position.x >= min.x && position.x <= max.x && position.y >= min.y && position.y <= max.y && position.z >= min.z && position.z <= max.z)
+                    list.push_back(e);
             }
-            else
+        };
+        size_t chunkCount = (size_t)((maxChunk.x - minChunk.x) / ChunkSize + 1) * (size_t)((maxChunk.z - minChunk.z) / ChunkSize + 1);
+        if(chunkCount > entityPartitions.size()) // huge box : cheaper to scan the occupied chunks
+        {
+            for(auto &p : entityPartitions)
             {
-                i++;
+                ChunkPosition pos = p.first;
+                if(pos.d == d && pos.x >= minChunk.x && pos.x <= maxChunk.x && pos.z >= minChunk.z && pos.z <= maxChunk.z)
+                    addEntities(p.second);
+            }
+        }
+        else
+        {
+            for(int x = minChunk.x; x <= maxChunk.x; x += ChunkSize)
+            {
+                for(int z = minChunk.z; z <= maxChunk.z; z += ChunkSize)
+                {
+                    auto iter = entityPartitions.find(ChunkPosition(x, z, d));
+                    if(iter != entityPartitions.end())
+                        addEntities(iter->second);
+                }
             }
         }
 
-        return 0;
+        return forEachEntityInList(fn, list);
     }
     template <typename Function>
     int forEachEntity(Function fn)
     {
         lock_guard<recursive_mutex> lockIt(lock);
+        vector<shared_ptr<EntityData>> list;
+        list.reserve(entitySlots.size());
+        for(auto &p : entitySlots)
+        {
+            list.push_back(p.first);
+        }
 
-        for(auto i = entities.begin(), end = entities.end(); i != end;)
+        return forEachEntityInList(fn, list);
+    }
+    /// calls fn once for every entity. the entities whose descriptor says they can move in parallel
+    /// are handled a chunk at a time on pool's threads. those tasks read blocks without taking lock from a
+    /// snapshot of the chunks the entities can reach in deltaTime, which blockWriteLock keeps from changing.
+    /// the rest are handled on this thread with lock held. entities only change partitions once all of them are done
+    template <typename Function>
+    void forEachEntityParallel(Function fn, float deltaTime, ThreadPool &pool)
+    {
+        vector<vector<shared_ptr<EntityData>>> parallelChunks;
+        vector<shared_ptr<EntityData>> serialEntities;
+        unordered_map<ChunkPosition, shared_ptr<Chunk>> chunks;
+        getParallelEntities(parallelChunks, serialEntities, chunks, deltaTime);
         {
-            shared_ptr<EntityData> e = *i;
-            if(!e->good())
-            {
-                destroyedEntities.push_back(e->entity);
-                i = entities.erase(i);
-            }
-            else
+            lock_guard<mutex> lockBlocks(blockWriteLock);
+            pool.run(parallelChunks.size(), [&](size_t index)
             {
-                i = entities.erase(i);
-                int retval;
-
-                try
-                {
-                    retval = fn(e);
-                }
-                catch(...)
-                {
-                if(e->good())
+                struct FrozenChunksScope final
                 {
-                    entities.insert(e);
-                }
-                else
-                {
-                    destroyedEntities.push_back(e->entity);
-                }
-
-                    throw;
-                }
-
-                if(e->good())
-                {
-                    entities.insert(e);
-                }
-                else
-                {
-                    destroyedEntities.push_back(e->entity);
-                }
-                if(retval != 0)
+                    FrozenChunksScope(const unordered_map<ChunkPosition, shared_ptr<Chunk>> * chunks)
+                    {
+                        frozenChunks = chunks;
+                    }
+                    ~FrozenChunksScope()
+                    {
+                        frozenChunks = nullptr;
+                    }
+                } frozenChunksScope(&chunks);
+                for(shared_ptr<EntityData> e : parallelChunks[index])
                 {
-                    return retval;
+                    fn(e);
                 }
+            });
+        }
+        lock_guard<recursive_mutex> lockIt(lock);
+        for(const vector<shared_ptr<EntityData>> &chunkEntities : parallelChunks)
+        {
+            for(shared_ptr<EntityData> e : chunkEntities)
+            {
+                updateEntityPartition(e);
             }
         }
-
-        return 0;
+        forEachEntityInList([&fn](shared_ptr<EntityData> e)->int
+        {
+            fn(e);
+            return 0;
+        }, serialEntities);
     }
     void addEntity(const EntityData &e)
     {
-        lock_guard<recursive_mutex> lockIt(lock);
-        entities.insert(make_shared<EntityData>(e));
+        addEntity(make_shared<EntityData>(e));
     }
     void addEntity(EntityData &&e)
     {
-        lock_guard<recursive_mutex> lockIt(lock);
-        entities.insert(make_shared<EntityData>(move(e)));
+        addEntity(make_shared<EntityData>(move(e)));
     }
     void addEntity(shared_ptr<EntityData> e)
     {
         lock_guard<recursive_mutex> lockIt(lock);
-        entities.insert(e);
+        updateEntityPartition(e);
+    }
+    /// call after changing the position of an entity outside of forEachEntity so that range queries can find it
+    void entityMoved(shared_ptr<EntityData> e)
+    {
+        lock_guard<recursive_mutex> lockIt(lock);
+        if(entitySlots.count(e) != 0)
+            updateEntityPartition(e);
     }
 };
 
@@ -358,6 +412,13 @@ private:
     BlockIterator(shared_ptr<World> w, PositionI pos);
     static BlockData makeBedrock();
     static BlockData makeLitAir();
+    /// locks the world unless this thread reads frozen chunks for World::forEachEntityParallel
+    unique_lock<recursive_mutex> lockWorld() const
+    {
+        if(World::frozenChunks != nullptr)
+            return unique_lock<recursive_mutex>();
+        return unique_lock<recursive_mutex>(world()->lock);
+    }
 public:
     BlockData get()
     {
@@ -371,10 +432,15 @@ public:
             return makeLitAir();
         }
 
-        lock_guard<recursive_mutex> lock(world()->lock);
+        unique_lock<recursive_mutex> lockIt = lockWorld();
         VectorI rPos = (VectorI)pos - (VectorI)(PositionI)chunk->pos;
         return chunk->blocks[rPos.x][rPos.y][rPos.z];
     }
+    /// the number of times a block in this chunk has been set
+    uint64_t getChunkChangeCount() const
+    {
+        return chunk->changeCount;
+    }
     void set(BlockData newBlock)
     {
         if(pos.y < 0)
@@ -387,9 +453,12 @@ public:
             return;
         }
 
+        assert(World::frozenChunks == nullptr);
         lock_guard<recursive_mutex> lock(world()->lock);
+        lock_guard<mutex> lockBlocks(world()->blockWriteLock);
         VectorI rPos = (VectorI)pos - (VectorI)(PositionI)chunk->pos;
         chunk->blocks[rPos.x][rPos.y][rPos.z] = newBlock;
+        chunk->changeCount++;
         world()->addUpdate(pos);
     }
     BlockIterator &operator =(VectorI newPos)
@@ -406,7 +475,7 @@ public:
     }
     BlockIterator &operator +=(VectorI deltaPos)
     {
-        shared_ptr<lock_guard<recursive_mutex>> lock = nullptr;
+        unique_lock<recursive_mutex> lock;
         pos += deltaPos;
 
         if(deltaPos.x < -ChunkSize || deltaPos.x > ChunkSize || deltaPos.z < -ChunkSize
@@ -417,9 +486,9 @@ public:
 
         if(pos.x < chunk->pos.x)
         {
-            if(lock == nullptr)
+            if(!lock)
             {
-                lock = make_shared<lock_guard<recursive_mutex>>(world()->lock);
+                lock = lockWorld();
             }
 
             chunk = chunk->nx.lock();
@@ -432,9 +501,9 @@ public:
 
         if(pos.x >= chunk->pos.x + ChunkSize)
         {
-            if(lock == nullptr)
+            if(!lock)
             {
-                lock = make_shared<lock_guard<recursive_mutex>>(world()->lock);
+                lock = lockWorld();
             }
 
             chunk = chunk->px.lock();
@@ -447,9 +516,9 @@ public:
 
         if(pos.z < chunk->pos.z)
         {
-            if(lock == nullptr)
+            if(!lock)
             {
-                lock = make_shared<lock_guard<recursive_mutex>>(world()->lock);
+                lock = lockWorld();
             }
 
             chunk = chunk->nz.lock();
@@ -462,9 +531,9 @@ public:
 
         if(pos.z >= chunk->pos.z + ChunkSize)
         {
-            if(lock == nullptr)
+            if(!lock)
             {
-                lock = make_shared<lock_guard<recursive_mutex>>(world()->lock);
+                lock = lockWorld();
             }
 
             chunk = chunk->pz.lock();
@@ -488,7 +557,7 @@ public:
         {
             if(pos.x-- == chunk->pos.x)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->nx.lock();
 
                 if(chunk == nullptr)
@@ -504,7 +573,7 @@ public:
         {
             if(++pos.x == chunk->pos.x + ChunkSize)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->px.lock();
 
                 if(chunk == nullptr)
@@ -532,7 +601,7 @@ public:
         {
             if(pos.z-- == chunk->pos.z)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->nz.lock();
 
                 if(chunk == nullptr)
@@ -548,7 +617,7 @@ public:
         {
             if(++pos.z == chunk->pos.z + ChunkSize)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->pz.lock();
 
                 if(chunk == nullptr)
@@ -572,7 +641,7 @@ public:
         {
             if(pos.x-- == chunk->pos.x)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->nx.lock();
 
                 if(chunk == nullptr)
@@ -588,7 +657,7 @@ public:
         {
             if(++pos.x == chunk->pos.x + ChunkSize)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->px.lock();
 
                 if(chunk == nullptr)
@@ -616,7 +685,7 @@ public:
         {
             if(pos.z-- == chunk->pos.z)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->nz.lock();
 
                 if(chunk == nullptr)
@@ -632,7 +701,7 @@ public:
         {
             if(++pos.z == chunk->pos.z + ChunkSize)
             {
-                lock_guard<recursive_mutex> lockIt(world()->lock);
+                unique_lock<recursive_mutex> lockIt = lockWorld();
                 chunk = chunk->pz.lock();
 
                 if(chunk == nullptr)
@@ -700,11 +769,12 @@ inline void World::merge(shared_ptr<World> world)
         }
     }
 
-    for(auto i = world->entities.begin(); i != world->entities.end();)
+    for(auto &p : world->entitySlots)
     {
-        entities.insert(*i);
-        i = world->entities.erase(i);
+        updateEntityPartition(p.first);
     }
+    world->entitySlots.clear();
+    world->entityPartitions.clear();
 }
 
 #endif // WORLD_H_INCLUDED
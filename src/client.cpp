@@ -17,6 +17,7 @@
  */
 #include "client.h"
 #include "network_protocol.h"
+#include "network.h"
 #include "render_object.h"
 #include "platform.h"
 #include "game_version.h"
@@ -54,6 +55,7 @@ struct ClientState
 #warning finish implementing flying
     flag needState;
     UpdateList neededChunkList;
+    unordered_set<PositionI> requestedChunks;
     bool forwardDown = false, backwardDown = false, leftDown = false, rightDown = false, jumpDown = false, sneakDown = false;
     shared_ptr<RenderObjectEntity> player;
     ClientState()
@@ -100,7 +102,7 @@ struct ClientState
 
 namespace ClientImplementation
 {
-bool writeState(Writer &writer, ClientState *state)
+bool writeState(NetworkProtocol::FrameWriter &frameWriter, ClientState *state)
 {
     flag &needState = state->needState;
 
@@ -128,7 +130,7 @@ bool writeState(Writer &writer, ClientState *state)
             bool flying = state->paused || state->flying;
             float age = state->player ? state->player->age : 0;
             state->lock.unlock();
-            NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::UpdatePositionAndVelocity);
+            Writer &writer = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::UpdatePositionAndVelocity);
             writer.writeF32(pos.x);
             writer.writeF32(pos.y);
             writer.writeF32(pos.z);
@@ -141,7 +143,7 @@ bool writeState(Writer &writer, ClientState *state)
             writer.writeF32(viewDistance);
             writer.writeBool(flying);
             writer.writeF32(age);
-            writer.flush();
+            frameWriter.endMessage();
             return true;
         }
     }
@@ -153,7 +155,7 @@ void clientProcessWriter(Writer *pwriter, ClientState *state)
 {
     Writer &writer = *pwriter;
     //Client &client = state->client;
-    unordered_set<PositionI> chunksAlreadyRequsted;
+    NetworkProtocol::FrameWriter frameWriter;
 
     try
     {
@@ -161,34 +163,46 @@ void clientProcessWriter(Writer *pwriter, ClientState *state)
 
         while(!state->done)
         {
-            UpdateList neededChunkList = state->neededChunkList;
+            vector<PositionI> neededChunkList;
+            for(PositionI p : state->neededChunkList.updatesList)
+            {
+                if(get<1>(state->requestedChunks.insert(p)))
+                    neededChunkList.push_back(p);
+            }
             state->neededChunkList.clear();
             state->lock.unlock();
             bool didAnything = false;
 
-            if(writeState(writer, state)) {
+            if(writeState(frameWriter, state)) {
                 didAnything = true;
             }
 
-            for(PositionI p : neededChunkList.updatesList)
+            for(PositionI p : neededChunkList)
             {
-                if(!get<1>(chunksAlreadyRequsted.insert(p))) {
-                    continue;
-                }
-
-                writeState(writer, state);
-                NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::RequestChunk);
-                writer.writeS32(p.x);
-                writer.writeS32(p.y);
-                writer.writeS32(p.z);
-                writer.writeDimension(p.d);
-                writer.writeU32(RenderObjectWorld::Chunk::size);
-                writer.flush();
+                writeState(frameWriter, state);
+                Writer &messageWriter = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::RequestChunk);
+                messageWriter.writeS32(p.x);
+                messageWriter.writeS32(p.y);
+                messageWriter.writeS32(p.z);
+                messageWriter.writeDimension(p.d);
+                messageWriter.writeU32(RenderObjectWorld::Chunk::size);
+                frameWriter.endMessage();
                 didAnything = true;
                 //cout << "Client : send chunk request\n";
             }
 
-            if(!didAnything) {
+            for(Client::IdType id : Image::takeImageRequests(state->client))
+            {
+                Writer &messageWriter = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::RequestImage);
+                Client::writeId(messageWriter, id);
+                frameWriter.endMessage();
+                didAnything = true;
+            }
+
+            if(didAnything) {
+                frameWriter.writeFrame(writer);
+                writer.flush();
+            } else {
                 this_thread::sleep_for(chrono::milliseconds(1));
             }
 
@@ -207,104 +221,143 @@ void clientProcessWriter(Writer *pwriter, ClientState *state)
     state->lock.unlock();
 }
 
-void clientProcessReader(Reader *preader, ClientState *state)
+/// reads the body of a message from reader and applies it
+void handleServerEvent(NetworkProtocol::NetworkEvent event, Reader &reader, ClientState *state)
 {
-    Reader &reader = *preader;
     Client &client = state->client;
-    NetworkProtocol::NetworkEvent event;
 
-    try
+    switch(event)
     {
-        state->lock.lock();
+    case NetworkProtocol::NetworkEvent::UpdateRenderObjects:
+    {
+        PositionF playerPosition;
+        VectorF playerVelocity, playerAcceleration, playerDeltaAcceleration;
+        uint64_t readCount = reader.readU64();
 
-        while(!state->done)
+        for(uint64_t i = 0; i < readCount; i++)
         {
-            state->lock.unlock();
-            event = NetworkProtocol::readNetworkEvent(reader);
-
-            switch(event)
             {
-            case NetworkProtocol::NetworkEvent::UpdateRenderObjects:
+                LockedClient lockIt(client);
+                playerPosition = state->player->position;
+                playerVelocity = state->player->velocity;
+                playerAcceleration = state->player->acceleration;
+                playerDeltaAcceleration = state->player->deltaAcceleration;
+            }
+            shared_ptr<RenderObject> ro = RenderObject::read(reader, client);
+
+            if(ro && ro->type() == RenderObject::Type::Entity)
             {
-                PositionF playerPosition;
-                VectorF playerVelocity, playerAcceleration, playerDeltaAcceleration;
-                uint64_t readCount = reader.readU64();
+                shared_ptr<RenderObjectEntity> e = dynamic_pointer_cast<RenderObjectEntity>(ro);
+                LockedClient lockIt(client);
+                shared_ptr<RenderObjectWorld> world = RenderObjectWorld::getWorld(client);
+                world->handleReadEntity(e);
 
-                for(uint64_t i = 0; i < readCount; i++)
+                if(e == state->player)
                 {
-                    {
-                        LockedClient lockIt(client);
-                        playerPosition = state->player->position;
-                        playerVelocity = state->player->velocity;
-                        playerAcceleration = state->player->acceleration;
-                        playerDeltaAcceleration = state->player->deltaAcceleration;
-                    }
-                    shared_ptr<RenderObject> ro = RenderObject::read(reader, client);
-
-                    if(ro && ro->type() == RenderObject::Type::Entity)
-                    {
-                        shared_ptr<RenderObjectEntity> e = dynamic_pointer_cast<RenderObjectEntity>(ro);
-                        LockedClient lockIt(client);
-                        shared_ptr<RenderObjectWorld> world = RenderObjectWorld::getWorld(client);
-                        world->handleReadEntity(e);
-
-                        if(e == state->player)
-                        {
-                            if(!e->good())
-                                throw IOException("sent destroyed player");
-                            state->player->position = playerPosition;
-                            state->player->velocity = playerVelocity;
-                            state->player->acceleration = playerAcceleration;
-                            state->player->deltaAcceleration = playerDeltaAcceleration;
-                        }
-                    }
+                    if(!e->good())
+                        throw IOException("sent destroyed player");
+                    state->player->position = playerPosition;
+                    state->player->velocity = playerVelocity;
+                    state->player->acceleration = playerAcceleration;
+                    state->player->deltaAcceleration = playerDeltaAcceleration;
                 }
-
-                //cout << "Client : received " << readCount << " updated render objects\n";
-                state->lock.lock();
-                continue;
             }
+        }
 
-            case NetworkProtocol::NetworkEvent::RequestState:
-            {
-                state->lock.lock();
-                state->needState = true;
-                continue;
-            }
+        //cout << "Client : received " << readCount << " updated render objects\n";
+        return;
+    }
 
-            case NetworkProtocol::NetworkEvent::SendPlayer:
-            {
-                shared_ptr<RenderObject> ro = RenderObject::read(reader, client);
+    case NetworkProtocol::NetworkEvent::RequestState:
+    {
+        state->needState = true;
+        return;
+    }
 
-                if(!ro || ro->type() != RenderObject::Type::Entity)
-                {
-                    throw InvalidDataValueException("in receive SendPlayer : didn't read entity");
-                }
+    case NetworkProtocol::NetworkEvent::SendPlayer:
+    {
+        shared_ptr<RenderObject> ro = RenderObject::read(reader, client);
 
-                shared_ptr<RenderObjectEntity> player = dynamic_pointer_cast<RenderObjectEntity>(ro);
-                player->acceleration = gravityVector;
+        if(!ro || ro->type() != RenderObject::Type::Entity)
+        {
+            throw InvalidDataValueException("in receive SendPlayer : didn't read entity");
+        }
 
-                if(!player)
-                {
-                    throw InvalidDataValueException("in receive SendPlayer : didn't read entity (can't cast)");
-                }
-                else
-                {
-                    LockedClient lockIt(client);
-                    shared_ptr<RenderObjectWorld> world = RenderObjectWorld::getWorld(client);
-                    world->handleReadEntity(player);
-                }
+        shared_ptr<RenderObjectEntity> player = dynamic_pointer_cast<RenderObjectEntity>(ro);
+        player->acceleration = gravityVector;
 
-                state->lock.lock();
-                state->player = player;
-                continue;
-            }
+        if(!player)
+        {
+            throw InvalidDataValueException("in receive SendPlayer : didn't read entity (can't cast)");
+        }
+        else
+        {
+            LockedClient lockIt(client);
+            shared_ptr<RenderObjectWorld> world = RenderObjectWorld::getWorld(client);
+            world->handleReadEntity(player);
+        }
 
-            case NetworkProtocol::NetworkEvent::Last:
-                assert(false);
-            }
+        state->lock.lock();
+        state->player = player;
+        state->lock.unlock();
+        return;
+    }
+
+    case NetworkProtocol::NetworkEvent::SendImage:
+    {
+        Image::readRequested(reader, client);
+        return;
+    }
 
-            assert(false);
+    case NetworkProtocol::NetworkEvent::UnsubscribeChunk:
+    {
+        int x = reader.readS32();
+        int z = reader.readS32();
+        Dimension d = reader.readDimension();
+        if((x & ChunkModSizeMask) != 0 || (z & ChunkModSizeMask) != 0)
+            throw InvalidDataValueException("in receive UnsubscribeChunk : chunk position not aligned");
+        LockedClient lockIt(client);
+        // the server stopped sending updates for it, so forget it and request it again when it's in view
+        RenderObjectWorld::getWorld(client)->removeChunkColumn(x, z, x + ChunkSize, z + ChunkSize, d);
+        for(auto iter = state->requestedChunks.begin(); iter != state->requestedChunks.end();)
+        {
+            PositionI p = *iter;
+            if(p.d == d && p.x >= x && p.x < x + ChunkSize && p.z >= z && p.z < z + ChunkSize)
+                iter = state->requestedChunks.erase(iter);
+            else
+                iter++;
+        }
+        return;
+    }
+
+    case NetworkProtocol::NetworkEvent::UpdatePositionAndVelocity:
+    case NetworkProtocol::NetworkEvent::RequestChunk:
+    case NetworkProtocol::NetworkEvent::RequestImage:
+        throw InvalidDataValueException("server sent a client only message");
+
+    case NetworkProtocol::NetworkEvent::Last:
+        assert(false);
+    }
+
+    assert(false);
+}
+
+void clientProcessReader(Reader *preader, ClientState *state)
+{
+    NetworkProtocol::FrameReader frameReader(*preader);
+
+    try
+    {
+        state->lock.lock();
+
+        while(!state->done)
+        {
+            state->lock.unlock();
+            frameReader.readFrame([state](NetworkProtocol::NetworkEvent event, Reader &reader)
+            {
+                handleServerEvent(event, reader, state);
+            });
+            state->lock.lock();
         }
 
         state->lock.unlock();
@@ -712,8 +765,14 @@ void clientProcess(StreamRW &streamRW)
     TransformedMesh selectBoxMesh = makeSelectBoxMesh();
     shared_ptr<Reader> preader = streamRW.preader();
     shared_ptr<Writer> pwriter = streamRW.pwriter();
-    //preader = shared_ptr<Reader>(new ExpandReader(preader));
-    //pwriter = shared_ptr<Writer>(new CompressWriter(pwriter));
+    NetworkProtocol::CompressionMode compressionMode = NetworkProtocol::CompressionMode::None;
+    if(dynamic_cast<NetworkConnection *>(&streamRW) != nullptr)
+        compressionMode = NetworkProtocol::CompressionMode::Adaptive;
+    NetworkProtocol::writeCompressionMode(*pwriter, compressionMode);
+    NetworkProtocol::writeCachedImageHashes(*pwriter, Image::getCachedHashes());
+    pwriter->flush();
+    if(NetworkProtocol::readCompressionMode(*preader) == NetworkProtocol::CompressionMode::Adaptive)
+        preader = shared_ptr<Reader>(new AdaptiveExpandReader(preader));
     Reader &reader = *preader;
     Writer &writer = *pwriter;
     ClientState clientState;
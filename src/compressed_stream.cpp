@@ -20,6 +20,9 @@
 #include <iostream>
 #include <cstdlib>
 #include <thread>
+#include <chrono>
+
+constexpr uint64_t CompressWriter::noPosition;
 
 #if 0 // use demo code
 namespace
@@ -78,3 +81,79 @@ initializer init1([]()
 }
 #endif // use demo code
 
+#if 0 // use benchmark code
+namespace
+{
+class CountingWriter final : public Writer
+{
+public:
+    size_t count = 0;
+    virtual void writeByte(uint8_t) override
+    {
+        count++;
+    }
+    virtual void writeBytes(const uint8_t *, size_t count) override
+    {
+        this->count += count;
+    }
+};
+
+vector<uint8_t> makeBenchmarkData()
+{
+    MemoryWriter writer;
+    minstd_rand r(1);
+    for(int i = 0; i < 20000; i++) // looks like a stream of block meshes
+    {
+        writer.writeU64(r() % 1000);
+        writer.writeU32(12);
+        for(int j = 0; j < 12 * 3 * 3; j++)
+            writer.writeF32((float)(r() % 2));
+        for(int j = 0; j < 12 * 3 * 2; j++)
+            writer.writeF32((float)(r() % 64) / 64);
+        for(int j = 0; j < 12 * 3 * 4; j++)
+            writer.writeF32(1.0f);
+    }
+    for(int i = 0; i < 1000000; i++) // incompressible data
+        writer.writeU8(r());
+    return writer.getBuffer();
+}
+
+initializer init2([]()
+{
+    vector<uint8_t> input = makeBenchmarkData();
+    cout << "compression benchmark : " << input.size() << " bytes\n";
+    CountingWriter counter;
+    auto startTime = chrono::steady_clock::now();
+    {
+        CompressWriter w(counter);
+        for(size_t i = 0; i < input.size(); i += 1500) // network sized writes
+        {
+            w.writeBytes(&input[i], min<size_t>(1500, input.size() - i));
+            if(i % 15000 == 0)
+                w.flush();
+        }
+        w.flush();
+    }
+    double elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
+    cout << "compressed to " << counter.count << " bytes (" << 100.0 * counter.count / input.size() << "%)\n";
+    cout << "compress speed : " << input.size() / elapsed / 1e6 << " MB/s\n";
+
+    MemoryWriter compressed;
+    {
+        CompressWriter w(compressed);
+        w.writeBytes(input.data(), input.size());
+        w.flush();
+    }
+    shared_ptr<uint8_t> compressedData(new uint8_t[compressed.size()], [](uint8_t * v){delete []v;});
+    memcpy((void *)compressedData.get(), (const void *)compressed.data(), compressed.size());
+    ExpandReader reader(shared_ptr<Reader>(new MemoryReader(compressedData, compressed.size())));
+    vector<uint8_t> output(input.size());
+    startTime = chrono::steady_clock::now();
+    reader.readBytes(output.data(), output.size());
+    elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
+    cout << "expand speed : " << output.size() / elapsed / 1e6 << " MB/s\n";
+    cout << (output == input ? "round trip matches\n" : "round trip DOESN'T match\n");
+    exit(0);
+});
+}
+#endif // use benchmark code
@@ -37,6 +37,8 @@ shared_ptr<RenderObjectEntity> EntityBlock::getEntity(EntityData & data, shared_
     assert(eData);
     if(data.entity == nullptr)
     {
+        static mutex meshsLock; // onMove runs on several threads at once
+        lock_guard<mutex> lockIt(meshsLock);
         static shared_ptr<unordered_map<BlockDescriptorPtr, shared_ptr<RenderObjectEntityMesh>>> meshs_static = nullptr;
         if(meshs_static == nullptr)
         {
@@ -57,104 +59,51 @@ shared_ptr<RenderObjectEntity> EntityBlock::getEntity(EntityData & data, shared_
     return data.entity;
 }
 
-void EntityBlock::onMove(EntityData & data, shared_ptr<World> world, float deltaTimeIn) const
+void EntityBlock::onMove(EntityData & data, shared_ptr<World> world, float deltaTime) const
 {
     getEntity(data, world);
-    data.deltaAcceleration = VectorF(0);
-    data.acceleration = gravityVector;
-    int count = iceil(deltaTimeIn * abs(data.velocity) / 0.5 + 1);
-    BlockIterator bi = world->get((PositionI)data.position);
-    data.entity->acceleration = data.acceleration;
-    data.entity->deltaAcceleration = data.deltaAcceleration;
-    auto pphysicsObject = make_shared<PhysicsBox>((VectorF)data.position, physicsExtents(), data.velocity, data.entity->acceleration, data.entity->deltaAcceleration, data.position.d, physicsProperties());
-    PhysicsBox & physicsObject = *pphysicsObject;
-    for(int step = 0; step < count; step++)
+    auto eData = dynamic_pointer_cast<ExtraData>(data.extraData);
+    assert(eData);
+    assert(data.physicsObject);
+    PhysicsObject & physicsObject = *data.physicsObject;
+    PositionF startPosition = physicsObject.getPosition();
+    BlockIterator bi = world->get((PositionI)startPosition);
+    if(eData->sleeping)
     {
-        float deltaTime = deltaTimeIn / count;
-        data.entity->age += deltaTime;
-        int zeroCount = 0;
-        while(deltaTime * deltaTime * absSquared(data.velocity) > eps * eps)
+        if(physicsObject.getVelocity() == VectorF(0) && startPosition == eData->restPosition && getNeighborhoodChangeCount(bi) == eData->neighborhoodChangeCount)
         {
-            bool supported = false;
-            PhysicsCollision firstCollision(data.position + deltaTime * data.velocity + deltaTime * deltaTime * 0.5f * data.entity->acceleration + deltaTime * deltaTime * deltaTime * (1 / 6.0f) * data.entity->deltaAcceleration, data.velocity + deltaTime * data.entity->acceleration + deltaTime * deltaTime * 0.5f * data.entity->deltaAcceleration, VectorF(0), deltaTime);
-            physicsObject.reInit((VectorF)data.position, physicsExtents(), data.velocity, data.entity->acceleration, data.entity->deltaAcceleration);
-            for(int dx = -1; dx <= 1; dx++)
+            data.entity->age += deltaTime;
+            if(data.entity->age > 15)
             {
-                for(int dy = -1; dy <= 1; dy++)
-                {
-                    for(int dz = -1; dz <= 1; dz++)
-                    {
-                        BlockIterator curBI = bi;
-                        curBI += VectorI(dx, dy, dz);
-                        shared_ptr<PhysicsObject> otherObject;
-                        if(curBI.get().good())
-                            otherObject = curBI.get().desc->getPhysicsObject(curBI.position());
-                        else
-                            otherObject = static_pointer_cast<PhysicsObject>(make_shared<PhysicsBox>((VectorI)curBI.position() + VectorF(0.5), VectorF(0.5), VectorF(0), VectorF(0), VectorF(0), curBI.position().d, PhysicsProperties(PhysicsProperties::INFINITE_MASS, 1, 0)));
-                        assert(otherObject);
-                        {
-                            bool filled = false;
-                            float newY;
-                            switch(otherObject->type())
-                            {
-                            case PhysicsObject::Type::Box:
-                            {
-                                const PhysicsBox * pbox = dynamic_cast<const PhysicsBox *>(otherObject.get());
-                                VectorF min = pbox->center - pbox->extents;
-                                VectorF max = pbox->center + pbox->extents;
-                                if(min.x <= curBI.position().x && max.x >= curBI.position().x + 1 &&
-                                   min.y <= curBI.position().y && max.y >= curBI.position().y + 1 &&
-                                   min.z <= curBI.position().z && max.z >= curBI.position().z + 1)
-                                {
-                                    newY = max.y + physicsObject.extents.y;
-                                    filled = true;
-                                }
-                                VectorF temp;
-                                if(isBoxCollision(pbox->center, pbox->extents, physicsObject.center - VectorF(0, eps * 10, 0), physicsObject.extents, temp) && !isBoxCollision(pbox->center, pbox->extents, physicsObject.center, physicsObject.extents, temp))
-                                {
-                                    supported = true;
-                                }
-                                break;
-                            }
-                            case PhysicsObject::Type::None:
-                                break;
-                            }
-                            if(filled && zeroCount >= 2 && dx == 0 && dy == 0 && dz == 0)
-                            {
-                                firstCollision.time = 0;
-                                firstCollision.newPosition = data.position;
-                                firstCollision.newPosition.y = newY;
-                                firstCollision.newVelocity = VectorF(0);
-                                firstCollision.collisionNormal = VectorF(0, 1, 0);
-                                break;
-                            }
-                        }
-                        PhysicsCollision collision = physicsObject.collide(otherObject, deltaTime);
-                        if(collision.valid)
-                        {
-                            if(collision.time < eps)
-                            {
-                                if(zeroCount > 25)
-                                    collision.valid = false;
-                                else
-                                    zeroCount++;
-                            }
-                            else
-                                zeroCount = 0;
-                        }
-                        if(collision.valid && collision.time < firstCollision.time)
-                            firstCollision = collision;
-                    }
-                }
+                data.clear();
             }
-            deltaTime -= firstCollision.time;
-            data.setPosition(firstCollision.newPosition + eps * (2 + abs(firstCollision.newVelocity)) * firstCollision.collisionNormal);
-            data.setVelocity(firstCollision.newVelocity);
-            data.setAcceleration(data.entity->acceleration + data.entity->deltaAcceleration * firstCollision.time);
+            return;
         }
+        eData->sleeping = false;
+        eData->restTickCount = 0;
     }
+    data.entity->age += deltaTime;
+    // the physics world moves us, so just push us back out of the blocks we ended up in
+    collideWithBlocks(physicsObject, bi, VectorI(-1), VectorI(1));
     if(data.entity->age > 15)
     {
         data.clear();
+        return;
+    }
+    PositionF position = physicsObject.getPosition();
+    VectorF velocity = physicsObject.getVelocity();
+    if(abs(velocity) < sleepSpeed && absSquared((VectorF)position - (VectorF)startPosition) < sleepDistance * sleepDistance && position.d == startPosition.d)
+    {
+        if(++eData->restTickCount >= ticksBeforeSleep)
+        {
+            eData->sleeping = true;
+            eData->restPosition = position;
+            eData->neighborhoodChangeCount = getNeighborhoodChangeCount(world->get((PositionI)position));
+            physicsObject.setCurrentState(position, VectorF(0));
+        }
+    }
+    else
+    {
+        eData->restTickCount = 0;
     }
 }
@@ -18,8 +18,14 @@
 #include "image.h"
 #include "png_decoder.h"
 #include "platform.h"
+#include "compressed_stream.h"
 #include <cstring>
+#include <cstdio>
+#include <cerrno>
+#include <cassert>
+#include <atomic>
 #include <iostream>
+#include <unordered_set>
 
 Image::Image(wstring resourceName)
 {
@@ -84,6 +90,7 @@ void Image::setPixel(int x, int y, Color c)
 
     copyOnWrite();
     data->textureValid = false;
+    data->encoded = nullptr;
     uint8_t *pixel = &data->data[BytesPerPixel * (x + y * data->w)];
     pixel[0] = c.ri();
     pixel[1] = c.gi();
@@ -211,6 +218,247 @@ void Image::copyOnWrite()
     data->lock.lock();
 }
 
+namespace
+{
+/// the same per-row filters as PNG
+enum class RowFilter : uint8_t
+{
+    None,
+    Sub,
+    Up,
+    Average,
+    Paeth,
+    Last
+};
+
+inline uint8_t paethPredictor(uint8_t a, uint8_t b, uint8_t c)
+{
+    int p = (int)a + (int)b - (int)c;
+    int pa = abs(p - (int)a), pb = abs(p - (int)b), pc = abs(p - (int)c);
+    if(pa <= pb && pa <= pc)
+        return a;
+    if(pb <= pc)
+        return b;
+    return c;
+}
+
+/// returns the value that is added to the filtered byte at index i to get the original
+inline uint8_t getPrediction(RowFilter filter, const uint8_t * row, const uint8_t * priorRow, size_t i, size_t bytesPerPixel)
+{
+    uint8_t a = (i >= bytesPerPixel ? row[i - bytesPerPixel] : 0);
+    uint8_t b = (priorRow != nullptr ? priorRow[i] : 0);
+    uint8_t c = (i >= bytesPerPixel && priorRow != nullptr ? priorRow[i - bytesPerPixel] : 0);
+    switch(filter)
+    {
+    case RowFilter::None:
+    case RowFilter::Last:
+        return 0;
+    case RowFilter::Sub:
+        return a;
+    case RowFilter::Up:
+        return b;
+    case RowFilter::Average:
+        return (uint8_t)(((unsigned)a + (unsigned)b) / 2);
+    case RowFilter::Paeth:
+        return paethPredictor(a, b, c);
+    }
+    return 0;
+}
+
+uint64_t hashPixels(unsigned w, unsigned h, const uint8_t * pixels, size_t size)
+{
+    // FNV-1a
+    uint64_t retval = 0xCBF29CE484222325ULL;
+    const uint64_t prime = 0x100000001B3ULL;
+    uint8_t header[8] = {(uint8_t)(w >> 24), (uint8_t)(w >> 16), (uint8_t)(w >> 8), (uint8_t)w, (uint8_t)(h >> 24), (uint8_t)(h >> 16), (uint8_t)(h >> 8), (uint8_t)h};
+    for(uint8_t v : header)
+        retval = (retval ^ v) * prime;
+    for(size_t i = 0; i < size; i++)
+        retval = (retval ^ pixels[i]) * prime;
+    return retval;
+}
+
+/// filters each row with whichever filter gives the smallest sum of absolute differences then compresses the result
+vector<uint8_t> encodePixels(unsigned w, unsigned h, const uint8_t * pixels, size_t bytesPerPixel)
+{
+    shared_ptr<MemoryWriter> output = make_shared<MemoryWriter>();
+    CompressWriter writer(output);
+    size_t rowSize = w * bytesPerPixel;
+    vector<uint8_t> filtered(rowSize), bestFiltered(rowSize);
+    for(size_t y = 0; y < h; y++)
+    {
+        const uint8_t * row = &pixels[y * rowSize];
+        const uint8_t * priorRow = (y > 0 ? &pixels[(y - 1) * rowSize] : nullptr);
+        RowFilter bestFilter = RowFilter::None;
+        size_t bestCost = ~(size_t)0;
+        for(int filter = 0; filter < (int)RowFilter::Last; filter++)
+        {
+            size_t cost = 0;
+            for(size_t i = 0; i < rowSize; i++)
+            {
+                filtered[i] = row[i] - getPrediction((RowFilter)filter, row, priorRow, i, bytesPerPixel);
+                cost += abs((int)(int8_t)filtered[i]);
+            }
+            if(cost < bestCost)
+            {
+                bestCost = cost;
+                bestFilter = (RowFilter)filter;
+                bestFiltered.swap(filtered);
+            }
+        }
+        writer.writeU8((uint8_t)bestFilter);
+        writer.writeBytes(bestFiltered.data(), rowSize);
+    }
+    writer.flush();
+    return std::move(output->getBuffer());
+}
+
+void decodePixels(const vector<uint8_t> & encoded, unsigned w, unsigned h, uint8_t * pixels, size_t bytesPerPixel)
+{
+    shared_ptr<uint8_t> data(new uint8_t[encoded.size()], [](uint8_t * v)
+    {
+        delete []v;
+    });
+    memcpy((void *)data.get(), (const void *)encoded.data(), encoded.size());
+    ExpandReader reader(make_shared<MemoryReader>(data, encoded.size()));
+    size_t rowSize = w * bytesPerPixel;
+    for(size_t y = 0; y < h; y++)
+    {
+        uint8_t * row = &pixels[y * rowSize];
+        const uint8_t * priorRow = (y > 0 ? &pixels[(y - 1) * rowSize] : nullptr);
+        RowFilter filter = (RowFilter)reader.readLimitedU8(0, (uint8_t)RowFilter::Last - 1);
+        reader.readBytes(row, rowSize);
+        for(size_t i = 0; i < rowSize; i++)
+            row[i] += getPrediction(filter, row, priorRow, i, bytesPerPixel);
+    }
+}
+
+const wchar_t * const cacheFileSuffix = L".image";
+const wchar_t * const tempFileSuffix = L".tmp";
+
+wstring getCacheFileName(uint64_t hash)
+{
+    wstring dir = getCacheDirectory();
+    if(dir.empty())
+        return L"";
+    wchar_t name[17];
+    swprintf(name, 17, L"%016llx", (unsigned long long)hash);
+    return dir + name + cacheFileSuffix;
+}
+
+void removeCachedImage(uint64_t hash)
+{
+    wstring fileName = getCacheFileName(hash);
+    if(!fileName.empty())
+        removeFile(fileName);
+}
+
+atomic_uint_fast64_t nextTempFileIndex(0);
+
+void storeCachedImage(uint64_t hash, unsigned w, unsigned h, const vector<uint8_t> & encoded)
+{
+    wstring fileName = getCacheFileName(hash);
+    if(fileName.empty())
+        return;
+    // write a temporary file and move it into place so a crash or a full disk can't leave a truncated entry
+    wstring tempFileName = fileName + L"." + to_wstring(nextTempFileIndex++) + tempFileSuffix;
+    try
+    {
+        {
+            FileWriter writer(tempFileName);
+            writer.writeU32(w);
+            writer.writeU32(h);
+            writer.writeU32(encoded.size());
+            writer.writeBytes(encoded.data(), encoded.size());
+            writer.flush();
+        }
+        if(!renameFile(tempFileName, fileName))
+            throw IOException(string("IO Error : ") + strerror(errno));
+    }
+    catch(IOException & e)
+    {
+        cerr << "Warning : can't cache image : " << e.what() << endl;
+        removeFile(tempFileName);
+    }
+}
+
+bool isSizeValid(unsigned w, unsigned h, size_t bytesPerPixel)
+{
+    return w == 0 || h <= SIZE_MAX / bytesPerPixel / w;
+}
+
+uint32_t getMaxEncodedSize(unsigned w, unsigned h, size_t bytesPerPixel)
+{
+    assert(isSizeValid(w, h, bytesPerPixel));
+    // every byte could be a literal code
+    size_t rawSize = (size_t)w * h * bytesPerPixel;
+    const size_t limit = (UINT32_MAX - 64) / LZ77CodeType::byteCount;
+    if(rawSize > limit || h > limit - rawSize)
+        return UINT32_MAX;
+    return LZ77CodeType::byteCount * (rawSize + h) + 64;
+}
+
+/// reads the encoded pixels, decodes them into pixels and checks them against hash. returns the encoded pixels
+vector<uint8_t> readEncodedPixels(Reader & reader, unsigned w, unsigned h, uint64_t hash, uint8_t * pixels, size_t bytesPerPixel)
+{
+    vector<uint8_t> encoded;
+    encoded.resize(reader.readLimitedU32(0, getMaxEncodedSize(w, h, bytesPerPixel)));
+    reader.readBytes(encoded.data(), encoded.size());
+    decodePixels(encoded, w, h, pixels, bytesPerPixel);
+    if(hashPixels(w, h, pixels, bytesPerPixel * w * h) != hash)
+        throw InvalidDataValueException("image content doesn't match its hash");
+    return encoded;
+}
+
+/// decodes the cached image into pixels. returns false and removes the cache entry if it's missing or bad
+bool loadCachedImage(uint64_t hash, unsigned w, unsigned h, uint8_t * pixels, size_t bytesPerPixel)
+{
+    wstring fileName = getCacheFileName(hash);
+    if(fileName.empty())
+        return false;
+    try
+    {
+        FileReader reader(fileName);
+        if(reader.readU32() != w || reader.readU32() != h)
+            throw InvalidDataValueException("cached image has the wrong size");
+        readEncodedPixels(reader, w, h, hash, pixels, bytesPerPixel);
+        return true;
+    }
+    catch(exception & e)
+    {
+        cerr << "Warning : can't load cached image : " << e.what() << endl;
+    }
+    removeCachedImage(hash);
+    memset((void *)pixels, 0, (size_t)w * h * bytesPerPixel);
+    return false;
+}
+}
+
+shared_ptr<const Image::EncodedImage> Image::getEncoded() const
+{
+    lock_guard<mutex> lockIt(data->lock);
+    if(data->encoded != nullptr)
+        return data->encoded;
+    vector<uint8_t> pixels;
+    size_t rowSize = data->w * BytesPerPixel;
+    pixels.resize(rowSize * data->h);
+    for(size_t y = 0; y < data->h; y++)
+    {
+        size_t adjustedY = y;
+        if(data->rowOrder == BottomToTop)
+        {
+            adjustedY = data->h - adjustedY - 1;
+        }
+
+        memcpy((void *)&pixels[y * rowSize], (const void *)&data->data[adjustedY * rowSize], rowSize);
+    }
+    shared_ptr<EncodedImage> encoded = make_shared<EncodedImage>();
+    encoded->hash = hashPixels(data->w, data->h, pixels.data(), pixels.size());
+    encoded->bytes = encodePixels(data->w, data->h, pixels.data(), BytesPerPixel);
+    data->encoded = encoded;
+    return encoded;
+}
+
 void Image::write(Writer &writer, Client &client) const
 {
     if(!*this)
@@ -228,34 +476,21 @@ void Image::write(Writer &writer, Client &client) const
     }
     cout << "Server : writing image\n";
     id = client.makeId(data, Client::DataType::Image);
+    unordered_set<uint64_t> &peerCachedHashes = client.getPropertyReference<unordered_set<uint64_t>, 0>(Client::DataType::ImageHashSet);
+    client.unlock();
+    shared_ptr<const EncodedImage> encoded = getEncoded();
+    client.lock();
+    bool peerHasImage = peerCachedHashes.count(encoded->hash) != 0;
     client.unlock();
     Client::writeId(writer, id);
     writer.writeU32(width());
     writer.writeU32(height());
-    vector<uint8_t> row;
-    row.resize(width() * BytesPerPixel);
-    for(size_t y = 0; y < height(); y++)
+    writer.writeU64(encoded->hash);
+    writer.writeBool(!peerHasImage);
+    if(!peerHasImage)
     {
-        data->lock.lock();
-        size_t adjustedY = y;
-        if(data->rowOrder == BottomToTop)
-        {
-            adjustedY = data->h - adjustedY - 1;
-        }
-
-        uint8_t *prow = &data->data[BytesPerPixel * (adjustedY * data->w)];
-        for(size_t x = 0, i = 0; x < width(); x++)
-        {
-            row[i++] = *prow++;
-            row[i++] = *prow++;
-            row[i++] = *prow++;
-            row[i++] = *prow++;
-        }
-        data->lock.unlock();
-        for(uint8_t v : row)
-        {
-            writer.writeU8(v);
-        }
+        writer.writeU32(encoded->bytes.size());
+        writer.writeBytes(encoded->bytes.data(), encoded->bytes.size());
     }
 }
 
@@ -276,13 +511,114 @@ Image Image::read(Reader &reader, Client &client)
     uint32_t w, h;
     w = reader.readU32();
     h = reader.readU32();
+    if(!isSizeValid(w, h, BytesPerPixel))
+        throw InvalidDataValueException("image is too big");
+    uint64_t hash = reader.readU64();
+    bool sentData = reader.readBool();
     retval = Image(w, h);
     retval.setRowOrder(RowOrder::TopToBottom);
-    for(size_t i = 0; i < BytesPerPixel * w * h; i++)
+    if(sentData)
+    {
+        vector<uint8_t> encoded = readEncodedPixels(reader, w, h, hash, retval.data->data, BytesPerPixel);
+        storeCachedImage(hash, w, h, encoded);
+    }
+    else
     {
-        retval.data->data[i] = reader.readU8();
+        DUMP_V(Image::read, "loading cached image");
+        if(!loadCachedImage(hash, w, h, retval.data->data, BytesPerPixel))
+            addImageRequest(client, id); // leave it blank until the server sends it again
     }
     client.setPtr(retval.data, id, Client::DataType::Image);
     return retval;
 }
 
+vector<Client::IdType> Image::takeImageRequests(Client &client)
+{
+    LockedClient lockIt(client);
+    vector<Client::IdType> retval;
+    retval.swap(client.getPropertyReference<vector<Client::IdType>, 0>(Client::DataType::ImageRequestList));
+    return retval;
+}
+
+void Image::addImageRequest(Client &client, Client::IdType id)
+{
+    LockedClient lockIt(client);
+    client.getPropertyReference<vector<Client::IdType>, 0>(Client::DataType::ImageRequestList).push_back(id);
+}
+
+void Image::writeRequested(Writer &writer, Client &client, Client::IdType id)
+{
+    Image image;
+    if(id != Client::NullId)
+        image.data = client.getPtr<data_t>(id, Client::DataType::Image);
+    if(!image)
+    {
+        Client::writeId(writer, Client::NullId);
+        return;
+    }
+    shared_ptr<const EncodedImage> encoded = image.getEncoded();
+    client.lock();
+    unordered_set<uint64_t> &peerCachedHashes = client.getPropertyReference<unordered_set<uint64_t>, 0>(Client::DataType::ImageHashSet);
+    peerCachedHashes.erase(encoded->hash); // the client's copy is bad
+    client.unlock();
+    Client::writeId(writer, id);
+    writer.writeU32(image.width());
+    writer.writeU32(image.height());
+    writer.writeU64(encoded->hash);
+    writer.writeU32(encoded->bytes.size());
+    writer.writeBytes(encoded->bytes.data(), encoded->bytes.size());
+}
+
+void Image::readRequested(Reader &reader, Client &client)
+{
+    Client::IdType id = Client::readId(reader);
+    if(id == Client::NullId) // the server doesn't have it anymore
+        return;
+    shared_ptr<data_t> data = client.getPtr<data_t>(id, Client::DataType::Image);
+    if(data == nullptr)
+        throw InvalidDataValueException("sent an image that wasn't requested");
+    uint32_t w = reader.readU32(), h = reader.readU32();
+    if(w != data->w || h != data->h)
+        throw InvalidDataValueException("sent image has the wrong size");
+    uint64_t hash = reader.readU64();
+    vector<uint8_t> pixels;
+    pixels.resize((size_t)w * h * BytesPerPixel);
+    vector<uint8_t> encoded = readEncodedPixels(reader, w, h, hash, pixels.data(), BytesPerPixel);
+    storeCachedImage(hash, w, h, encoded);
+    lock_guard<mutex> lockIt(data->lock);
+    data->rowOrder = TopToBottom;
+    memcpy((void *)data->data, (const void *)pixels.data(), pixels.size());
+    data->textureValid = false;
+}
+
+vector<uint64_t> Image::getCachedHashes()
+{
+    vector<uint64_t> retval;
+    wstring dir = getCacheDirectory();
+    if(dir.empty())
+        return retval;
+    wstring suffix = cacheFileSuffix;
+    wstring tempSuffix = tempFileSuffix;
+    for(wstring name : listDirectory(dir))
+    {
+        if(name.size() > tempSuffix.size() && name.substr(name.size() - tempSuffix.size()) == tempSuffix)
+        {
+            removeFile(dir + name); // left behind by a write that didn't finish
+            continue;
+        }
+        if(name.size() != 16 + suffix.size() || name.substr(16) != suffix)
+            continue;
+        wstring hexDigits = name.substr(0, 16);
+        if(hexDigits.find_first_not_of(L"0123456789abcdef") != wstring::npos)
+            continue;
+        retval.push_back((uint64_t)wcstoull(hexDigits.c_str(), nullptr, 16));
+    }
+    return retval;
+}
+
+void Image::setPeerCachedHashes(Client &client, const vector<uint64_t> &hashes)
+{
+    LockedClient lockIt(client);
+    unordered_set<uint64_t> &peerCachedHashes = client.getPropertyReference<unordered_set<uint64_t>, 0>(Client::DataType::ImageHashSet);
+    peerCachedHashes.insert(hashes.begin(), hashes.end());
+}
@@ -18,6 +18,8 @@
 #include "mesh.h"
 #include "platform.h"
 #include <iostream>
+#include <unordered_map>
+#include <cmath>
 
 Renderer & Renderer::operator <<(const Mesh_t & m)
 {
@@ -29,3 +31,181 @@ Renderer & Renderer::operator <<(const Mesh_t & m)
     return *this;
 }
 
+
+namespace
+{
+enum class MeshFormat : uint8_t
+{
+    Float32, /// 3 F32 positions, 2 F32 texture coordinates and 4 F32 colors for every vertex of every triangle
+    Quantized, /// indexed vertices with S16 fixed-point positions, U16 texture coordinates and RGBA8 colors
+    Last
+};
+
+constexpr float quantizedPositionScale = 4096; // positions in [-8, 8)
+constexpr float quantizedTextureCoordScale = 32768; // texture coordinates in [0, 2), exact for atlas fractions
+constexpr float quantizedColorScale = 255;
+
+struct QuantizedVertex final
+{
+    int16_t p[3];
+    uint16_t t[2];
+    uint8_t c[4];
+    bool operator ==(const QuantizedVertex &rt) const
+    {
+        return p[0] == rt.p[0] && p[1] == rt.p[1] && p[2] == rt.p[2] && t[0] == rt.t[0] && t[1] == rt.t[1]
+            && c[0] == rt.c[0] && c[1] == rt.c[1] && c[2] == rt.c[2] && c[3] == rt.c[3];
+    }
+};
+
+struct QuantizedVertexHash final
+{
+    size_t operator()(const QuantizedVertex &v) const
+    {
+        uint64_t a = (uint64_t)(uint16_t)v.p[0] | (uint64_t)(uint16_t)v.p[1] << 16 | (uint64_t)(uint16_t)v.p[2] << 32 | (uint64_t)v.t[0] << 48;
+        uint64_t b = (uint64_t)v.t[1] | (uint64_t)v.c[0] << 16 | (uint64_t)v.c[1] << 24 | (uint64_t)v.c[2] << 32 | (uint64_t)v.c[3] << 40;
+        return (size_t)(a * 0x9E3779B97F4A7C15ULL ^ b * 0xC2B2AE3D27D4EB4FULL);
+    }
+};
+
+/// returns false if value doesn't fit
+bool quantize(float value, float scale, int32_t min, int32_t max, int32_t &retval)
+{
+    float v = std::round(value * scale);
+    if(!(v >= min && v <= max)) // also catches NaN
+        return false;
+    retval = (int32_t)v;
+    return true;
+}
+}
+
+void writeMeshData(Mesh mesh, Writer &writer)
+{
+    const Mesh_t &m = *mesh;
+    size_t vertexCount = m.points.size() / Mesh_t::floatsPerPoint;
+    vector<QuantizedVertex> vertices;
+    vector<uint32_t> indices;
+    indices.reserve(vertexCount);
+    unordered_map<QuantizedVertex, uint32_t, QuantizedVertexHash> vertexIndices;
+    bool fits = true;
+    for(size_t i = 0; i < vertexCount && fits; i++)
+    {
+        QuantizedVertex v;
+        int32_t value;
+        for(size_t j = 0; j < 3 && fits; j++)
+        {
+            fits = quantize(m.points[i * Mesh_t::floatsPerPoint + j], quantizedPositionScale, -0x8000, 0x7FFF, value);
+            v.p[j] = value;
+        }
+        for(size_t j = 0; j < 2 && fits; j++)
+        {
+            fits = quantize(m.textureCoords[i * Mesh_t::floatsPerTextureCoord + j], quantizedTextureCoordScale, 0, 0xFFFF, value);
+            v.t[j] = value;
+        }
+        for(size_t j = 0; j < 4 && fits; j++)
+        {
+            fits = quantize(m.colors[i * Mesh_t::floatsPerColor + j], quantizedColorScale, 0, 0xFF, value);
+            v.c[j] = value;
+        }
+        if(!fits)
+            break;
+        auto iter = vertexIndices.find(v);
+        if(iter == vertexIndices.end())
+        {
+            iter = vertexIndices.insert(make_pair(v, (uint32_t)vertices.size())).first;
+            vertices.push_back(v);
+        }
+        indices.push_back(iter->second);
+    }
+
+    if(!fits)
+    {
+        writer.writeU8((uint8_t)MeshFormat::Float32);
+        writer.writeF32Array(m.points.data(), m.points.size());
+        writer.writeF32Array(m.textureCoords.data(), m.textureCoords.size());
+        writer.writeF32Array(m.colors.data(), m.colors.size());
+        return;
+    }
+
+    writer.writeU8((uint8_t)MeshFormat::Quantized);
+    writer.writeU32(vertices.size());
+    vector<int16_t> positions;
+    vector<uint16_t> textureCoords;
+    vector<uint8_t> colors;
+    positions.reserve(vertices.size() * 3);
+    textureCoords.reserve(vertices.size() * 2);
+    colors.reserve(vertices.size() * 4);
+    for(const QuantizedVertex &v : vertices)
+    {
+        positions.insert(positions.end(), v.p, v.p + 3);
+        textureCoords.insert(textureCoords.end(), v.t, v.t + 2);
+        colors.insert(colors.end(), v.c, v.c + 4);
+    }
+    writer.writeS16Array(positions.data(), positions.size());
+    writer.writeU16Array(textureCoords.data(), textureCoords.size());
+    writer.writeBytes(colors.data(), colors.size());
+    // the index width is implied by the vertex count
+    if(vertices.size() <= 0x100)
+    {
+        vector<uint8_t> smallIndices(indices.begin(), indices.end());
+        writer.writeBytes(smallIndices.data(), smallIndices.size());
+    }
+    else if(vertices.size() <= 0x10000)
+    {
+        vector<uint16_t> smallIndices(indices.begin(), indices.end());
+        writer.writeU16Array(smallIndices.data(), smallIndices.size());
+    }
+    else
+    {
+        writer.writeU32Array(indices.data(), indices.size());
+    }
+}
+
+void Mesh_t::readData(Reader &reader)
+{
+    MeshFormat format = (MeshFormat)reader.readLimitedU8(0, (uint8_t)MeshFormat::Last - 1);
+    if(format == MeshFormat::Float32)
+    {
+        reader.readFiniteF32Array(points.data(), points.size());
+        reader.readFiniteF32Array(textureCoords.data(), textureCoords.size());
+        reader.readFiniteF32Array(colors.data(), colors.size());
+        return;
+    }
+    assert(format == MeshFormat::Quantized);
+    size_t indexCount = points.size() / floatsPerPoint;
+    size_t vertexCount = reader.readLimitedU32(0, indexCount);
+    vector<int16_t> positions(vertexCount * 3);
+    vector<uint16_t> quantizedTextureCoords(vertexCount * 2);
+    vector<uint8_t> quantizedColors(vertexCount * 4);
+    reader.readS16Array(positions.data(), positions.size());
+    reader.readU16Array(quantizedTextureCoords.data(), quantizedTextureCoords.size());
+    reader.readBytes(quantizedColors.data(), quantizedColors.size());
+    vector<uint32_t> indices(indexCount);
+    if(vertexCount <= 0x100)
+    {
+        vector<uint8_t> smallIndices(indexCount);
+        reader.readBytes(smallIndices.data(), smallIndices.size());
+        indices.assign(smallIndices.begin(), smallIndices.end());
+    }
+    else if(vertexCount <= 0x10000)
+    {
+        vector<uint16_t> smallIndices(indexCount);
+        reader.readU16Array(smallIndices.data(), smallIndices.size());
+        indices.assign(smallIndices.begin(), smallIndices.end());
+    }
+    else
+    {
+        reader.readU32Array(indices.data(), indices.size());
+    }
+    for(size_t i = 0; i < indexCount; i++)
+    {
+        uint32_t index = indices[i];
+        if(index >= vertexCount)
+            throw InvalidDataValueException("mesh vertex index out of range");
+        for(size_t j = 0; j < 3; j++)
+            points[i * floatsPerPoint + j] = positions[index * 3 + j] / quantizedPositionScale;
+        for(size_t j = 0; j < 2; j++)
+            textureCoords[i * floatsPerTextureCoord + j] = quantizedTextureCoords[index * 2 + j] / quantizedTextureCoordScale;
+        for(size_t j = 0; j < 4; j++)
+            colors[i * floatsPerColor + j] = quantizedColors[index * 4 + j] / quantizedColorScale;
+    }
+}
@@ -19,11 +19,14 @@
 #include "util.h"
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <errno.h>
 #include <signal.h>
 #include <netinet/tcp.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 using namespace std;
 
@@ -34,17 +37,50 @@ initializer signalInit([]()
     signal(SIGPIPE, SIG_IGN);
 });
 
+bool isLocalPeer(int fd)
+{
+    sockaddr_storage addr;
+    socklen_t addrLength = sizeof(addr);
+    if(getpeername(fd, (sockaddr *)&addr, &addrLength) != 0)
+        return false;
+    if(addr.ss_family == AF_UNIX)
+        return true;
+    if(addr.ss_family == AF_INET)
+    {
+        uint32_t ip = ntohl(((const sockaddr_in *)&addr)->sin_addr.s_addr);
+        return (ip >> 24) == 127 // loopback
+               || (ip >> 24) == 10
+               || (ip >> 20) == ((172 << 4) | 1) // 172.16.0.0/12
+               || (ip >> 16) == ((192 << 8) | 168)
+               || (ip >> 16) == ((169 << 8) | 254); // link local
+    }
+    if(addr.ss_family == AF_INET6)
+    {
+        const in6_addr &ip = ((const sockaddr_in6 *)&addr)->sin6_addr;
+        if(IN6_IS_ADDR_LOOPBACK(&ip) || IN6_IS_ADDR_LINKLOCAL(&ip))
+            return true;
+        if((ip.s6_addr[0] & 0xFE) == 0xFC) // unique local
+            return true;
+        if(IN6_IS_ADDR_V4MAPPED(&ip))
+        {
+            uint8_t a = ip.s6_addr[12], b = ip.s6_addr[13];
+            return a == 127 || a == 10 || (a == 172 && (b & 0xF0) == 16) || (a == 192 && b == 168) || (a == 169 && b == 254);
+        }
+    }
+    return false;
+}
+
+/// collects output in a ChainWriter and sends the whole chain with sendmsg when flushed
 class NetworkWriter final : public Writer
 {
 private:
-    vector<uint8_t> buffer;
+    static constexpr size_t flushSize = 1 << 16;
+    ChainWriter chain;
     int fd;
 public:
     NetworkWriter(int fd)
         : fd(fd)
     {
-        int flag = 1;
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
     }
     virtual ~NetworkWriter()
     {
@@ -52,35 +88,151 @@ public:
     }
     virtual void writeByte(uint8_t v)
     {
-        buffer.push_back(v);
-        if(buffer.size() >= 16384)
+        chain.writeByte(v);
+        if(chain.size() >= flushSize)
+            flush();
+    }
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        chain.writeBytes(array, count);
+        if(chain.size() >= flushSize)
+            flush();
+    }
+    virtual void writeSharedBytes(shared_ptr<const vector<uint8_t>> bytes) override
+    {
+        chain.writeSharedBytes(bytes);
+        if(chain.size() >= flushSize)
             flush();
     }
     virtual void flush()
     {
-        const uint8_t * pbuffer = buffer.data();
-        ssize_t sizeLeft = buffer.size();
-        while(sizeLeft > 0)
+        size_t index = 0, offset = 0;
+        sendBufferChain(fd, chain.getChain(), index, offset);
+        chain.clear();
+    }
+};
+}
+
+bool sendBufferChain(int fd, const ChainWriter::Chain & chain, size_t & index, size_t & offset)
+{
+    constexpr size_t maxIOVecCount = 256;
+    while(index < chain.size())
+    {
+        iovec iov[maxIOVecCount];
+        size_t iovCount = 0;
+        for(size_t i = index; i < chain.size() && iovCount < maxIOVecCount; i++)
+        {
+            size_t start = (i == index ? offset : 0);
+            if(start >= chain[i]->size())
+                continue;
+            iov[iovCount].iov_base = (void *)(chain[i]->data() + start);
+            iov[iovCount].iov_len = chain[i]->size() - start;
+            iovCount++;
+        }
+        if(iovCount == 0)
+        {
+            index = chain.size();
+            break;
+        }
+        msghdr message;
+        memset((void *)&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = iovCount;
+        ssize_t retval = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if(retval == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return false;
+            throw IOException(string("io error : ") + strerror(errno));
+        }
+        size_t sent = retval;
+        while(index < chain.size() && sent >= chain[index]->size() - offset)
+        {
+            sent -= chain[index]->size() - offset;
+            offset = 0;
+            index++;
+        }
+        offset += sent;
+    }
+    return true;
+}
+
+NetworkReader::NetworkReader(int fd)
+    : buffer(new uint8_t[bufferSize]), startIndex(0), endIndex(0), fd(fd)
+{
+}
+
+NetworkReader::~NetworkReader()
+{
+    close(fd);
+    delete []buffer;
+}
+
+void NetworkReader::fill(size_t count)
+{
+    if(count > bufferSize)
+        throw IOException("IO Error : read too big for network buffer");
+    if(startIndex == endIndex)
+    {
+        startIndex = endIndex = 0;
+    }
+    else if(bufferSize - startIndex < count)
+    {
+        memmove((void *)buffer, (const void *)&buffer[startIndex], endIndex - startIndex);
+        endIndex -= startIndex;
+        startIndex = 0;
+    }
+    while(endIndex - startIndex < count)
+    {
+        ssize_t retval = recv(fd, (void *)&buffer[endIndex], bufferSize - endIndex, 0);
+        if(retval == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            throw IOException(string("io error : ") + strerror(errno));
+        }
+        if(retval == 0)
+            throw EOFException();
+        endIndex += retval;
+    }
+}
+
+void NetworkReader::readBytes(uint8_t * array, size_t count)
+{
+    size_t currentCount = min(count, endIndex - startIndex);
+    memcpy((void *)array, (const void *)&buffer[startIndex], currentCount);
+    startIndex += currentCount;
+    array += currentCount;
+    count -= currentCount;
+    if(count == 0)
+        return;
+    if(count >= bufferSize / 2)
+    {
+        while(count > 0) // big reads go straight to the destination
         {
-            ssize_t retval = send(fd, (const void *)pbuffer, sizeLeft, 0);
+            ssize_t retval = recv(fd, (void *)array, count, MSG_WAITALL);
             if(retval == -1)
             {
+                if(errno == EINTR)
+                    continue;
                 throw IOException(string("io error : ") + strerror(errno));
             }
-            else
-            {
-                sizeLeft -= retval;
-                pbuffer += retval;
-            }
+            if(retval == 0)
+                throw EOFException();
+            array += retval;
+            count -= retval;
         }
-        int flag = 1;
-        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
-        buffer.clear();
+        return;
     }
-};
+    fill(count);
+    memcpy((void *)array, (const void *)&buffer[startIndex], count);
+    startIndex += count;
 }
 
 NetworkConnection::NetworkConnection(wstring url, uint16_t port)
+    : fd(-1), localPeer(false)
 {
     string url_utf8 = wcsrtombs(url), port_str = to_string((unsigned)port);
     addrinfo *addrList = nullptr;
@@ -128,8 +280,31 @@ NetworkConnection::NetworkConnection(wstring url, uint16_t port)
     setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
 
     freeaddrinfo(addrList);
-    readerInternal = unique_ptr<Reader>(new FileReader(fdopen(dup(fd), "r")));
-    writerInternal = unique_ptr<Writer>(new NetworkWriter(fd));
+    this->fd = fd;
+    localPeer = isLocalPeer(fd);
+    makeStreams();
+}
+
+NetworkConnection::NetworkConnection(int fd)
+    : fd(fd), localPeer(isLocalPeer(fd))
+{
+}
+
+NetworkConnection::~NetworkConnection()
+{
+    if(fd != -1)
+        close(fd);
+}
+
+void NetworkConnection::makeStreams()
+{
+    if(readerInternal != nullptr)
+        return;
+    if(fd == -1)
+        throw NetworkException("socket already released");
+    readerInternal = shared_ptr<Reader>(new NetworkReader(dup(fd)));
+    writerInternal = shared_ptr<Writer>(new NetworkWriter(fd));
+    fd = -1;
 }
 
 NetworkServer::NetworkServer(uint16_t port)
@@ -215,7 +390,5 @@ shared_ptr<StreamRW> NetworkServer::accept()
     int flag = 1;
     setsockopt(fd2, IPPROTO_TCP, TCP_NODELAY, (const void *)&flag, sizeof(flag));
 
-    shared_ptr<Reader> reader = shared_ptr<Reader>(new FileReader(fdopen(dup(fd2), "r")));
-    shared_ptr<Writer> writer = shared_ptr<Writer>(new NetworkWriter(fd2));
-    return shared_ptr<StreamRW>(new StreamRWWrapper(reader, writer));
+    return shared_ptr<StreamRW>(new NetworkConnection(fd2));
 }
@@ -0,0 +1,282 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#include "network_event_loop.h"
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <iostream>
+
+using namespace std;
+
+namespace
+{
+constexpr size_t readSize = 65536;
+constexpr size_t maxReadsPerEvent = 2; /// so a peer that keeps sending can't starve the other connections on its thread
+constexpr int maxEvents = 64;
+}
+
+NetworkEventLoop::Connection::Connection(int fd, int epollFd, shared_ptr<Handler> handler)
+    : fd(fd), epollFd(epollFd), handler(handler), maxInputSize(handler->maxInputSize()), outputIndex(0), outputOffset(0), wakeRequested(false), closed(false), readBlocked(false)
+{
+}
+
+NetworkEventLoop::Connection::~Connection()
+{
+    ::close(fd);
+}
+
+void NetworkEventLoop::Connection::setEvents(bool wantWrite)
+{
+    epoll_event event;
+    memset((void *)&event, 0, sizeof(event));
+    event.events = (readBlocked ? 0u : (uint32_t)EPOLLIN) | (uint32_t)EPOLLRDHUP | (wantWrite ? (uint32_t)EPOLLOUT : 0u);
+    event.data.ptr = (void *)this;
+    if(-1 == epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event))
+        throw NetworkException(string("epoll_ctl: ") + strerror(errno));
+}
+
+void NetworkEventLoop::Connection::wake()
+{
+    if(closed)
+        return;
+    wakeRequested = true;
+    try
+    {
+        setEvents(true);
+    }
+    catch(NetworkException &e)
+    {
+        if(!closed) // closing removes us from epoll, so failing then is expected
+            cerr << "Error : " << e.what() << endl;
+    }
+}
+
+bool NetworkEventLoop::Connection::handleRead()
+{
+    if(readBlocked) // only a hangup or an error gets here once we've stopped reading
+        return false;
+    bool gotEOF = false;
+    for(size_t i = 0; i < maxReadsPerEvent && input.size() < maxInputSize; i++)
+    {
+        size_t oldSize = input.size();
+        size_t size = min(readSize, maxInputSize - oldSize);
+        input.resize(oldSize + size);
+        ssize_t retval = recv(fd, (void *)&input[oldSize], size, 0);
+        if(retval == -1)
+        {
+            input.resize(oldSize);
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            throw IOException(string("io error : ") + strerror(errno));
+        }
+        input.resize(oldSize + retval);
+        if(retval == 0)
+        {
+            gotEOF = true;
+            break;
+        }
+        if((size_t)retval < size)
+            break; // nothing left to read right now
+    }
+    size_t used = handler->onRead(input.data(), input.size());
+    input.erase(input.begin(), input.begin() + used);
+    if(gotEOF)
+        return false;
+    if(input.size() >= maxInputSize && !readBlocked) // the handler can't make progress, so stop filling input
+    {
+        readBlocked = true;
+        setEvents(true);
+    }
+    if(used > 0) // the messages may have produced something to send
+        wake();
+    return true;
+}
+
+bool NetworkEventLoop::Connection::handleWrite()
+{
+    if(outputIndex >= output.getChain().size())
+    {
+        output.clear();
+        outputIndex = outputOffset = 0;
+        wakeRequested = false;
+        handler->onWritable(output);
+        if(output.empty())
+        {
+            setEvents(false);
+            if(wakeRequested) // a producer woke us after we checked
+                setEvents(true);
+            return true;
+        }
+    }
+    // only send one batch per event so a busy connection doesn't starve the others on this thread.
+    // shared buffers in the batch go straight from where they are to the socket
+    sendBufferChain(fd, output.getChain(), outputIndex, outputOffset);
+    return true;
+}
+
+void NetworkEventLoop::Connection::close()
+{
+    if(closed.exchange(true))
+        return;
+    if(-1 == epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr))
+        cerr << "Error : epoll_ctl: " << strerror(errno) << endl;
+    handler->onClose();
+}
+
+NetworkEventLoop::NetworkEventLoop(size_t threadCount)
+    : nextThread(0), done(false)
+{
+    assert(threadCount > 0);
+    for(size_t i = 0; i < threadCount; i++)
+    {
+        shared_ptr<IOThread> ioThread = make_shared<IOThread>();
+        ioThread->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if(ioThread->epollFd == -1)
+            throw NetworkException(string("epoll_create1: ") + strerror(errno));
+        ioThread->eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(ioThread->eventFd == -1)
+        {
+            string msg = string("eventfd: ") + strerror(errno);
+            close(ioThread->epollFd);
+            throw NetworkException(msg);
+        }
+        epoll_event event;
+        memset((void *)&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if(-1 == epoll_ctl(ioThread->epollFd, EPOLL_CTL_ADD, ioThread->eventFd, &event))
+        {
+            string msg = string("epoll_ctl: ") + strerror(errno);
+            close(ioThread->eventFd);
+            close(ioThread->epollFd);
+            throw NetworkException(msg);
+        }
+        ioThreads.push_back(ioThread);
+    }
+    for(shared_ptr<IOThread> ioThread : ioThreads)
+    {
+        ioThread->theThread = thread([this](IOThread * ioThread)
+        {
+            run(*ioThread);
+        }, ioThread.get());
+    }
+}
+
+NetworkEventLoop::~NetworkEventLoop()
+{
+    done = true;
+    for(shared_ptr<IOThread> ioThread : ioThreads)
+    {
+        uint64_t v = 1;
+        ssize_t retval = write(ioThread->eventFd, (const void *)&v, sizeof(v));
+        (void)retval;
+    }
+    for(shared_ptr<IOThread> ioThread : ioThreads)
+    {
+        ioThread->theThread.join();
+        for(auto p : ioThread->connections)
+        {
+            get<1>(p)->close();
+        }
+        ioThread->connections.clear();
+        close(ioThread->eventFd);
+        close(ioThread->epollFd);
+    }
+}
+
+shared_ptr<NetworkEventLoop::Connection> NetworkEventLoop::add(int fd, shared_ptr<Handler> handler)
+{
+    assert(handler != nullptr);
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        string msg = string("fcntl: ") + strerror(errno);
+        close(fd);
+        throw NetworkException(msg);
+    }
+    IOThread & ioThread = *ioThreads[nextThread++ % ioThreads.size()];
+    shared_ptr<Connection> connection = shared_ptr<Connection>(new Connection(fd, ioThread.epollFd, handler));
+    {
+        lock_guard<mutex> lockIt(ioThread.lock);
+        ioThread.connections[connection.get()] = connection;
+    }
+    epoll_event event;
+    memset((void *)&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLOUT;
+    event.data.ptr = (void *)connection.get();
+    if(-1 == epoll_ctl(ioThread.epollFd, EPOLL_CTL_ADD, fd, &event))
+    {
+        string msg = string("epoll_ctl: ") + strerror(errno);
+        lock_guard<mutex> lockIt(ioThread.lock);
+        ioThread.connections.erase(connection.get());
+        throw NetworkException(msg);
+    }
+    return connection;
+}
+
+void NetworkEventLoop::run(IOThread & ioThread)
+{
+    epoll_event events[maxEvents];
+    while(!done)
+    {
+        int count = epoll_wait(ioThread.epollFd, events, maxEvents, -1);
+        if(count == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            cerr << "Error : epoll_wait: " << strerror(errno) << endl;
+            return;
+        }
+        for(int i = 0; i < count; i++)
+        {
+            if(events[i].data.ptr == nullptr)
+            {
+                uint64_t v;
+                ssize_t retval = read(ioThread.eventFd, (void *)&v, sizeof(v));
+                (void)retval;
+                continue;
+            }
+            Connection * connection = (Connection *)events[i].data.ptr;
+            bool good = true;
+            try
+            {
+                if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                    good = connection->handleRead();
+                if(good && (events[i].events & EPOLLOUT))
+                    good = connection->handleWrite();
+            }
+            catch(exception &e)
+            {
+                cerr << "Error : " << e.what() << endl;
+                good = false;
+            }
+            if(!good)
+            {
+                connection->close();
+                lock_guard<mutex> lockIt(ioThread.lock);
+                ioThread.connections.erase(connection);
+            }
+        }
+    }
+}
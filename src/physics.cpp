@@ -16,3 +16,174 @@
  *
  */
 #include "physics.h"
+#include "util.h"
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <chrono>
+
+#if 0 // use benchmark code
+namespace
+{
+constexpr double benchmarkTickDuration = 1 / 20.0;
+
+constexpr size_t benchmarkThreadCount = 4; /// including the calling thread. fixed so the threaded pass always runs
+
+struct BenchmarkScene final
+{
+    const char * name;
+    size_t tickCount;
+    void (*build)(shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects);
+    uint64_t expectedPairTestCount; /// update these when a change to the engine is meant to change the results
+    uint64_t expectedChecksum;
+};
+
+void makeFloor(shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects)
+{
+    auto floorMaker = PhysicsObjectConstructor::boxMaker(VectorF(32, 0.5f, 32), false, true, PhysicsProperties(), vector<PhysicsConstraint>());
+    objects.push_back(floorMaker->make(PositionF(0, -0.5f, 0, Dimension::Overworld), VectorF(0), world));
+}
+
+const BenchmarkScene benchmarkScenes[] =
+{
+    {"stacks", 200, [](shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects)
+    {
+        makeFloor(world, objects);
+        auto boxMaker = PhysicsObjectConstructor::boxMaker(VectorF(0.5f), true, false, PhysicsProperties(), vector<PhysicsConstraint>());
+        for(int x = -8; x < 8; x += 4)
+        {
+            for(int z = -8; z < 8; z += 4)
+            {
+                for(int y = 0; y < 8; y++)
+                {
+                    objects.push_back(boxMaker->make(PositionF(x + 0.5f, y + 0.5f, z + 0.5f, Dimension::Overworld), VectorF(0), world));
+                }
+            }
+        }
+    }, 425248, 0x40d40420fd302915ULL},
+    {"pile", 200, [](shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects)
+    {
+        makeFloor(world, objects);
+        auto boxMaker = PhysicsObjectConstructor::boxMaker(VectorF(0.25f), true, false, PhysicsProperties(), vector<PhysicsConstraint>());
+        minstd_rand r(1);
+        uniform_real_distribution<float> xz(-1, 1);
+        for(int i = 0; i < 250; i++)
+        {
+            objects.push_back(boxMaker->make(PositionF(xz(r), 1 + 0.6f * i, xz(r), Dimension::Overworld), VectorF(0), world));
+        }
+    }, 141111510, 0x55793b633a17e9e6ULL},
+    {"random boxes", 100, [](shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects)
+    {
+        makeFloor(world, objects);
+        auto boxMaker = PhysicsObjectConstructor::boxMaker(VectorF(0.25f), true, false, PhysicsProperties(), vector<PhysicsConstraint>());
+        minstd_rand r(2);
+        uniform_real_distribution<float> xz(-16, 16), y(1, 10);
+        for(int i = 0; i < 1000; i++)
+        {
+            float x = xz(r);
+            objects.push_back(boxMaker->make(PositionF(x, y(r), xz(r), Dimension::Overworld), VectorF(0), world));
+        }
+    }, 17274014, 0xee38c2e7b702db42ULL},
+    {"players", 200, [](shared_ptr<PhysicsWorld> world, vector<shared_ptr<PhysicsObject>> & objects)
+    {
+        makeFloor(world, objects);
+        auto blockMaker = PhysicsObjectConstructor::boxMaker(VectorF(0.5f), false, true, PhysicsProperties(), vector<PhysicsConstraint>());
+        auto playerMaker = PhysicsObjectConstructor::cylinderMaker(0.3f, 0.9f, true, false, PhysicsProperties(0, 0.9f), vector<PhysicsConstraint>());
+        minstd_rand r(3);
+        uniform_int_distribution<int> blockXZ(-16, 15);
+        uniform_real_distribution<float> xz(-16, 16), angle(0, 2 * M_PI);
+        for(int i = 0; i < 300; i++)
+        {
+            int x = blockXZ(r);
+            objects.push_back(blockMaker->make(PositionF(x + 0.5f, 0.5f, blockXZ(r) + 0.5f, Dimension::Overworld), VectorF(0), world));
+        }
+        for(int i = 0; i < 64; i++) // walking speed, in random directions
+        {
+            float x = xz(r), z = xz(r), a = angle(r);
+            objects.push_back(playerMaker->make(PositionF(x, 2, z, Dimension::Overworld), VectorF(4.3f * cos(a), 0, 4.3f * sin(a)), world));
+        }
+    }, 917508, 0x8153a71e17f4f9c2ULL},
+};
+
+uint64_t hashFloat(uint64_t hash, float v) // FNV-1a over the bits of v
+{
+    uint32_t bits;
+    memcpy((void *)&bits, (const void *)&v, sizeof(bits));
+    for(int i = 0; i < 4; i++)
+    {
+        hash ^= (bits >> 8 * i) & 0xFF;
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+struct BenchmarkResult final
+{
+    double elapsed;
+    uint64_t pairTestCount;
+    uint64_t checksum;
+};
+
+BenchmarkResult runBenchmarkScene(const BenchmarkScene & scene, shared_ptr<ThreadPool> threadPool)
+{
+    shared_ptr<PhysicsWorld> world = make_shared<PhysicsWorld>();
+    world->setThreadPool(threadPool);
+    vector<shared_ptr<PhysicsObject>> objects;
+    scene.build(world, objects);
+    BenchmarkResult retval;
+    auto startTime = chrono::steady_clock::now();
+    for(size_t i = 1; i <= scene.tickCount; i++)
+    {
+        world->runToTime(i * benchmarkTickDuration);
+    }
+    retval.elapsed = chrono::duration_cast<chrono::duration<double>>(chrono::steady_clock::now() - startTime).count();
+    retval.pairTestCount = world->getCollisionPairTestCount();
+    retval.checksum = 0xCBF29CE484222325ULL;
+    for(shared_ptr<PhysicsObject> o : objects)
+    {
+        PositionF position = o->getPosition();
+        VectorF velocity = o->getVelocity();
+        for(float v : {position.x, position.y, position.z, velocity.x, velocity.y, velocity.z})
+            retval.checksum = hashFloat(retval.checksum, v);
+        retval.checksum = hashFloat(retval.checksum, o->isSupported() ? 1 : 0);
+    }
+    return retval;
+}
+
+bool checkBenchmarkResult(const BenchmarkScene & scene, const BenchmarkResult & result)
+{
+    if(result.pairTestCount == scene.expectedPairTestCount && result.checksum == scene.expectedChecksum)
+        return true;
+    cout << scene.name << " : expected " << scene.expectedPairTestCount << " pair tests : checksum " << hex << scene.expectedChecksum << dec << "\n";
+    return false;
+}
+
+initializer init1([]()
+{
+    shared_ptr<ThreadPool> threadPool = make_shared<ThreadPool>(benchmarkThreadCount - 1);
+    bool good = true;
+    cout << "physics benchmark : " << benchmarkTickDuration << "s ticks\n";
+    for(const BenchmarkScene & scene : benchmarkScenes)
+    {
+        BenchmarkResult result = runBenchmarkScene(scene, nullptr);
+        cout << scene.name << " : " << scene.tickCount << " steps : " << scene.tickCount / result.elapsed << " steps/s : ";
+        cout << result.pairTestCount << " pair tests : checksum " << hex << result.checksum << dec << "\n";
+        if(!checkBenchmarkResult(scene, result))
+            good = false;
+        BenchmarkResult threadedResult = runBenchmarkScene(scene, threadPool);
+        cout << scene.name << " with " << benchmarkThreadCount << " threads : " << scene.tickCount / threadedResult.elapsed << " steps/s : ";
+        cout << threadedResult.pairTestCount << " pair tests : checksum " << hex << threadedResult.checksum << dec << "\n";
+        if(!checkBenchmarkResult(scene, threadedResult))
+            good = false;
+    }
+    if(!good)
+    {
+        cout << "physics benchmark : results don't match\n";
+        exit(1);
+    }
+    exit(0);
+});
+}
+#endif // use benchmark code
@@ -68,6 +68,23 @@ public:
         }
         return retval;
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        SDL_ClearError(); // for error detection
+        while(count > 0)
+        {
+            size_t readCount = SDL_RWread(rw, (void *)array, sizeof(uint8_t), count);
+            if(readCount == 0)
+            {
+                const char * str = SDL_GetError();
+                if(str[0]) // non-empty string : error
+                    throw IOException(str);
+                throw EOFException();
+            }
+            array += readCount;
+            count -= readCount;
+        }
+    }
     ~RWOpsReader()
     {
         SDL_RWclose(rw);
@@ -148,6 +165,78 @@ shared_ptr<Reader> getResourceReader(wstring resource)
 #error unknown platform in getResourceReader
 #endif
 
+#ifdef _WIN64
+#error implement getCacheDirectory for Win64
+#elif _WIN32
+#error implement getCacheDirectory for Win32
+#elif __ANDROID
+#error implement getCacheDirectory for Android
+#elif __APPLE__
+#if TARGET_OS_IPHONE && TARGET_IPHONE_SIMULATOR
+#error implement getCacheDirectory for iPhone simulator
+#elif TARGET_OS_IPHONE
+#error implement getCacheDirectory for iPhone
+#else
+#error implement getCacheDirectory for OS X
+#endif
+#elif __linux
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <cstdio>
+wstring getCacheDirectory()
+{
+    string dir;
+    const char * cacheHome = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+    if(cacheHome != nullptr && cacheHome[0] != '\0')
+        dir = cacheHome;
+    else if(home != nullptr && home[0] != '\0')
+    {
+        dir = string(home) + "/.cache";
+        mkdir(dir.c_str(), 0755);
+    }
+    else
+        return L"";
+    dir += "/voxels";
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST)
+        return L"";
+    return mbsrtowcs(dir + "/");
+}
+
+vector<wstring> listDirectory(wstring directory)
+{
+    vector<wstring> retval;
+    DIR * dir = opendir(wcsrtombs(directory).c_str());
+    if(dir == nullptr)
+        return retval;
+    while(dirent * entry = readdir(dir))
+    {
+        string name = entry->d_name;
+        if(name != "." && name != "..")
+            retval.push_back(mbsrtowcs(name));
+    }
+    closedir(dir);
+    return retval;
+}
+
+bool renameFile(wstring oldName, wstring newName)
+{
+    return 0 == rename(wcsrtombs(oldName).c_str(), wcsrtombs(newName).c_str());
+}
+
+bool removeFile(wstring fileName)
+{
+    return 0 == unlink(wcsrtombs(fileName).c_str());
+}
+#elif __unix
+#error implement getCacheDirectory for other unix
+#elif __posix
+#error implement getCacheDirectory for other posix
+#else
+#error unknown platform in getCacheDirectory
+#endif
+
 static int xResInternal, yResInternal;
 
 static SDL_Window *window = nullptr;
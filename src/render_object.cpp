@@ -89,6 +89,71 @@ shared_ptr<RenderObjectBlock> RenderObjectBlock::read(Reader &reader, Client &cl
     return retval;
 }
 
+const RenderObjectBlockMesh::SerializedPayload &RenderObjectBlockMesh::getSerializedPayload()
+{
+    call_once(serializedPayloadFlag, [this]()
+    {
+        shared_ptr<SerializedPayload> payload = make_shared<SerializedPayload>();
+        const Mesh meshes[7] = {center, nx, px, ny, py, nz, pz};
+        for(size_t i = 0; i < payload->meshes.size(); i++)
+        {
+            assert(meshes[i] && (uint32_t)meshes[i]->size() == meshes[i]->size());
+            payload->meshes[i].size = meshes[i]->size();
+            payload->meshes[i].texture = meshes[i]->texture();
+            MemoryWriter writer;
+            writeMeshData(meshes[i], writer);
+            payload->meshes[i].data = make_shared<vector<uint8_t>>(std::move(writer.getBuffer()));
+        }
+        MemoryWriter writer;
+        lightProperties.write(writer);
+        writeRenderLayer(rl, writer);
+        writeRenderObjectBlockClass(writer, blockClass);
+        uint8_t blockedMask = 0;
+
+        if(nxBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::NX;
+        }
+
+        if(pxBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::PX;
+        }
+
+        if(nyBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::NY;
+        }
+
+        if(pyBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::PY;
+        }
+
+        if(nzBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::NZ;
+        }
+
+        if(pzBlocked)
+        {
+            blockedMask |= 1 << (int)BlockFace::PZ;
+        }
+
+        writer.writeU8(blockedMask);
+        writer.writeF32(hitBoxMin.x);
+        writer.writeF32(hitBoxMin.y);
+        writer.writeF32(hitBoxMin.z);
+        writer.writeF32(hitBoxMax.x);
+        writer.writeF32(hitBoxMax.y);
+        writer.writeF32(hitBoxMax.z);
+        physicsConstructor->write(writer);
+        payload->tail = std::move(writer.getBuffer());
+        serializedPayload = payload;
+    });
+    return *serializedPayload;
+}
+
 void RenderObjectBlockMesh::write(Writer &writer, Client &client)
 {
     Client::IdType id = client.getId(shared_from_this(), Client::DataType::RenderObjectBlockMesh);
@@ -101,56 +166,14 @@ void RenderObjectBlockMesh::write(Writer &writer, Client &client)
 
     id = client.makeId(shared_from_this(), Client::DataType::RenderObjectBlockMesh);
     Client::writeId(writer, id);
-    writeMesh(center, writer, client);
-    writeMesh(nx, writer, client);
-    writeMesh(px, writer, client);
-    writeMesh(ny, writer, client);
-    writeMesh(py, writer, client);
-    writeMesh(nz, writer, client);
-    writeMesh(pz, writer, client);
-    lightProperties.write(writer);
-    writeRenderLayer(rl, writer);
-    writeRenderObjectBlockClass(writer, blockClass);
-    uint8_t blockedMask = 0;
-
-    if(nxBlocked)
-    {
-        blockedMask |= 1 << (int)BlockFace::NX;
-    }
-
-    if(pxBlocked)
-    {
-        blockedMask |= 1 << (int)BlockFace::PX;
-    }
-
-    if(nyBlocked)
+    const SerializedPayload &payload = getSerializedPayload();
+    for(const SerializedPayload::SerializedMesh &mesh : payload.meshes)
     {
-        blockedMask |= 1 << (int)BlockFace::NY;
+        writer.writeU32(mesh.size);
+        mesh.texture.write(writer, client);
+        writer.writeSharedBytes(mesh.data);
     }
-
-    if(pyBlocked)
-    {
-        blockedMask |= 1 << (int)BlockFace::PY;
-    }
-
-    if(nzBlocked)
-    {
-        blockedMask |= 1 << (int)BlockFace::NZ;
-    }
-
-    if(pzBlocked)
-    {
-        blockedMask |= 1 << (int)BlockFace::PZ;
-    }
-
-    writer.writeU8(blockedMask);
-    writer.writeF32(hitBoxMin.x);
-    writer.writeF32(hitBoxMin.y);
-    writer.writeF32(hitBoxMin.z);
-    writer.writeF32(hitBoxMax.x);
-    writer.writeF32(hitBoxMax.y);
-    writer.writeF32(hitBoxMax.z);
-    physicsConstructor->write(writer);
+    writer.writeBytes(payload.tail.data(), payload.tail.size());
 }
 
 shared_ptr<RenderObject> RenderObject::read(Reader &reader, Client &client)
@@ -26,6 +26,9 @@
 #include "generate.h"
 #include "texture_atlas.h"
 #include "player.h"
+#include "network_event_loop.h"
+#include "tick_scheduler.h"
+#include "tick_profiler.h"
 #include <thread>
 #include <list>
 
@@ -166,95 +169,281 @@ inline flag &getClientGotStateFlag(Client &client)
     return client.getPropertyReference<flag, 1>(Client::DataType::ServerFlag);
 }
 
-void runServerReaderThread(shared_ptr<StreamRW> connection, shared_ptr<Client> pclient,
-                           shared_ptr<World> world)
+inline function<void()> &getClientWakeFunction(Client &client)
 {
-    Reader &reader = connection->reader();
-    Client &client = *pclient;
-    flag &terminated = getClientTerminatedFlag(client);
+    return client.getPropertyReference<function<void()>, 0>(Client::DataType::WakeFunction);
+}
 
-    try
+/// the chunks the client was unsubscribed from that it hasn't been told about yet
+inline UpdateList &getClientUnsubscribedChunks(Client &client)
+{
+    return client.getPropertyReference<UpdateList, 1>(Client::DataType::UpdateList);
+}
+
+/// when the client's send budget will have refilled for the updates still queued for it, or 0 if none are waiting on it
+inline double &getClientRefillTime(Client &client)
+{
+    return client.getPropertyReference<double, 0>(Client::DataType::Double);
+}
+
+/// set when there may be something new to send to the client
+inline flag &getClientWorkPendingFlag(Client &client)
+{
+    return client.getPropertyReference<flag, 2>(Client::DataType::ServerFlag);
+}
+
+/// tells whichever writer serves client that it may have more to send
+void wakeClientWriter(Client &client)
+{
+    getClientWorkPendingFlag(client).set();
+    function<void()> wake;
     {
-        while(!terminated)
-        {
-            NetworkProtocol::NetworkEvent event = NetworkProtocol::readNetworkEvent(reader);
+        LockedClient lockIt(client);
+        wake = getClientWakeFunction(client);
+    }
+    if(wake)
+        wake();
+}
+
+/// how much further than its view distance a chunk has to be before the client is unsubscribed from it,
+/// so a player walking back and forth over the edge doesn't resubscribe over and over
+constexpr float SubscriptionHysteresis = 2 * ChunkSize;
 
-            switch(event)
+/// which clients want block updates for which chunks. a client subscribes to the chunks it requests
+/// and is unsubscribed when they go out of its view distance; it's told so it can forget them and request them again
+class ChunkSubscriptions final
+{
+    ChunkSubscriptions(const ChunkSubscriptions &) = delete;
+    const ChunkSubscriptions &operator =(const ChunkSubscriptions &) = delete;
+private:
+    mutex lock;
+    unordered_map<ChunkPosition, vector<Client *>> subscribers;
+    unordered_map<Client *, unordered_set<ChunkPosition>> subscriptions;
+public:
+    ChunkSubscriptions()
+    {
+    }
+    void subscribe(Client &client, ChunkPosition chunk)
+    {
+        lock_guard<mutex> lockIt(lock);
+        if(getClientTerminatedFlag(client)) // checked under lock so we can't race with unsubscribeAll
+            return;
+        if(get<1>(subscriptions[&client].insert(chunk)))
+            subscribers[chunk].push_back(&client);
+    }
+    /// unsubscribes client from the chunks that are further than viewDistance plus the hysteresis from position
+    /// and returns them. must not have client locked
+    vector<ChunkPosition> unsubscribeOutOfRange(Client &client, PositionF position, float viewDistance)
+    {
+        vector<ChunkPosition> retval;
+        lock_guard<mutex> lockIt(lock);
+        auto iter = subscriptions.find(&client);
+        if(iter == subscriptions.end())
+            return retval;
+        float maxDistance = viewDistance + SubscriptionHysteresis;
+        for(auto chunkIter = iter->second.begin(); chunkIter != iter->second.end();)
+        {
+            ChunkPosition chunk = *chunkIter;
+            float distanceX = max<float>(0, max<float>(chunk.x - position.x, position.x - (chunk.x + ChunkSize)));
+            float distanceZ = max<float>(0, max<float>(chunk.z - position.z, position.z - (chunk.z + ChunkSize)));
+            if(chunk.d == position.d && distanceX <= maxDistance && distanceZ <= maxDistance)
             {
-            case NetworkProtocol::NetworkEvent::UpdatePositionAndVelocity:
+                chunkIter++;
+                continue;
+            }
+            retval.push_back(chunk);
+            chunkIter = iter->second.erase(chunkIter);
+            auto subscribersIter = subscribers.find(chunk);
+            vector<Client *> &clients = subscribersIter->second;
+            clients.erase(find(clients.begin(), clients.end(), &client));
+            if(clients.empty())
+                subscribers.erase(subscribersIter);
+        }
+        return retval;
+    }
+    /// call after client is terminated
+    void unsubscribeAll(Client &client)
+    {
+        lock_guard<mutex> lockIt(lock);
+        auto iter = subscriptions.find(&client);
+        if(iter == subscriptions.end())
+            return;
+        for(ChunkPosition chunk : iter->second)
+        {
+            auto subscribersIter = subscribers.find(chunk);
+            vector<Client *> &clients = subscribersIter->second;
+            clients.erase(find(clients.begin(), clients.end(), &client));
+            if(clients.empty())
+                subscribers.erase(subscribersIter);
+        }
+        subscriptions.erase(iter);
+    }
+    /// adds each update to the update lists of the clients subscribed to its chunk. returns the clients that got updates
+    unordered_set<Client *> publish(const UpdateList &updates)
+    {
+        unordered_set<Client *> updatedClients;
+        unordered_map<ChunkPosition, vector<PositionI>> updatesByChunk;
+        for(PositionI pos : updates.updatesList)
+        {
+            updatesByChunk[ChunkPosition(pos)].push_back(pos);
+        }
+        lock_guard<mutex> lockIt(lock);
+        for(const auto &p : updatesByChunk)
+        {
+            auto iter = subscribers.find(p.first);
+            if(iter == subscribers.end())
+                continue;
+            for(Client *client : iter->second)
             {
-                //cout << "Server : read position and velocity\n";
-                PositionF pos;
-                pos.x = reader.readFiniteF32();
-                pos.y = reader.readFiniteF32();
-                pos.z = reader.readFiniteF32();
-                pos.d = reader.readDimension();
-                VectorF velocity;
-                velocity.x = reader.readFiniteF32();
-                velocity.y = reader.readFiniteF32();
-                velocity.z = reader.readFiniteF32();
-                float phi, theta, viewDistance;
-                phi = reader.readLimitedF32(-M_PI / 2 - eps, M_PI / 2 + eps);
-                theta = reader.readLimitedF32(-2 * M_PI - eps, 2 * M_PI + eps);
-                viewDistance = reader.readLimitedF32(0, 1000);
-                bool flying = reader.readBool();
-                float age = reader.readLimitedF32(0, 1e10);
+                LockedClient lockClient(*client);
+                UpdateList &clientUpdateList = getClientUpdateList(*client);
+                for(PositionI pos : p.second)
                 {
-                    lock_guard<recursive_mutex> lockIt(world->lock);
-                    shared_ptr<EntityData> player = EntityPlayer::get(client);
-                    float serverAge = player->entity ? player->entity->age : 0;
-                    EntityPlayer::update(player, pos, velocity, theta, phi, flying);
+                    clientUpdateList.add(pos);
                 }
-                {
-                    LockedClient lockIt(client);
-                    getClientPosition(client) = pos;
-                    getClientVelocity(client) = velocity;
-                    getClientViewPhi(client) = phi;
-                    getClientViewTheta(client) = theta;
-                    getClientViewDistance(client) = viewDistance;
-                    getClientGotStateFlag(client) = true;
-                    getClientNeedStateFlag(client) = false;
-                }
-                continue;
+                updatedClients.insert(client);
             }
+        }
+        return updatedClients;
+    }
+};
+
+ChunkSubscriptions chunkSubscriptions;
+
+/// reads the body of a message from reader and applies it
+void handleClientEvent(NetworkProtocol::NetworkEvent event, Reader &reader, Client &client, shared_ptr<World> world)
+{
+    switch(event)
+    {
+    case NetworkProtocol::NetworkEvent::UpdatePositionAndVelocity:
+    {
+        //cout << "Server : read position and velocity\n";
+        PositionF pos;
+        pos.x = reader.readFiniteF32();
+        pos.y = reader.readFiniteF32();
+        pos.z = reader.readFiniteF32();
+        pos.d = reader.readDimension();
+        VectorF velocity;
+        velocity.x = reader.readFiniteF32();
+        velocity.y = reader.readFiniteF32();
+        velocity.z = reader.readFiniteF32();
+        float phi, theta, viewDistance;
+        phi = reader.readLimitedF32(-M_PI / 2 - eps, M_PI / 2 + eps);
+        theta = reader.readLimitedF32(-2 * M_PI - eps, 2 * M_PI + eps);
+        viewDistance = reader.readLimitedF32(0, 1000);
+        bool flying = reader.readBool();
+        float age = reader.readLimitedF32(0, 1e10);
+        {
+            lock_guard<recursive_mutex> lockIt(world->lock);
+            shared_ptr<EntityData> player = EntityPlayer::get(client);
+            float serverAge = player->entity ? player->entity->age : 0;
+            EntityPlayer::update(player, pos, velocity, theta, phi, flying);
+            world->entityMoved(player);
+        }
+        {
+            LockedClient lockIt(client);
+            getClientPosition(client) = pos;
+            getClientVelocity(client) = velocity;
+            getClientViewPhi(client) = phi;
+            getClientViewTheta(client) = theta;
+            getClientViewDistance(client) = viewDistance;
+            getClientGotStateFlag(client) = true;
+            getClientNeedStateFlag(client) = false;
+        }
+        wakeClientWriter(client); // the send order depends on where the player is
+        return;
+    }
 
-            case NetworkProtocol::NetworkEvent::RequestChunk:
+    case NetworkProtocol::NetworkEvent::RequestChunk:
+    {
+        PositionI origin;
+        origin.x = reader.readS32();
+        origin.y = reader.readS32();
+        origin.z = reader.readS32();
+        origin.d = reader.readDimension();
+        int size = reader.readU32();
+        {
+            lock_guard<recursive_mutex> lockIt(world->lock);
+            ChunkPosition cPos(origin);
+            world->addGenerateChunk((PositionI)cPos);
+        }
+        // subscribe before queueing the blocks so no change made in between is missed
+        for(int x = origin.x & ChunkFloorSizeMask; x < origin.x + size; x += ChunkSize)
+        {
+            for(int z = origin.z & ChunkFloorSizeMask; z < origin.z + size; z += ChunkSize)
+            {
+                chunkSubscriptions.subscribe(client, ChunkPosition(x, z, origin.d));
+            }
+        }
+        UpdateList &updateList = getClientUpdateList(client);
+        {
+            LockedClient lockIt(client);
+            UpdateList &unsubscribedChunks = getClientUnsubscribedChunks(client);
+            for(int x = origin.x & ChunkFloorSizeMask; x < origin.x + size; x += ChunkSize)
             {
-                PositionI origin;
-                origin.x = reader.readS32();
-                origin.y = reader.readS32();
-                origin.z = reader.readS32();
-                origin.d = reader.readDimension();
-                int size = reader.readU32();
+                for(int z = origin.z & ChunkFloorSizeMask; z < origin.z + size; z += ChunkSize)
                 {
-                    lock_guard<recursive_mutex> lockIt(world->lock);
-                    ChunkPosition cPos(origin);
-                    world->addGenerateChunk((PositionI)cPos);
+                    unsubscribedChunks.remove((PositionI)ChunkPosition(x, z, origin.d)); // still has the blocks, so don't tell it to forget them
                 }
-                UpdateList &updateList = getClientUpdateList(client);
+            }
+        }
 
-                for(int x = 0; x < size; x++)
+        for(int x = 0; x < size; x++)
+        {
+            LockedClient lockIt(client);
+            for(int y = 0; y < size; y++)
+            {
+                for(int z = 0; z < size; z++)
                 {
-                    LockedClient lockIt(client);
-                    for(int y = 0; y < size; y++)
-                    {
-                        for(int z = 0; z < size; z++)
-                        {
-                            updateList.add(origin + VectorI(x, y, z));
-                        }
-                    }
+                    updateList.add(origin + VectorI(x, y, z));
                 }
-
-                //cout << "Server : Got Chunk Request : " << origin.x << ", " << origin.y << ", " << origin.z << ", "
-                //     << (int)origin.d << endl;
-                continue;
             }
+        }
 
-            case NetworkProtocol::NetworkEvent::Last:
-                assert(false);
-            }
+        //cout << "Server : Got Chunk Request : " << origin.x << ", " << origin.y << ", " << origin.z << ", "
+        //     << (int)origin.d << endl;
+        wakeClientWriter(client);
+        return;
+    }
 
-            throw runtime_error("Network Event not implemented");
+    case NetworkProtocol::NetworkEvent::RequestImage:
+    {
+        Image::addImageRequest(client, Client::readId(reader));
+        wakeClientWriter(client);
+        return;
+    }
+
+    case NetworkProtocol::NetworkEvent::SendImage:
+    case NetworkProtocol::NetworkEvent::UnsubscribeChunk:
+        throw InvalidDataValueException("client sent a server only message");
+
+    case NetworkProtocol::NetworkEvent::Last:
+        assert(false);
+    }
+
+    throw runtime_error("Network Event not implemented");
+}
+
+NetworkProtocol::CompressionMode chooseCompressionMode(NetworkProtocol::CompressionMode clientMode, NetworkProtocol::CompressionMode serverMode)
+{
+    return (NetworkProtocol::CompressionMode)min((int)clientMode, (int)serverMode);
+}
+
+void runServerReaderThread(shared_ptr<StreamRW> connection, shared_ptr<Client> pclient,
+                           shared_ptr<World> world)
+{
+    NetworkProtocol::FrameReader frameReader(connection->reader());
+    Client &client = *pclient;
+    flag &terminated = getClientTerminatedFlag(client);
+
+    try
+    {
+        while(!terminated)
+        {
+            frameReader.readFrame([&](NetworkProtocol::NetworkEvent event, Reader &reader)
+            {
+                handleClientEvent(event, reader, client, world);
+            });
         }
     }
     catch(exception &e)
@@ -263,6 +452,7 @@ void runServerReaderThread(shared_ptr<StreamRW> connection, shared_ptr<Client> p
     }
 
     terminated = true;
+    getClientWorkPendingFlag(client).set(); // let the writer see that we're done
 }
 
 struct PlayerDistanceOrdering final
@@ -291,124 +481,344 @@ struct PlayerDistanceOrdering final
     }
 };
 
-void runServerWriterThread(shared_ptr<StreamRW> connection, shared_ptr<Client> pclient,
-                           shared_ptr<World> world)
+/// per-client outbound queue : sends the entities and blocks nearest to the player first, lets
+/// updates that have waited a long time catch up and paces the output with a token bucket
+class ClientSendScheduler final
 {
-    Writer &writer = connection->writer();
-    Client &client = *pclient;
-    flag &terminated = getClientTerminatedFlag(client);
-    flag &needState = getClientNeedStateFlag(client);
-    cout << "connected\n";
-    UpdateList &clientUpdateList = getClientUpdateList(client);
-    set<shared_ptr<RenderObjectEntity>> &entitiesList = client.getPropertyReference<set<shared_ptr<RenderObjectEntity>>, 0>(Client::DataType::RenderObjectEntitySet);
-    //PositionF &clientPosition = getClientPosition(client);
-    UpdateList updateList;
-    unordered_set<PositionI> neededUpdates;
-
-    try
+    ClientSendScheduler(const ClientSendScheduler &) = delete;
+    const ClientSendScheduler &operator =(const ClientSendScheduler &) = delete;
+private:
+    struct PendingChunk final
+    {
+        vector<PositionI> blocks;
+        double queueTime;
+    };
+    unordered_map<ChunkPosition, PendingChunk> pendingChunks;
+    unordered_set<PositionI> pendingBlocks;
+    unordered_map<shared_ptr<RenderObjectEntity>, double> pendingEntities; /// entity -> when it was queued
+    const double bytesPerSecond;
+    const double burstSize;
+    double tokens;
+    double lastRefillTime;
+    /// chunks closer than this are always sent before farther ones
+    static constexpr float nearDistance = 2 * ChunkSize;
+    /// how many blocks of distance are forgiven for each second an update has waited
+    static constexpr float stalenessWeight = 16;
+    /// bounds how long the world lock is held while building a batch
+    static constexpr size_t maxBlocksPerBatch = 4000;
+    /// running average of the bytes written per block, for deciding how many blocks fit in the budget
+    float bytesPerBlock = 256;
+    static float getPriority(float distance, bool sameDimension, double queueTime, double now)
+    {
+        if(!sameDimension)
+            distance = distance * 50 + 1000;
+        if(distance < nearDistance)
+            return distance - 1e6f;
+        return distance - stalenessWeight * (float)(now - queueTime);
+    }
+    struct QueuedUpdate final
+    {
+        float priority;
+        ChunkPosition chunk;
+        shared_ptr<RenderObjectEntity> entity; /// null for a chunk
+    };
+    struct BlockToWrite final
     {
+        PositionI pos;
+        shared_ptr<RenderObjectBlockMesh> mesh;
+        Lighting light;
+    };
+public:
+    /// bytesPerSecond is 0 for no limit
+    explicit ClientSendScheduler(double bytesPerSecond)
+        : bytesPerSecond(bytesPerSecond), burstSize(bytesPerSecond / 4), tokens(bytesPerSecond / 4), lastRefillTime(Display::realtimeTimer())
+    {
+    }
+    void add(const UpdateList &updates, double now)
+    {
+        for(PositionI pos : updates.updatesList)
         {
-            shared_ptr<RenderObjectEntity> roplayer;
+            if(!get<1>(pendingBlocks.insert(pos)))
+                continue;
+            ChunkPosition chunk(pos);
+            auto iter = pendingChunks.find(chunk);
+            if(iter == pendingChunks.end())
             {
-                LockedClient lockClient(client);
-                lock_guard<recursive_mutex> lockWorld(world->lock);
-                shared_ptr<EntityData> eplayer = EntityPlayer::get(client);
-                EntityPlayer::update(eplayer, PositionF(0.5, 0.5 + AverageGroundHeight + 10, 0.5, Dimension::Overworld), VectorF(0), 0, 0, false);
-                world->addEntity(eplayer);
-                roplayer = eplayer->desc->getEntity(*eplayer, world);
+                iter = pendingChunks.insert(make_pair(chunk, PendingChunk())).first;
+                iter->second.queueTime = now;
             }
-            NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::SendPlayer);
-            roplayer->write(writer, client);
+            iter->second.blocks.push_back(pos);
         }
-#if 0
+    }
+    /// drops the queued blocks in chunk
+    void remove(ChunkPosition chunk)
+    {
+        auto iter = pendingChunks.find(chunk);
+        if(iter == pendingChunks.end())
+            return;
+        for(PositionI pos : iter->second.blocks)
+            pendingBlocks.erase(pos);
+        pendingChunks.erase(iter);
+    }
+    /// entities is the entities that changed since the last call
+    void add(const vector<shared_ptr<RenderObjectEntity>> &entities, double now)
+    {
+        for(shared_ptr<RenderObjectEntity> e : entities)
         {
-            shared_ptr<RenderObjectEntityMesh> entityMesh = make_shared<RenderObjectEntityMesh>(VectorF(0),
-                    VectorF(0));
-            entityMesh->addPart(Generate::unitBox(TextureAtlas::Wool.td(), TextureAtlas::Wool.td(),
-                                                  TextureAtlas::Wool.td(), TextureAtlas::Wool.td(), TextureAtlas::Wool.td(), TextureAtlas::Wool.td()),
-                                Script::parse(
-                                    L"io.transform = make_translate(<-0.5, -0.5, -0.5>) ~ make_rotatey(io.age / 5 * 2 * pi) ~ make_translate(io.position);io.colorR=io.colorG=1-(io.colorB=0.5+0.5*sin(io.age*2*pi))"));
-            shared_ptr<RenderObjectEntity> entity = make_shared<RenderObjectEntity>(entityMesh, PositionF(0.5,
-                                                    AverageGroundHeight + 10.5, 0.5, Dimension::Overworld), VectorF(0,-0.1,0), 0);
-            NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::UpdateRenderObjects);
-            writer.writeU64(1);
-            entity->write(writer, client);
+            pendingEntities.insert(make_pair(e, now)); // keeps the older queue time if it's already queued
         }
-#endif
-        while(!terminated)
+    }
+    bool empty() const
+    {
+        return pendingBlocks.empty() && pendingEntities.empty();
+    }
+    void refill(double now)
+    {
+        tokens = min(burstSize, tokens + bytesPerSecond * (now - lastRefillTime));
+        lastRefillTime = now;
+    }
+    bool hasBudget() const
+    {
+        return bytesPerSecond <= 0 || tokens > 0;
+    }
+    /// how long until refill gives us budget again
+    double getRefillDelay() const
+    {
+        if(hasBudget())
+            return 0;
+        return (1 - tokens) / bytesPerSecond;
+    }
+    void consume(size_t byteCount)
+    {
+        if(bytesPerSecond > 0)
+            tokens -= byteCount;
+    }
+    /// writes queued entities and blocks in one priority order until the budget or the batch is used up.
+    /// the world is only locked while the blocks' meshes are looked up. returns the number of objects written
+    size_t write(ChainWriter &writer, Client &client, shared_ptr<World> world, PositionF playerPosition, double now)
+    {
+        vector<QueuedUpdate> order;
+        order.reserve(pendingChunks.size() + pendingEntities.size());
+        for(const auto &p : pendingEntities)
+        {
+            shared_ptr<RenderObjectEntity> e = get<0>(p);
+            float priority = -numeric_limits<float>::infinity(); // removals first because they're tiny and can't be resent
+            if(e->good())
+            {
+                PositionF position = e->physicsObject->getPosition();
+                priority = getPriority(abs((VectorF)position - (VectorF)playerPosition), position.d == playerPosition.d, get<1>(p), now);
+            }
+            order.push_back(QueuedUpdate{priority, ChunkPosition(), e});
+        }
+        for(const auto &p : pendingChunks)
+        {
+            ChunkPosition chunk = get<0>(p);
+            float distance = abs(VectorF(chunk.x + ChunkSize / 2 - playerPosition.x, 0, chunk.z + ChunkSize / 2 - playerPosition.z));
+            order.push_back(QueuedUpdate{getPriority(distance, chunk.d == playerPosition.d, get<1>(p).queueTime, now), chunk, nullptr});
+        }
+        sort(order.begin(), order.end(), [](const QueuedUpdate &a, const QueuedUpdate &b)
+        {
+            return a.priority < b.priority;
+        });
+
+        // entities are written as we go; blocks are only counted against the budget until we have the lock
+        size_t count = 0, blockCount = 0;
+        double reservedBytes = 0;
+        vector<pair<ChunkPosition, size_t>> chunks; /// chunk and how many of its blocks to send
+        for(const QueuedUpdate &update : order)
         {
-            list<shared_ptr<RenderObject>> objects;
-            bool didAnything = false;
-            client.lock();
-            //PositionF curClientPosition = clientPosition;
-            updateList.merge(clientUpdateList);
-            clientUpdateList.clear();
-            for(auto e : entitiesList)
+            bool haveBudget = bytesPerSecond <= 0 || tokens - reservedBytes > 0;
+            if(update.entity != nullptr)
             {
-                objects.push_back(e);
+                if(update.entity->good() && !haveBudget)
+                    break;
+                size_t startSize = writer.size();
+                update.entity->write(writer, client);
+                consume(writer.size() - startSize);
+                pendingEntities.erase(update.entity);
+                count++;
+                continue;
             }
-            entitiesList.clear();
-            client.unlock();
+            if(!haveBudget || blockCount >= maxBlocksPerBatch)
+                break;
+            size_t chunkBlockCount = pendingChunks[update.chunk].blocks.size();
+            if(bytesPerSecond > 0)
+                chunkBlockCount = min<size_t>(chunkBlockCount, (size_t)ceil((tokens - reservedBytes) / bytesPerBlock));
+            chunkBlockCount = min(chunkBlockCount, maxBlocksPerBatch - blockCount);
+            chunks.push_back(make_pair(update.chunk, chunkBlockCount));
+            blockCount += chunkBlockCount;
+            reservedBytes += chunkBlockCount * bytesPerBlock;
+        }
+        if(chunks.empty())
+            return count;
 
-            if(!updateList.updatesList.empty())
+        vector<BlockToWrite> blocksToWrite;
+        blocksToWrite.reserve(blockCount);
+        {
+            lock_guard<recursive_mutex> lockWorld(world->lock);
+            BlockIterator bi = world->get((PositionI)chunks.front().first);
+            for(const pair<ChunkPosition, size_t> &p : chunks)
             {
-                bool locked = true;
-                world->lock.lock();
-                BlockIterator bi = world->get(updateList.updatesList.front());
-                ssize_t count = 0;
-                for(auto i = updateList.updatesList.begin(); i != updateList.updatesList.end();)
+                auto chunkIter = pendingChunks.find(get<0>(p));
+                vector<PositionI> &blocks = chunkIter->second.blocks;
+                size_t keptCount = 0;
+                for(size_t i = 0; i < blocks.size(); i++)
                 {
-                    PositionI pos = *i;
+                    PositionI pos = blocks[i];
                     bi = pos;
-
-                    if(count >= max<ssize_t>(1000, 4000 - (ssize_t)objects.size() / 2))
-                    {
-                        if(locked)
-                        {
-                            world->lock.unlock();
-                            locked = false;
-                        }
-                        break;
-                    }
-                    else if(bi.get().good())
+                    if(i >= get<1>(p) || !bi.get().good()) // over budget or not generated yet : keep it
                     {
-                        assert(locked);
-                        shared_ptr<RenderObjectBlockMesh> mesh = bi.get().desc->getBlockMesh(bi);
-                        shared_ptr<RenderObject> object = static_pointer_cast<RenderObject>(make_shared<RenderObjectBlock>
-                                                          (mesh, pos, bi.get().light));
-                        objects.push_back(object);
-                        count++;
-                        updateList.updatesSet.erase(pos);
-                        i = updateList.updatesList.erase(i);
+                        blocks[keptCount++] = pos;
+                        continue;
                     }
-                    else
-                        i++;
+                    blocksToWrite.push_back(BlockToWrite{pos, bi.get().desc->getBlockMesh(bi), bi.get().light});
+                    pendingBlocks.erase(pos);
                 }
-
-                if(locked)
-                    world->lock.unlock();
+                blocks.resize(keptCount);
+                if(blocks.empty())
+                    pendingChunks.erase(chunkIter);
             }
+        }
 
-            if(!objects.empty())
-            {
-                didAnything = true;
-                //cout << "Server : writing " << objects.size() << " render objects\n";
-                NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::UpdateRenderObjects);
-                writer.writeU64(objects.size());
+        size_t startSize = writer.size();
+        for(const BlockToWrite &block : blocksToWrite)
+        {
+            make_shared<RenderObjectBlock>(block.mesh, block.pos, block.light)->write(writer, client);
+        }
+        size_t byteCount = writer.size() - startSize;
+        consume(byteCount);
+        if(!blocksToWrite.empty())
+            bytesPerBlock = 0.75f * bytesPerBlock + 0.25f * (float)byteCount / blocksToWrite.size();
+        return count + blocksToWrite.size();
+    }
+};
 
-                for(shared_ptr<RenderObject> object : objects)
-                {
-                    object->write(writer, client);
-                }
-            }
-            if(needState.exchange(false))
-            {
-                NetworkProtocol::writeNetworkEvent(writer, NetworkProtocol::NetworkEvent::RequestState);
-                didAnything = true;
-            }
+void writeClientPlayer(NetworkProtocol::FrameWriter &frameWriter, Client &client, shared_ptr<World> world)
+{
+    shared_ptr<RenderObjectEntity> roplayer;
+    {
+        LockedClient lockClient(client);
+        lock_guard<recursive_mutex> lockWorld(world->lock);
+        shared_ptr<EntityData> eplayer = EntityPlayer::get(client);
+        EntityPlayer::update(eplayer, PositionF(0.5, 0.5 + AverageGroundHeight + 10, 0.5, Dimension::Overworld), VectorF(0), 0, 0, false);
+        world->addEntity(eplayer);
+        roplayer = eplayer->desc->getEntity(*eplayer, world);
+    }
+    roplayer->write(frameWriter.beginMessage(NetworkProtocol::NetworkEvent::SendPlayer), client);
+    frameWriter.endMessage();
+#if 0
+    {
+        shared_ptr<RenderObjectEntityMesh> entityMesh = make_shared<RenderObjectEntityMesh>(VectorF(0),
+                VectorF(0));
+        entityMesh->addPart(Generate::unitBox(TextureAtlas::Wool.td(), TextureAtlas::Wool.td(),
+                                              TextureAtlas::Wool.td(), TextureAtlas::Wool.td(), TextureAtlas::Wool.td(), TextureAtlas::Wool.td()),
+                            Script::parse(
+                                L"io.transform = make_translate(<-0.5, -0.5, -0.5>) ~ make_rotatey(io.age / 5 * 2 * pi) ~ make_translate(io.position);io.colorR=io.colorG=1-(io.colorB=0.5+0.5*sin(io.age*2*pi))"));
+        shared_ptr<RenderObjectEntity> entity = make_shared<RenderObjectEntity>(entityMesh, PositionF(0.5,
+                                                AverageGroundHeight + 10.5, 0.5, Dimension::Overworld), VectorF(0,-0.1,0), 0);
+        Writer &writer = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::UpdateRenderObjects);
+        writer.writeU64(1);
+        entity->write(writer, client);
+        frameWriter.endMessage();
+    }
+#endif
+}
+
+/// writes the next batch of updates for client. returns false if there wasn't anything to write
+bool writeClientUpdates(NetworkProtocol::FrameWriter &frameWriter, Client &client, shared_ptr<World> world, ClientSendScheduler &scheduler)
+{
+    flag &needState = getClientNeedStateFlag(client);
+    UpdateList &clientUpdateList = getClientUpdateList(client);
+    set<shared_ptr<RenderObjectEntity>> &entitiesList = client.getPropertyReference<set<shared_ptr<RenderObjectEntity>>, 0>(Client::DataType::RenderObjectEntitySet);
+    vector<shared_ptr<RenderObjectEntity>> entities;
+    bool didAnything = false;
+    double now = Display::realtimeTimer();
+    client.lock();
+    scheduler.add(clientUpdateList, now);
+    clientUpdateList.clear();
+    UpdateList &clientUnsubscribedChunks = getClientUnsubscribedChunks(client);
+    list<PositionI> unsubscribedChunks;
+    unsubscribedChunks.swap(clientUnsubscribedChunks.updatesList);
+    clientUnsubscribedChunks.clear();
+    PositionF playerPosition = getClientPosition(client);
+    entities.assign(entitiesList.begin(), entitiesList.end()); // the simulate thread only queues entities that need updating
+    entitiesList.clear();
+    client.unlock();
+    scheduler.add(entities, now);
+    scheduler.refill(now);
+
+    // before any blocks so the client doesn't forget blocks sent after it was unsubscribed
+    for(PositionI pos : unsubscribedChunks)
+    {
+        ChunkPosition chunk(pos);
+        scheduler.remove(chunk);
+        Writer &writer = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::UnsubscribeChunk);
+        writer.writeS32(chunk.x);
+        writer.writeS32(chunk.z);
+        writer.writeDimension(chunk.d);
+        frameWriter.endMessage();
+        didAnything = true;
+    }
+
+    ChainWriter objects;
+    size_t objectCount = scheduler.write(objects, client, world, playerPosition, now);
+
+    if(objectCount > 0)
+    {
+        didAnything = true;
+        //cout << "Server : writing " << objectCount << " render objects\n";
+        Writer &writer = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::UpdateRenderObjects);
+        writer.writeU64(objectCount);
+        objects.writeTo(writer); // the cached block meshes in objects are passed along, not copied
+        frameWriter.endMessage();
+    }
+    for(Client::IdType id : Image::takeImageRequests(client))
+    {
+        Writer &writer = frameWriter.beginMessage(NetworkProtocol::NetworkEvent::SendImage);
+        Image::writeRequested(writer, client, id);
+        frameWriter.endMessage();
+        didAnything = true;
+    }
+    if(needState.exchange(false))
+    {
+        frameWriter.beginMessage(NetworkProtocol::NetworkEvent::RequestState);
+        frameWriter.endMessage();
+        didAnything = true;
+    }
+    {
+        // event loop connections aren't woken again until something new is queued, so the simulate thread wakes them when the budget refills
+        LockedClient lockClient(client);
+        getClientRefillTime(client) = (scheduler.empty() || scheduler.hasBudget()) ? 0 : now + scheduler.getRefillDelay();
+    }
+    return didAnything;
+}
+
+void runServerWriterThread(shared_ptr<StreamRW> connection, shared_ptr<Client> pclient,
+                           shared_ptr<World> world, double bandwidthLimit)
+{
+    Writer &writer = connection->writer();
+    Client &client = *pclient;
+    flag &terminated = getClientTerminatedFlag(client);
+    flag &workPending = getClientWorkPendingFlag(client);
+    cout << "connected\n";
+    ClientSendScheduler scheduler(bandwidthLimit);
+    NetworkProtocol::FrameWriter frameWriter;
+
+    try
+    {
+        writeClientPlayer(frameWriter, client, world);
+        while(!terminated)
+        {
+            workPending = false; // cleared first so a producer signalling while we write isn't lost
+            bool didAnything = writeClientUpdates(frameWriter, client, world, scheduler);
+            frameWriter.writeFrame(writer);
             writer.flush();
-            if(!didAnything)
-                this_thread::sleep_for(chrono::milliseconds(1));
+            if(didAnything)
+                continue;
+            if(!scheduler.hasBudget()) // nothing new may come in, but the budget will refill
+                workPending.waitFor(chrono::duration<double>(scheduler.getRefillDelay()));
+            else
+                workPending.wait();
         }
     }
     catch(exception &e)
@@ -419,31 +829,114 @@ void runServerWriterThread(shared_ptr<StreamRW> connection, shared_ptr<Client> p
     terminated = true;
 }
 
-struct Periodic
+void runServerConnection(shared_ptr<StreamRW> connection, shared_ptr<Client> pclient,
+                         shared_ptr<World> world, NetworkProtocol::CompressionMode serverMode, double bandwidthLimit)
 {
-    double lastFlipTime = -1e9;
-    double deltaTime = 1 / 60.0;
-
-    void runAtFPS(float fps)
+    try
     {
-        double sleepTime;
-        double curTime = Display::realtimeTimer();
-        sleepTime = 1 / fps - (curTime - lastFlipTime);
+        NetworkProtocol::CompressionMode mode = chooseCompressionMode(NetworkProtocol::readCompressionMode(connection->reader()), serverMode);
+        Image::setPeerCachedHashes(*pclient, NetworkProtocol::readCachedImageHashes(connection->reader()));
+        NetworkProtocol::writeCompressionMode(connection->writer(), mode);
+        connection->writer().flush();
+        if(mode == NetworkProtocol::CompressionMode::Adaptive)
+        {
+            connection = shared_ptr<StreamRW>(new StreamRWWrapper(connection->preader(), shared_ptr<Writer>(new AdaptiveCompressWriter(connection->pwriter()))));
+        }
+    }
+    catch(exception &e)
+    {
+        cerr << "Error : " << e.what() << endl;
+        getClientTerminatedFlag(*pclient) = true;
+        return;
+    }
+    thread writerThread(runServerWriterThread, connection, pclient, world, bandwidthLimit);
+    runServerReaderThread(connection, pclient, world);
+    writerThread.join();
+}
 
-        if(sleepTime <= eps)
+/// per-connection state for clients served by the NetworkEventLoop
+class ServerConnectionHandler final : public NetworkEventLoop::Handler
+{
+private:
+    shared_ptr<Client> pclient;
+    shared_ptr<World> world;
+    ClientSendScheduler scheduler;
+    NetworkProtocol::FrameWriter frameWriter;
+    bool sentPlayer;
+    const NetworkProtocol::CompressionMode serverMode;
+    bool gotCompressionMode;
+    shared_ptr<ChainWriter> output;
+    shared_ptr<Writer> writer;
+public:
+    ServerConnectionHandler(shared_ptr<Client> pclient, shared_ptr<World> world, NetworkProtocol::CompressionMode serverMode, double bandwidthLimit)
+        : pclient(pclient), world(world), scheduler(bandwidthLimit), sentPlayer(false), serverMode(serverMode), gotCompressionMode(false), output(make_shared<ChainWriter>()), writer(output)
+    {
+        cout << "connected\n";
+    }
+    virtual size_t onRead(const uint8_t * data, size_t size) override
+    {
+        Client &client = *pclient;
+        size_t used = 0;
+        if(!gotCompressionMode)
         {
-            if(lastFlipTime >= 0)
-                deltaTime = curTime - lastFlipTime;
-            lastFlipTime = curTime;
+            MemoryReader reader(shared_ptr<const uint8_t>(data, [](const uint8_t *){}), size);
+            NetworkProtocol::CompressionMode mode;
+            vector<uint64_t> cachedImageHashes;
+            try
+            {
+                mode = chooseCompressionMode(NetworkProtocol::readCompressionMode(reader), serverMode);
+                cachedImageHashes = NetworkProtocol::readCachedImageHashes(reader);
+            }
+            catch(EOFException &e)
+            {
+                return 0; // wait for the rest of the handshake
+            }
+            Image::setPeerCachedHashes(client, cachedImageHashes);
+            NetworkProtocol::writeCompressionMode(*output, mode);
+            if(mode == NetworkProtocol::CompressionMode::Adaptive)
+                writer = shared_ptr<Writer>(new AdaptiveCompressWriter(output));
+            gotCompressionMode = true;
+            used += reader.position();
+        }
+        while(used < size && !getClientTerminatedFlag(client))
+        {
+            size_t frameSize = NetworkProtocol::getFrameSize(data + used, size - used);
+            if(frameSize == 0)
+                break; // wait for the rest of the frame
+            NetworkProtocol::forEachMessage(data + used + sizeof(uint32_t), frameSize - sizeof(uint32_t), [&](NetworkProtocol::NetworkEvent event, Reader &reader)
+            {
+                handleClientEvent(event, reader, client, world);
+            });
+            used += frameSize;
         }
-        else
+        return used;
+    }
+    virtual bool onWritable(Writer &connectionWriter) override
+    {
+        if(getClientTerminatedFlag(*pclient))
+            throw IOException("client terminated");
+        if(!gotCompressionMode)
+            return false;
+        if(!sentPlayer)
         {
-            this_thread::sleep_for(chrono::nanoseconds(static_cast<int64_t>(sleepTime * 1e9)));
-            curTime = Display::realtimeTimer();
-            deltaTime = curTime - lastFlipTime;
-            lastFlipTime = curTime;
+            sentPlayer = true;
+            writeClientPlayer(frameWriter, *pclient, world);
         }
-        //cout << "Delta Time : " << deltaTime << endl;
+        writeClientUpdates(frameWriter, *pclient, world, scheduler);
+        frameWriter.writeFrame(*writer);
+        writer->flush();
+        bool retval = !output->empty();
+        output->writeTo(connectionWriter);
+        output->clear();
+        return retval;
+    }
+    virtual void onClose() override
+    {
+        getClientTerminatedFlag(*pclient) = true;
+    }
+    virtual size_t maxInputSize() const override
+    {
+        return sizeof(uint32_t) + NetworkProtocol::MaxFrameSize;
     }
 };
 
@@ -558,18 +1051,22 @@ void serverSimulateThreadFn(shared_ptr<list<shared_ptr<Client>>> clients, shared
 
     try
     {
-        Periodic periodic;
         generateInitialWorld(world);
+        TickScheduler tickScheduler(ServerTicksPerSecond, ServerMaxCatchUpTicks);
         uint64_t frame = 0;
-        set<shared_ptr<EntityData>> entitiesSet;
+        ThreadPool entityThreadPool(EntityMoveThreadCount - 1);
 
         while(true)
         {
+            tickScheduler.beginTick();
+            PROFILE_TICK_END(); // here so every phase of the last tick has finished
             {
+                PROFILE_TICK_PHASE("client updates");
                 lock_guard<recursive_mutex> lockIt(world->lock);
                 UpdateList updateList = world->copyOutUpdates();
                 vector<shared_ptr<RenderObjectEntity>> destroyedEntities = world->copyOutDestroyedEntities();
                 vector<shared_ptr<EntityData>> playerEntities;
+                vector<shared_ptr<Client>> terminatedClients;
 
                 for(auto i = clients->begin(); i != clients->end();)
                 {
@@ -577,6 +1074,7 @@ void serverSimulateThreadFn(shared_ptr<list<shared_ptr<Client>>> clients, shared
                     LockedClient lockClient(client);
                     if(getClientTerminatedFlag(client))
                     {
+                        terminatedClients.push_back(*i);
                         i = clients->erase(i);
                         serverClientCount--;
                         if(serverClientCount <= 0)
@@ -589,14 +1087,56 @@ void serverSimulateThreadFn(shared_ptr<list<shared_ptr<Client>>> clients, shared
                     }
                 }
 
+                for(shared_ptr<Client> pclient : terminatedClients)
+                {
+                    chunkSubscriptions.unsubscribeAll(*pclient);
+                }
+
+                unordered_set<Client *> updatedClients;
+                {
+                    PROFILE_TICK_PHASE("publish block updates");
+                    PROFILE_TICK_ITEMS("publish block updates", updateList.updatesList.size());
+                    updatedClients = chunkSubscriptions.publish(updateList);
+                }
+
+                if(frame % (uint64_t)ServerTicksPerSecond == 0)
+                {
+                    for(shared_ptr<Client> pclient : *clients)
+                    {
+                        PositionF position;
+                        float viewDistance;
+                        {
+                            LockedClient lockClient(*pclient);
+                            position = getClientPosition(*pclient);
+                            viewDistance = getClientViewDistance(*pclient);
+                        }
+                        if(viewDistance <= 0) // hasn't sent its state yet
+                            continue;
+                        vector<ChunkPosition> chunks = chunkSubscriptions.unsubscribeOutOfRange(*pclient, position, viewDistance);
+                        if(chunks.empty())
+                            continue;
+                        LockedClient lockClient(*pclient);
+                        UpdateList &unsubscribedChunks = getClientUnsubscribedChunks(*pclient);
+                        for(ChunkPosition chunk : chunks)
+                            unsubscribedChunks.add((PositionI)chunk);
+                        updatedClients.insert(pclient.get());
+                    }
+                }
+
+                double now = Display::realtimeTimer();
                 for(shared_ptr<Client> pclient : *clients)
                 {
                     LockedClient lockClient(*pclient);
+                    bool needStateWasSet = false;
                     if(getClientGotStateFlag(*pclient))
                     {
-                        getClientNeedStateFlag(*pclient) = true;
+                        needStateWasSet = !getClientNeedStateFlag(*pclient).exchange(true);
                         getClientGotStateFlag(*pclient) = false;
                     }
+                    double &refillTime = getClientRefillTime(*pclient);
+                    bool budgetRefilled = refillTime != 0 && refillTime <= now;
+                    if(budgetRefilled)
+                        refillTime = 0;
 #if 1
                     if(frame % 80 == 0)
                     {
@@ -617,47 +1157,59 @@ void serverSimulateThreadFn(shared_ptr<list<shared_ptr<Client>>> clients, shared
                         }
                     }
 #endif
-                    UpdateList &cul = getClientUpdateList(*pclient);
                     set<shared_ptr<RenderObjectEntity>> &entitiesList = pclient->getPropertyReference<set<shared_ptr<RenderObjectEntity>>, 0>(Client::DataType::RenderObjectEntitySet);
-                    cul.merge(updateList);
+                    bool queuedEntities = false;
+                    // only entities the client is out of date on are queued, so an idle client's writer isn't woken
+                    auto queueEntity = [&](shared_ptr<RenderObjectEntity> e)
+                    {
+                        if(e->needsUpdate(*pclient) && get<1>(entitiesList.insert(e)))
+                            queuedEntities = true;
+                    };
                     for(auto e : destroyedEntities)
                     {
-                        entitiesList.insert(e);
+                        queueEntity(e);
                     }
                     for(auto e : playerEntities)
                     {
-                        entitiesList.insert(e->desc->getEntity(*e, world));
+                        queueEntity(e->desc->getEntity(*e, world));
                     }
                     PositionF &clientPosition = getClientPosition(*pclient);
                     VectorF min = (VectorF)clientPosition - VectorF(getClientViewDistance(*pclient));
                     VectorF max = (VectorF)clientPosition + VectorF(getClientViewDistance(*pclient));
-                    world->forEachEntityInRange([&entitiesList, world](shared_ptr<EntityData> e)->int
                     {
-                        entitiesList.insert(e->desc->getEntity(*e, world));
-                        return 0;
-                    }, min, max, clientPosition.d);
+                        PROFILE_TICK_PHASE("entity range query");
+                        world->forEachEntityInRange([&queueEntity, world](shared_ptr<EntityData> e)->int
+                        {
+                            PROFILE_TICK_ITEMS("entity range query", 1);
+                            queueEntity(e->desc->getEntity(*e, world));
+                            return 0;
+                        }, min, max, clientPosition.d);
+                    }
                     for(auto e : pclient->getAllPtrs<RenderObjectEntity>(Client::DataType::RenderObjectEntity))
                     {
                         if(!e->good())
-                            entitiesList.insert(e);
+                            queueEntity(e);
                         else if((e->position.x < min.x || e->position.x > max.x || e->position.y < min.y || e->position.y > max.y || e->position.z < min.z || e->position.z > max.z || e->position.d != clientPosition.d) && !e->isPlayer())
                         {
                             e->clear();
-                            entitiesList.insert(e);
+                            queueEntity(e);
                         }
                     }
+                    if(queuedEntities || updatedClients.count(pclient.get()) != 0 || needStateWasSet || budgetRefilled)
+                        wakeClientWriter(*pclient);
                 }
             }
 
-            float deltaTime = periodic.deltaTime;
-            entitiesSet.clear();
-            world->forEachEntity([world, &entitiesSet, deltaTime](shared_ptr<EntityData> e)->int
+            float deltaTime = tickScheduler.getTickDuration();
             {
-                if(get<1>(entitiesSet.insert(e)))
+                PROFILE_TICK_PHASE("entity move");
+                world->forEachEntityParallel([world, deltaTime](shared_ptr<EntityData> e)
+                {
                     e->desc->onMove(*e, world, deltaTime);
-                return 0;
-            });
+                }, deltaTime, entityThreadPool);
+            }
 
+            PROFILE_TICK_PHASE("start generators");
             for(shared_ptr<ChunkGenerator> &generator : generators)
             {
                 if(generator != nullptr && generator->inUse())
@@ -687,8 +1239,12 @@ void serverSimulateThreadFn(shared_ptr<list<shared_ptr<Client>>> clients, shared
                 assert(retval);
             }
 
-            periodic.runAtFPS(20);
+            tickScheduler.endTick();
             frame++;
+            if(frame % ServerTickMetricsInterval == 0)
+            {
+                cout << "Server : " << tickScheduler.takeMetrics() << endl;
+            }
             //cout << "server frame : " << frame << endl;
         }
     }
@@ -705,6 +1261,7 @@ void runServer(StreamServer &server)
     shared_ptr<list<thread>> threads = make_shared<list<thread>>();
     shared_ptr<list<shared_ptr<Client>>> clients = make_shared<list<shared_ptr<Client>>>();
     shared_ptr<World> world = World::make();
+    NetworkEventLoop eventLoop(NetworkThreadCount);
     thread serverSimulateThread(serverSimulateThreadFn, clients, world);
 
     try
@@ -713,12 +1270,36 @@ void runServer(StreamServer &server)
         {
             shared_ptr<StreamRW> stream = server.accept();
             serverClientCount++;
-            //stream = shared_ptr<StreamRW>(new StreamRWWrapper(shared_ptr<Reader>(new ExpandReader(stream->preader())), shared_ptr<Writer>(new CompressWriter(stream->pwriter()))));
             lock_guard<recursive_mutex> lockIt(world->lock);
             shared_ptr<Client> pclient = make_shared<Client>();
             clients->push_back(pclient);
-            threads->push_back(thread(runServerWriterThread, stream, pclient, world));
-            threads->push_back(thread(runServerReaderThread, stream, pclient, world));
+            shared_ptr<NetworkConnection> networkConnection = dynamic_pointer_cast<NetworkConnection>(stream);
+            // compression only pays off when bandwidth isn't free
+            NetworkProtocol::CompressionMode serverMode = NetworkProtocol::CompressionMode::None;
+            double bandwidthLimit = 0;
+            int fd = -1;
+            if(networkConnection != nullptr)
+            {
+                if(!networkConnection->peerIsLocal())
+                {
+                    serverMode = NetworkProtocol::CompressionMode::Adaptive;
+                    bandwidthLimit = ClientBandwidthLimit;
+                }
+                fd = networkConnection->releaseSocket();
+            }
+            if(fd != -1)
+            {
+                shared_ptr<NetworkEventLoop::Connection> connection = eventLoop.add(fd, make_shared<ServerConnectionHandler>(pclient, world, serverMode, bandwidthLimit));
+                weak_ptr<NetworkEventLoop::Connection> wconnection = connection;
+                getClientWakeFunction(*pclient) = [wconnection]()
+                {
+                    shared_ptr<NetworkEventLoop::Connection> connection = wconnection.lock();
+                    if(connection != nullptr)
+                        connection->wake();
+                };
+                continue;
+            }
+            threads->push_back(thread(runServerConnection, stream, pclient, world, serverMode, bandwidthLimit));
         }
     }
     catch(NoStreamsLeftException &e)
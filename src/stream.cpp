@@ -77,6 +77,31 @@ public:
         pipe->lock.unlock();
         return retval;
     }
+    virtual void readBytes(uint8_t * array, size_t count) override
+    {
+        pipe->lock.lock();
+        while(count > 0)
+        {
+            if(pipe->buffer.empty())
+            {
+                pipe->cond.notify_all();
+                if(pipe->closed)
+                {
+                    pipe->lock.unlock();
+                    throw EOFException();
+                }
+                pipe->cond.wait(pipe->lock);
+                continue;
+            }
+            do
+            {
+                *array++ = pipe->buffer.front();
+                pipe->buffer.pop();
+            }
+            while(--count > 0 && !pipe->buffer.empty());
+        }
+        pipe->lock.unlock();
+    }
 };
 
 class PipeWriter final : public Writer
@@ -116,6 +141,31 @@ public:
         pipe->lock.unlock();
     }
 
+    virtual void writeBytes(const uint8_t * array, size_t count) override
+    {
+        pipe->lock.lock();
+        while(count > 0)
+        {
+            if(pipe->closed)
+            {
+                pipe->lock.unlock();
+                throw IOException("IO Error : can't write to pipe");
+            }
+            if(pipe->buffer.size() >= bufferSize)
+            {
+                pipe->cond.notify_all();
+                pipe->cond.wait(pipe->lock);
+                continue;
+            }
+            do
+            {
+                pipe->buffer.push(*array++);
+            }
+            while(--count > 0 && pipe->buffer.size() < bufferSize);
+        }
+        pipe->lock.unlock();
+    }
+
     virtual void flush() override
     {
         pipe->lock.lock();
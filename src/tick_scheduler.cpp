@@ -0,0 +1,100 @@
+/*
+ * Voxels is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * Voxels is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Voxels; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+#include "tick_scheduler.h"
+#include <thread>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+constexpr size_t TickScheduler::Metrics::histogramBucketCount;
+
+namespace
+{
+/// seconds on a clock that doesn't jump when the wall clock is set, so a step back can't freeze the ticks
+double getSteadyTime()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+}
+
+double TickScheduler::Metrics::durationPercentile(double fraction) const
+{
+    if(tickCount == 0)
+        return 0;
+    uint64_t target = (uint64_t)ceil(fraction * tickCount);
+    uint64_t count = 0;
+    for(size_t i = 0; i < histogramBucketCount - 1; i++)
+    {
+        count += durationHistogram[i];
+        if(count >= target)
+            return min(tickBudget * (i + 1) / 8, maxDuration); // the bucket's upper bound can be above any real tick
+    }
+    return maxDuration;
+}
+
+TickScheduler::TickScheduler(double ticksPerSecond, unsigned maxCatchUpTicks)
+    : tickDuration(1 / ticksPerSecond), maxCatchUpTicks(maxCatchUpTicks), nextTickTime(getSteadyTime()), tickStartTime(nextTickTime), metrics(tickDuration)
+{
+}
+
+void TickScheduler::beginTick()
+{
+    double currentTime = getSteadyTime();
+    if(currentTime < nextTickTime)
+    {
+        this_thread::sleep_for(chrono::duration<double>(nextTickTime - currentTime));
+        currentTime = getSteadyTime();
+    }
+    else
+    {
+        double behindTicks = floor((currentTime - nextTickTime) / tickDuration);
+        if(behindTicks > maxCatchUpTicks)
+        {
+            double skipCount = behindTicks - maxCatchUpTicks;
+            metrics.skippedTickCount += (uint64_t)skipCount;
+            nextTickTime += skipCount * tickDuration;
+        }
+    }
+    tickStartTime = currentTime;
+    nextTickTime += tickDuration;
+}
+
+void TickScheduler::endTick()
+{
+    double duration = getSteadyTime() - tickStartTime;
+    metrics.tickCount++;
+    metrics.totalDuration += duration;
+    if(duration > metrics.maxDuration)
+        metrics.maxDuration = duration;
+    if(duration > tickDuration)
+        metrics.overrunCount++;
+    size_t bucket = (size_t)(duration / tickDuration * 8);
+    if(bucket >= Metrics::histogramBucketCount)
+        bucket = Metrics::histogramBucketCount - 1;
+    metrics.durationHistogram[bucket]++;
+}
+
+ostream &operator <<(ostream &os, const TickScheduler::Metrics &metrics)
+{
+    os << metrics.tickCount << " ticks : average " << metrics.averageDuration() * 1000 << "ms, 95% within "
+       << metrics.durationPercentile(0.95) * 1000 << "ms, max " << metrics.maxDuration * 1000 << "ms of "
+       << metrics.tickBudget * 1000 << "ms; " << metrics.overrunCount << " overruns, "
+       << metrics.skippedTickCount << " skipped";
+    return os;
+}
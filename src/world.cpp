@@ -55,3 +55,45 @@ BlockData BlockIterator::makeLitAir()
     return retval;
 }
 
+
+thread_local const unordered_map<ChunkPosition, shared_ptr<Chunk>> * World::frozenChunks = nullptr;
+
+void World::getParallelEntities(vector<vector<shared_ptr<EntityData>>> &parallelChunks, vector<shared_ptr<EntityData>> &serialEntities,
+                                unordered_map<ChunkPosition, shared_ptr<Chunk>> &chunks, float deltaTime)
+{
+    lock_guard<recursive_mutex> lockIt(lock);
+    parallelChunks.reserve(entityPartitions.size());
+    for(auto &p : entityPartitions)
+    {
+        vector<shared_ptr<EntityData>> chunkEntities;
+        chunkEntities.reserve(p.second.size());
+        for(shared_ptr<EntityData> e : p.second.slots)
+        {
+            if(e == nullptr)
+                continue;
+            if(!e->good() || !e->desc->canMoveInParallel())
+            {
+                serialEntities.push_back(e);
+                continue;
+            }
+            chunkEntities.push_back(e);
+            // get every chunk the entity could look at while it moves so the tasks don't need lock
+            PositionF position = e->position();
+            float reach = abs(e->velocity()) * deltaTime + abs(gravityVector) * deltaTime * deltaTime + 2;
+            ChunkPosition minChunk((VectorF)position - VectorF(reach), position.d);
+            ChunkPosition maxChunk((VectorF)position + VectorF(reach), position.d);
+            for(int x = minChunk.x; x <= maxChunk.x; x += ChunkSize)
+            {
+                for(int z = minChunk.z; z <= maxChunk.z; z += ChunkSize)
+                {
+                    ChunkPosition cPos(x, z, position.d);
+                    shared_ptr<Chunk> &chunk = chunks[cPos];
+                    if(chunk == nullptr)
+                        chunk = getChunk(cPos);
+                }
+            }
+        }
+        if(!chunkEntities.empty())
+            parallelChunks.push_back(std::move(chunkEntities));
+    }
+}